@@ -23,6 +23,7 @@ static const char rcsid[] = "$Id: acct.c,v 1.14 2004-05-16 21:29:53 ghudson Exp
 #include <sys/types.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include "al.h"
 #include "al_private.h"
 
@@ -37,6 +38,9 @@ static const char rcsid[] = "$Id: acct.c,v 1.14 2004-05-16 21:29:53 ghudson Exp
  * 		- A login session record is created containing the
  * 		  requisite information for reversal of the above
  * 		  steps by al_acct_revert().
+ * 	  If "nss" is set in al.conf(5), the passwd entry and groups
+ * 	  are recorded in the session record for the NSS module to
+ * 	  serve instead of being added to the system files.
  *
  * 	* Unless a login record was already present and indicated that
  * 	  a temporary directory has been created for the user:
@@ -44,7 +48,12 @@ static const char rcsid[] = "$Id: acct.c,v 1.14 2004-05-16 21:29:53 ghudson Exp
  * 		  an invocation of "attach").
  * 	  If the value of havecred is true, the user's home directory
  * 	  is attached with authentication; otherwise the "-n" flag is
- * 	  passed to attach to suppress authentication.
+ * 	  passed to attach to suppress authentication.  If a login
+ * 	  record was present showing that the home directory was
+ * 	  attached (with authentication, if havecred is true), and
+ * 	  the user's passwd entry and home directory are still in
+ * 	  place, neither this step nor the passwd step above is
+ * 	  repeated, unless "fast_create" is set to "no" in al.conf.
  *
  * 	* If the user's home directory is remote and "attach"
  * 	  fails and tmphomedir is true:
@@ -79,8 +88,10 @@ static const char rcsid[] = "$Id: acct.c,v 1.14 2004-05-16 21:29:53 ghudson Exp
 int al_acct_create(const char *username, pid_t sessionpid, int havecred,
 		   int tmphomedir, int **warnings)
 {
-  int retval = AL_SUCCESS, nwarns = 0, warns[6], i, existed;
+  int retval = AL_SUCCESS, nwarns = 0, warns[6], i, pos, existed, set_up;
+  int resumed, pipelined, status;
   struct al_record record;
+  struct al_attach early;
 
   /* If the caller wants warnings, initialize them to NULL so that
    * the caller can easily tell if they were set. */
@@ -101,18 +112,53 @@ int al_acct_create(const char *username, pid_t sessionpid, int havecred,
   existed = record.exists;
   record.exists = 1;
 
+  /* If the user's last logout left the home directory to be detached
+   * later, cancel the detach; the directory may still be in place.
+   */
+  resumed = record.detach_pending;
+  record.detach_pending = 0;
+  record.linger_until = 0;
+
+  /* If the user's account is already fully set up for another session,
+   * checking that it still is suffices; there is no need to look the
+   * user up in Hesiod or run attach again.
+   */
+  set_up = (existed && al__config_bool("fast_create", 1)
+	    && al__homedir_in_place(username, &record, havecred));
+
+  /* In pipelined mode, start attaching the home directory now, so that
+   * attach runs while the passwd and group files are updated.
+   */
+  pipelined = (!set_up && !resumed && al__config_bool("pipeline_attach", 0));
+  if (pipelined)
+    al__start_attach(username, &record, havecred, &early);
+
   /* Add the user to the passwd file if necessary.  Do this even if
    * the record already existed, in case the user was removed from the
    * passwd file since the last login.
    */
-  retval = al__add_to_passwd(username, &record);
-  if (AL_ISWARNING(retval))
-    warns[nwarns++] = retval;
-  else if (retval != AL_SUCCESS)
-    goto cleanup;
+  if (!set_up)
+    {
+      retval = al__add_to_passwd(username, &record);
+      if (AL_ISWARNING(retval))
+	warns[nwarns++] = retval;
+      else if (retval != AL_SUCCESS)
+	goto cleanup;
+    }
 
   if (!existed)			/* We're first interested in this user. */
     {
+      /* A record holding only a pending detach was parsed with empty
+       * arrays, which are replaced here.
+       */
+      free(record.groups);
+      free(record.pids);
+      free(record.starts);
+      record.groups = NULL;
+      record.pids = NULL;
+      record.starts = NULL;
+      record.ngroups = 0;
+
       /* Add the user's groups to the group file if not already there. */
       retval = al__add_to_group(username, &record);
       if (AL_ISWARNING(retval))
@@ -121,32 +167,44 @@ int al_acct_create(const char *username, pid_t sessionpid, int havecred,
 	goto cleanup;
 
       record.pids = malloc(sizeof(pid_t));
-      if (!record.pids)
+      record.starts = malloc(sizeof(unsigned long long));
+      if (!record.pids || !record.starts)
 	{
 	  retval = AL_ENOMEM;
 	  goto cleanup;
 	}
       record.npids = 1;
+      record.maxpids = 1;
       record.pids[0] = sessionpid;
+      record.starts[0] = al__pid_start_time(sessionpid);
     }
   else				/* Other processes also interested in user. */
     {
-      /* Add pid to record if not already there. */
-      for (i = 0; i < record.npids; i++)
-	{
-	  if (record.pids[i] == sessionpid)
-	    break;
-	}
-      /* al__get_session_record() leaves an extra slot in record.pids. */
-      if (i == record.npids)
-	record.pids[record.npids++] = sessionpid;
+      /* Add pid to record if not already there.  If it was there, it
+       * may have been reused, so update its start time.
+       * al__get_session_record() leaves an extra slot in record.pids.
+       */
+      i = al__find_pid(&record, sessionpid, &pos);
+      if (i == -1)
+	al__insert_pid(&record, pos, sessionpid,
+		       al__pid_start_time(sessionpid));
+      else
+	record.starts[i] = al__pid_start_time(sessionpid);
     }
 
-  retval = al__setup_homedir(username, &record, havecred, tmphomedir);
-  if (AL_ISWARNING(retval))
-    warns[nwarns++] = retval;
-  else if (retval != AL_SUCCESS)
-    goto cleanup;
+  if (resumed)
+    set_up = al__homedir_in_place(username, &record, havecred);
+
+  if (!set_up)
+    {
+      retval = al__setup_homedir(username, &record, havecred, tmphomedir,
+				 (pipelined) ? &early : NULL);
+      pipelined = 0;
+      if (AL_ISWARNING(retval))
+	warns[nwarns++] = retval;
+      else if (retval != AL_SUCCESS)
+	goto cleanup;
+    }
 
   /* Set warnings. */
   if (nwarns > 0)
@@ -164,10 +222,53 @@ int al_acct_create(const char *username, pid_t sessionpid, int havecred,
     }
 
 cleanup:
-  al__put_session_record(&record);
+  if (pipelined)
+    al__abandon_attach(&early, &record, havecred);
+
+  /* If the record cannot be written, the new session is not recorded,
+   * so another session's logout could revert the account under it.
+   */
+  status = al__put_session_record(&record);
+  if (status != AL_SUCCESS && (retval == AL_SUCCESS || retval == AL_WARNINGS))
+    {
+      if (warnings && *warnings)
+	{
+	  free(*warnings);
+	  *warnings = NULL;
+	}
+      retval = status;
+    }
   return retval;
 }
 
+/* If "linger" is set in al.conf, a user's account setup is left in
+ * place for that many seconds after the user's last session ends, so
+ * that a user who logs back in meanwhile, as across a session restart,
+ * finds it still set up.  The record keeps its contents, with no pids
+ * and the time the linger ends, and the account is reverted once that
+ * time has passed by whichever cleanup looks at the record next.
+ */
+
+/* This is an internal function.  Its contract is to return true if the
+ * account recorded in record, which has no sessions left, should be
+ * reverted now, or otherwise to start its linger if it has not begun
+ * and return false.
+ */
+int al__should_revert(struct al_record *record)
+{
+  long linger;
+
+  linger = al__config_number("linger", 0);
+  if (linger <= 0)
+    return 1;
+  if (!record->linger_until)
+    {
+      record->linger_until = time(NULL) + linger;
+      return 0;
+    }
+  return time(NULL) >= record->linger_until;
+}
+
 static int revert(const char *username, struct al_record *record)
 {
   int retval, reterr = AL_SUCCESS;
@@ -194,7 +295,8 @@ static int revert(const char *username, struct al_record *record)
  * 	    of pids of active login sessions.
  *
  * 	* If sessionpid was successfully removed from the list, and
- * 	  the list of pids is now empty:
+ * 	  the list of pids is now empty (and has been for "linger"
+ * 	  seconds, if that is set):
  * 	  - All modifications to the passwd and group database
  * 	    effected by calls to al_acct_create() are reverted.
  * 	  - The user's home directory is detached.
@@ -202,7 +304,18 @@ static int revert(const char *username, struct al_record *record)
 
 int al_acct_revert(const char *username, pid_t sessionpid)
 {
-  int retval, i, j;
+  return al__revert_session(username, sessionpid, 0);
+}
+
+/* This is an internal function.  Its contract is to do the work of
+ * al_acct_revert(), but to leave sessionpid in the record if start is
+ * not 0 and the record shows sessionpid starting at a different time,
+ * that is, if the pid has since been reused for another session.
+ */
+int al__revert_session(const char *username, pid_t sessionpid,
+		       unsigned long long start)
+{
+  int retval, i, pos;
   struct al_record record;
 
   if (!al__username_valid(username))
@@ -218,17 +331,14 @@ int al_acct_revert(const char *username, pid_t sessionpid)
 
   if (record.exists)
     {
-      /* Copy record.pids to itself, eliminating occurances of sessionpid. */
-      j = 0;
-      for (i = 0; i < record.npids; i++)
-	{
-	  if (record.pids[i] != sessionpid)
-	    record.pids[j++] = record.pids[i];
-	}
-      record.npids = j;
+      /* Remove sessionpid unless it now belongs to another session. */
+      i = al__find_pid(&record, sessionpid, &pos);
+      if (i != -1
+	  && (!start || !record.starts[i] || record.starts[i] == start))
+	al__remove_pid(&record, i);
 
       /* Revert the account if we emptied out the pid list. */
-      if (record.npids == 0)
+      if (record.npids == 0 && al__should_revert(&record))
 	revert(username, &record);
     }
 
@@ -239,9 +349,12 @@ int al_acct_revert(const char *username, pid_t sessionpid)
  *
  * 	* If a login record for the user exists:
  * 	  - All pids in the login record are checked for existence and
- * 	    the ones which don't exist are removed from the list.
+ * 	    the ones which don't exist, or which have been reused by a
+ * 	    process started after the login session, are removed from
+ * 	    the list.
  *
- * 	* If the list of pids was emptied by the above operation:
+ * 	* If the list of pids was emptied by the above operation (and
+ * 	  has been empty for "linger" seconds, if that is set):
  * 	  - All modifications to the passwd and group database
  * 	    effected by calls to al_acct_create() are reverted.
  * 	  - The user's home directory is detached.
@@ -265,17 +378,22 @@ int al_acct_cleanup(const char *username)
 
   if (record.exists)
     {
-      /* Copy record.pids to itself, eliminating pids which don't exist. */
+      /* Copy record.pids to itself, eliminating pids which don't exist
+       * or which now belong to a process other than the login session.
+       */
       j = 0;
       for (i = 0; i < record.npids; i++)
 	{
-	  if (kill(record.pids[i], 0) == 0)
-	    record.pids[j++] = record.pids[i];
+	  if (al__pid_alive(record.pids[i], record.starts[i]))
+	    {
+	      record.starts[j] = record.starts[i];
+	      record.pids[j++] = record.pids[i];
+	    }
 	}
       record.npids = j;
 
       /* Revert the account if we emptied out the pid list. */
-      if (record.npids == 0)
+      if (record.npids == 0 && al__should_revert(&record))
 	revert(username, &record);
     }
 
@@ -0,0 +1,230 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements
+ * limiting the number of attach and detach processes run at once.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "al.h"
+#include "al_private.h"
+
+extern char *al__session_dir;
+
+/* When many users log in at once, as after a file server outage, the
+ * attaches they start compete for the file servers and for the local
+ * kernel.  Setting "attach_limit" in al.conf bounds the number of
+ * attach and detach processes run at once by all the processes on the
+ * machine, with later arrivals waiting their turn in order of arrival.
+ *
+ * The limit is kept with fcntl locks on a file in the session
+ * directory, so that a process which dies releases everything it
+ * held.  The file holds a header with two ticket numbers: the next to
+ * be handed out, and the oldest which may still be waiting.  A process
+ * takes a ticket, and marks itself as waiting by locking the byte at
+ * TICKET_BASE plus its ticket modulo MAX_WAITERS.  Only the waiter with
+ * the oldest ticket still marked tries to take a slot, by locking one
+ * of the bytes at SLOT_BASE, so slots are granted in ticket order.
+ * The header is read and updated with its first byte locked.
+ */
+
+#define ADMIT_FILE		".admission"
+#define ADMIT_MAGIC		"ALAD"
+#define SLOT_BASE		1024
+#define TICKET_BASE		65536
+#define MAX_WAITERS		65536
+
+/* Longest pause between attempts to take a slot, in microseconds. */
+#define ADMIT_POLL_MAX		50000
+
+struct admit_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t next_ticket;
+  uint32_t head;
+};
+
+/* Outside threads mode, each process keeps the file open once for all
+ * its admissions, since closing any descriptor for the file would
+ * release the process's locks on it.  The descriptor is not passed on
+ * to attach and detach, which would otherwise share open file
+ * description locks taken in threads mode.
+ */
+static int admit_fd = -1;
+
+static int open_admit_file(void)
+{
+  char *path;
+  int fd;
+
+  if (!al__threaded() && admit_fd != -1)
+    return admit_fd;
+  path = malloc(strlen(al__session_dir) + sizeof(ADMIT_FILE) + 1);
+  if (!path)
+    return -1;
+  sprintf(path, "%s/%s", al__session_dir, ADMIT_FILE);
+  fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+  free(path);
+  if (fd != -1 && !al__threaded())
+    admit_fd = fd;
+  return fd;
+}
+
+/* Read the header of the file open on fd, whose first byte the caller
+ * has locked, initializing it if the file is new.  Return 0 on success
+ * or -1 on failure.
+ */
+static int read_header(int fd, struct admit_header *hdr)
+{
+  ssize_t len;
+
+  len = pread(fd, hdr, sizeof(*hdr), 0);
+  if (len == 0)
+    {
+      memset(hdr, 0, sizeof(*hdr));
+      memcpy(hdr->magic, ADMIT_MAGIC, sizeof(hdr->magic));
+      hdr->version = 1;
+      return 0;
+    }
+  if (len != sizeof(*hdr)
+      || memcmp(hdr->magic, ADMIT_MAGIC, sizeof(hdr->magic)) != 0)
+    return -1;
+  return 0;
+}
+
+static off_t ticket_offset(uint32_t ticket)
+{
+  return TICKET_BASE + ticket % MAX_WAITERS;
+}
+
+/* This is an internal function.  Its contract is to wait until fewer
+ * than "attach_limit" attach and detach processes are running on the
+ * machine, and to record in adm a place for one more, to be given up
+ * with al__admission_leave() once the process has been reaped.  If no
+ * limit is set, or the limit cannot be kept because the admission file
+ * is unusable, it returns at once without waiting.  Time spent waiting
+ * is recorded in the statistics.
+ */
+void al__admission_enter(struct al_admission *adm)
+{
+  struct admit_header hdr;
+  struct timeval begin, now;
+  uint32_t ticket;
+  long limit, pause = 1000, waited;
+  int fd, i, marked = 0, waiting = 0;
+
+  adm->fd = -1;
+  adm->slot = -1;
+  limit = al__config_number("attach_limit", 0);
+  if (limit <= 0)
+    return;
+  fd = open_admit_file();
+  if (fd == -1)
+    return;
+
+  /* Take a ticket and mark it as waiting. */
+  if (al__lock_fd(fd, 0, 1, F_WRLCK, 1) == -1 || read_header(fd, &hdr) == -1)
+    goto fail;
+  ticket = hdr.next_ticket++;
+  if (al__lock_fd(fd, ticket_offset(ticket), 1, F_WRLCK, 0) == -1)
+    goto fail;
+  marked = 1;
+  if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    goto fail;
+  al__lock_fd(fd, 0, 1, F_UNLCK, 0);
+
+  while (1)
+    {
+      if (al__lock_fd(fd, 0, 1, F_WRLCK, 1) == -1
+	  || read_header(fd, &hdr) == -1)
+	goto fail;
+
+      /* Skip tickets whose holders have stopped waiting or died. */
+      while (hdr.head != ticket
+	     && !al__lock_held(fd, ticket_offset(hdr.head), 1))
+	hdr.head++;
+
+      if (hdr.head == ticket)
+	{
+	  for (i = 0; i < limit; i++)
+	    {
+	      if (al__lock_fd(fd, SLOT_BASE + i, 1, F_WRLCK, 0) == 0)
+		break;
+	    }
+	  if (i < limit)
+	    {
+	      hdr.head++;
+	      pwrite(fd, &hdr, sizeof(hdr), 0);
+	      al__lock_fd(fd, ticket_offset(ticket), 1, F_UNLCK, 0);
+	      al__lock_fd(fd, 0, 1, F_UNLCK, 0);
+	      adm->fd = fd;
+	      adm->slot = i;
+	      break;
+	    }
+	}
+      pwrite(fd, &hdr, sizeof(hdr), 0);
+      al__lock_fd(fd, 0, 1, F_UNLCK, 0);
+
+      if (!waiting)
+	{
+	  waiting = 1;
+	  gettimeofday(&begin, NULL);
+	}
+      usleep(pause);
+      pause = (pause * 2 > ADMIT_POLL_MAX) ? ADMIT_POLL_MAX : pause * 2;
+    }
+
+  al__stat_add(AL__STAT_ADMISSIONS, 1);
+  if (waiting)
+    {
+      gettimeofday(&now, NULL);
+      waited = (now.tv_sec - begin.tv_sec) * 1000000
+	+ (now.tv_usec - begin.tv_usec);
+      al__stat_add(AL__STAT_ADMISSION_WAITS, 1);
+      al__stat_add(AL__STAT_ADMISSION_WAIT_USEC, waited);
+      al__stat_max(AL__STAT_ADMISSION_WAIT_MAX_USEC, waited);
+    }
+  return;
+
+fail:
+  if (marked)
+    al__lock_fd(fd, ticket_offset(ticket), 1, F_UNLCK, 0);
+  al__lock_fd(fd, 0, 1, F_UNLCK, 0);
+  if (al__threaded())
+    close(fd);
+}
+
+/* This is an internal function.  Its contract is to give up the place
+ * recorded in adm by al__admission_enter().
+ */
+void al__admission_leave(struct al_admission *adm)
+{
+  if (adm->slot == -1)
+    return;
+  al__lock_fd(adm->fd, SLOT_BASE + adm->slot, 1, F_UNLCK, 0);
+  if (al__threaded())
+    close(adm->fd);
+  adm->slot = -1;
+}
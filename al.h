@@ -37,15 +37,50 @@
 #define AL_EPERM		10
 #define AL_ENOENT		11
 #define AL_ENOMEM		12
+#define AL_ELOCKTIMEOUT		19
 
 /* Warning values */
-#define AL_ISWARNING(n) 	(AL_WBADSESSION <= (n) && (n) <= AL_WNOATTACH)
+#define AL_ISWARNING(n) 	((AL_WBADSESSION <= (n) && (n) <= AL_WNOATTACH) \
+				 || (AL_WATTACHTIMEOUT <= (n) \
+				     && (n) <= AL_WATTACHSKIPPED))
 #define AL_WBADSESSION		13
 #define AL_WGROUP		14
 #define AL_WXTMPDIR		15
 #define AL_WTMPDIR		16
 #define AL_WNOHOMEDIR		17
 #define AL_WNOATTACH		18
+#define AL_WATTACHTIMEOUT	20
+#define AL_WATTACHSKIPPED	21
+
+/* Session information returned by al_session_query() */
+struct al_session {
+  int exists;			/* User has an active session */
+  int passwd_added;		/* A passwd entry was added for the user */
+  int attached;			/* The home directory was attached */
+  char *old_homedir;		/* Home directory before a temporary one */
+  gid_t *groups;		/* Groups the user was added to */
+  int ngroups;
+  pid_t *pids;			/* Pids of the user's login sessions */
+  int npids;
+};
+
+/* Statistics returned by al_get_stats() */
+struct al_stats {
+  unsigned long long lock_acquires;	/* Session record locks taken */
+  unsigned long long lock_waits;	/* Locks which had to wait */
+  unsigned long long lock_wait_usec;	/* Total time spent waiting */
+  unsigned long long lock_wait_max_usec; /* Longest wait */
+  unsigned long long lock_timeouts;	/* Waits which hit lock_timeout */
+  unsigned long long admissions;	/* Attaches and detaches admitted */
+  unsigned long long admission_waits;	/* Admissions which had to wait */
+  unsigned long long admission_wait_usec; /* Total time spent waiting */
+  unsigned long long admission_wait_max_usec; /* Longest wait */
+  unsigned long long spawns;		/* Helper programs started */
+  unsigned long long spawn_usec;	/* Total time spent starting them */
+  unsigned long long spawn_max_usec;	/* Longest time to start one */
+};
+
+struct al_reaper;
 
 /* Public functions */
 int al_login_allowed(const char *username, int isremote, int *local_acct,
@@ -54,9 +89,18 @@ int al_acct_create(const char *username, pid_t sessionpid, int havecred,
 		   int tmphomedir, int **warnings);
 int al_acct_revert(const char *username, pid_t sessionpid);
 int al_acct_cleanup(const char *username);
+int al_acct_cleanup_all(void);
 const char *al_strerror(int code, char **mem);
 void al_free_errmem(char *mem);
 int al_get_access(const char *username, char **access, char **text);
 int al_is_local_acct(const char *username);
+int al_session_query(const char *username, struct al_session *session);
+void al_free_session(struct al_session *session);
+int al_reaper_open(struct al_reaper **reaper);
+int al_reaper_fd(struct al_reaper *reaper);
+int al_reaper_run(struct al_reaper *reaper, int timeout);
+void al_reaper_close(struct al_reaper *reaper);
+int al_get_stats(struct al_stats *stats);
+int al_tmphome_refill(void);
 
 #endif
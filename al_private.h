@@ -24,6 +24,7 @@
 
 #define PATH_SESSIONS		AL_PATH_SESSIONS
 #define PATH_TMPDIRS		"/var/athena/tmphomedir"
+#define PATH_TMPPOOL		PATH_TMPDIRS "/.pool"
 #define PATH_TMPPROTO		"/usr/athena/lib/prototype_tmpuser"
 #define PATH_ATTACH		"/bin/athena/attach"
 #define PATH_DETACH		"/bin/athena/detach"
@@ -33,21 +34,18 @@
 #define PATH_NOREMOTE		"/etc/noremote"
 #define PATH_NOCREATE		"/etc/nocreate"
 #define PATH_NOATTACH		"/etc/noattach"
+#define PATH_CONFIG		"/etc/athena/al.conf"
+#define PATH_PROC		"/proc"
 
 #define PATH_GROUP		"/etc/group"
 #define PATH_GROUP_TMP		"/etc/gtmp"
 #define PATH_GROUP_LOCAL	"/etc/group.local"
 #define PATH_GROUP_LOCK		"/var/athena/group.lock"
-#ifdef HAVE_MASTER_PASSWD
-#define PATH_PASSWD		"/etc/master.passwd"
-#else
 #define PATH_PASSWD		"/etc/passwd"
-#endif
+#define PATH_MASTER_PASSWD	"/etc/master.passwd"
 #define PATH_PASSWD_TMP		"/etc/ptmp"
-#ifdef HAVE_SHADOW
 #define PATH_SHADOW		"/etc/shadow"
 #define PATH_SHADOW_TMP		"/etc/stmp"
-#endif
 
 /* The gid of the lowest-numbered group for which a group membership
  * may be added based on hesiod information. The low-numbered groups
@@ -58,43 +56,227 @@
 struct passwd;
 
 struct al_record {
-  FILE *fp;
+  int fd;			/* locked record file (files store, or db
+				 * store in threads mode) */
+  int slot;			/* locked slot (db store) */
+  int threaded;			/* mask is this thread's; SIGCHLD untouched */
   sigset_t mask;
   struct sigaction sigchld_action;
+  int cache;			/* record cache entry claimed, or -1 */
+  unsigned int cache_ticket;
+  unsigned int generation;	/* incremented each time record is written */
+  unsigned int checksum;
   int exists;
   int passwd_added;
   int attached;
+  int authenticated;		/* attached with the user's credentials */
+  int detach_pending;		/* detach left for cleanup to run */
+  uid_t detach_uid;		/* ids to run the pending detach as */
+  gid_t detach_gid;
+  time_t linger_until;		/* end of linger after last session, or 0 */
   char *old_homedir;
   gid_t *groups;
   int ngroups;
   pid_t *pids;
+  unsigned long long *starts;	/* start times of pids, 0 if unknown */
   int npids;
+  int maxpids;			/* room in pids and starts */
+  char *nss_passwd;		/* passwd line served by the NSS module */
+  char *nss_groups;		/* name:gid: list served by the NSS module */
+};
+
+/* A passwd database backend.  Lookups return an allocated entry to be
+ * freed with al__free_passwd().  Edits are made within a transaction:
+ * lock() locks the database and returns a transaction handle (or NULL
+ * on failure), add(), remove(), and change_homedir() queue edits, and
+ * commit() applies them and releases the lock, or abort() discards
+ * them.  Either of the latter frees the handle.
+ */
+struct al_pwbackend {
+  const char *name;
+  struct passwd *(*getpwnam)(const char *username);
+  struct passwd *(*getpwuid)(uid_t uid);
+  void *(*lock)(void);
+  int (*add)(void *txn, const struct passwd *pwd);
+  int (*remove)(void *txn, const char *username);
+  int (*change_homedir)(void *txn, const char *username,
+			const char *homedir);
+  int (*commit)(void *txn);
+  void (*abort)(void *txn);
+};
+
+/* A session record store.  get() locks username's record and reads it
+ * into record, releasing everything if it fails with AL_ESESSION,
+ * AL_ENOMEM, or AL_ELOCKTIMEOUT; put() writes record back (or empties it if
+ * record->exists is not set) and releases the lock.  snapshot() reads
+ * a record without locking it.  iter_open(), iter_next(), and
+ * iter_close() enumerate the usernames which may have records.
+ */
+struct al_sessstore {
+  const char *name;
+  int (*exists)(const char *username);
+  int (*get)(const char *username, struct al_record *record);
+  int (*snapshot)(const char *username, struct al_record *record);
+  int (*put)(struct al_record *record);
+  void *(*iter_open)(void);
+  const char *(*iter_next)(void *iter);
+  void (*iter_close)(void *iter);
 };
 
+/* acct.c */
+int al__should_revert(struct al_record *record);
+int al__revert_session(const char *username, pid_t sessionpid,
+		       unsigned long long start);
+
+/* cleanup.c */
+int al__cleanup_deferred(time_t *next_linger);
+
 /* session.c */
+extern const struct al_sessstore al__files_store;
+const struct al_sessstore *al__sessstore(void);
+char *al__session_path(const char *username);
 int al__record_exists(const char *username);
+int al__parse_session_record(char *buf, size_t len, struct al_record *record);
+char *al__encode_session_record(struct al_record *record, size_t *len);
+int al__cached_session_record(const char *username, const char *buf,
+			      size_t len, struct al_record *record);
 int al__get_session_record(const char *username, struct al_record *record);
+int al__snapshot_session_record(const char *username,
+				struct al_record *record);
 int al__put_session_record(struct al_record *record);
+void al__free_record(struct al_record *record);
+int al__find_pid(struct al_record *record, pid_t pid, int *pos);
+void al__insert_pid(struct al_record *record, int pos, pid_t pid,
+		    unsigned long long start);
+void al__remove_pid(struct al_record *record, int i);
+void *al__session_iter_open(void);
+const char *al__session_iter_next(void *iter);
+void al__session_iter_close(void *iter);
+int al__shard_sessions(void);
+int al__lock_record(int fd, off_t start, off_t len);
+int al__set_uid_index(uid_t uid, const char *username);
+void al__clear_uid_index(uid_t uid);
+char *al__lookup_uid_index(uid_t uid);
+int al__next_group(const char **p, char **name, gid_t *gid);
+int al__set_group_index(const char *username, const char *groups);
+void al__clear_group_index(const char *username, const char *groups);
+int al__lookup_group_index(const char *name, gid_t *gid);
+char **al__group_index_members(gid_t gid, int *n);
+void *al__group_iter_open(void);
+const char *al__group_iter_next(void *iter);
+void al__group_iter_close(void *iter);
+
+/* sessdb.c */
+extern const struct al_sessstore al__db_store;
 
 /* passwd.c */
+const struct al_pwbackend *al__pwbackend(void);
+struct passwd *al__getpwnam(const char *username);
+struct passwd *al__getpwuid(uid_t uid);
 int al__add_to_passwd(const char *username, struct al_record *record);
 int al__remove_from_passwd(const char *username, struct al_record *record);
-int al__change_passwd_homedir(const char *username, const char *homedir);
+int al__change_passwd_homedir(const char *username, struct al_record *record,
+			      const char *homedir);
+int al__revert_users_passwd(const char **usernames,
+			    struct al_record **records, int n);
+struct passwd *al__session_getpwnam(const char *username,
+				    struct al_record *record);
+struct passwd *al__parse_passwd_line(const char *line);
+
+/* pwfiles.c */
+extern const struct al_pwbackend al__passwd_backend;
+extern const struct al_pwbackend al__shadow_backend;
+#ifdef HAVE_MASTER_PASSWD
+extern const struct al_pwbackend al__master_backend;
+#endif
+
+/* pwmem.c */
+extern const struct al_pwbackend al__memory_backend;
 
 /* group.c */
 int al__add_to_group(const char *username, struct al_record *record);
 int al__remove_from_group(const char *username, struct al_record *record);
+int al__remove_users_from_group(const char **usernames,
+				struct al_record **records, int n);
+
+/* admit.c */
+struct al_admission {
+  int fd;
+  int slot;			/* Slot held, or -1 if none */
+};
+void al__admission_enter(struct al_admission *adm);
+void al__admission_leave(struct al_admission *adm);
+
+/* spawn.c */
+#define AL__SPAWN_PGROUP	0x1	/* Lead a new process group */
+#define AL__SPAWN_SETID		0x2	/* Run as the given uid and gid */
+pid_t al__spawn(const char *path, char *const argv[], int flags, uid_t uid,
+		gid_t gid);
 
 /* homedir.c */
+struct al_attach {
+  pid_t pid;			/* attach started early, or 0 */
+  int skipped;			/* attach skipped by the breaker */
+  char *key;			/* file server key for the breaker */
+  struct al_admission adm;
+};
+void al__start_attach(const char *username, struct al_record *record,
+		      int havecred, struct al_attach *att);
+void al__abandon_attach(struct al_attach *att, struct al_record *record,
+			int havecred);
 int al__setup_homedir(const char *username, struct al_record *record,
-		      int havecred, int tmphomedir);
+		      int havecred, int tmphomedir, struct al_attach *early);
+int al__homedir_in_place(const char *username, struct al_record *record,
+			 int havecred);
 int al__revert_homedir(const char *username, struct al_record *record);
+int al__start_detach(const char *username, struct al_record *record,
+		     pid_t *pid);
+
+/* breaker.c */
+char *al__attach_key(const char *username);
+int al__attach_allowed(const char *key);
+void al__attach_result(const char *key, int success);
+
+/* tmphome.c */
+int al__copy_prototype(const char *proto, const char *dest, uid_t uid,
+		       gid_t gid);
+int al__claim_tmphome(const char *dest, uid_t uid, gid_t gid);
+int al__remove_tree(int dirfd, const char *name);
+
+/* stats.c; statistics are kept in this order in the statistics file */
+#define AL__STAT_LOCK_ACQUIRES		0
+#define AL__STAT_LOCK_WAITS		1
+#define AL__STAT_LOCK_WAIT_USEC		2
+#define AL__STAT_LOCK_WAIT_MAX_USEC	3
+#define AL__STAT_LOCK_TIMEOUTS		4
+#define AL__STAT_ADMISSIONS		5
+#define AL__STAT_ADMISSION_WAITS	6
+#define AL__STAT_ADMISSION_WAIT_USEC	7
+#define AL__STAT_ADMISSION_WAIT_MAX_USEC 8
+#define AL__STAT_SPAWNS			9
+#define AL__STAT_SPAWN_USEC		10
+#define AL__STAT_SPAWN_MAX_USEC		11
+#define AL__NSTATS			12
+void al__stat_add(int stat, unsigned long long n);
+void al__stat_max(int stat, unsigned long long n);
+
+/* config.c */
+extern char *al__config_file;
+const char *al__config_string(const char *name);
+long al__config_number(const char *name, long defval);
+int al__config_bool(const char *name, int defval);
 
 /* util.c */
-struct passwd *al__getpwnam(const char *username);
-struct passwd *al__getpwuid(uid_t uid);
 void al__free_passwd(struct passwd *pwd);
 int al__read_line(FILE *fp, char **buf, int *bufsize);
 int al__username_valid(const char *username);
+unsigned int al__hash_name(const char *username);
+unsigned long long al__pid_start_time(pid_t pid);
+int al__pid_alive(pid_t pid, unsigned long long start);
+int al__threaded(void);
+int al__lock_fd(int fd, off_t start, off_t len, int type, int wait);
+int al__lock_held(int fd, off_t start, off_t len);
+int al__lock_owned(int fd);
+int al__sync_fd(int fd);
 
 #endif
@@ -0,0 +1,263 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements
+ * skipping attaches from file servers which keep failing.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <hesiod.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "al.h"
+#include "al_private.h"
+
+extern char *al__session_dir;
+
+/* When a file server goes down, every login of a user whose home
+ * directory it holds would wait for attach to fail.  Once
+ * "attach_breaker_failures" attaches from a server have failed in a
+ * row, attaches from it are skipped for "attach_breaker_cooldown"
+ * seconds, and users go straight to temporary home directories.  When
+ * the cooldown ends, the next login tries an attach as a probe, with
+ * the cooldown renewed so that other logins keep skipping meanwhile;
+ * if the probe succeeds, attaches resume.
+ *
+ * The outcomes are kept in a file in the session directory, shared by
+ * every process, holding a header followed by BREAKER_SLOTS entries,
+ * each found by hashing the server's key and probing onwards.  An
+ * entry with no failures counted may be reused for another key.  The
+ * file is locked while an entry is read and updated.
+ */
+
+#define BREAKER_FILE		".breakers"
+#define BREAKER_MAGIC		"ALBR"
+#define BREAKER_SLOTS		256
+#define BREAKER_KEY_MAX		119
+#define DEFAULT_COOLDOWN	60
+
+struct breaker_header {
+  char magic[4];
+  uint32_t version;
+};
+
+struct breaker_entry {
+  char key[BREAKER_KEY_MAX + 1];
+  uint32_t failures;		/* Consecutive failed attaches */
+  uint32_t pad;
+  uint64_t open_until;		/* Skip attaches until this time */
+};
+
+#define ENTRY_OFFSET(i) \
+	((off_t) sizeof(struct breaker_header) \
+	 + (off_t) (i) * sizeof(struct breaker_entry))
+
+/* Open and lock the breaker file, creating it if necessary.  Return
+ * the descriptor, or -1 if the file cannot be used.
+ */
+static int open_breakers(void)
+{
+  struct breaker_header hdr;
+  char *path;
+  int fd;
+  ssize_t len;
+
+  path = malloc(strlen(al__session_dir) + sizeof(BREAKER_FILE) + 1);
+  if (!path)
+    return -1;
+  sprintf(path, "%s/%s", al__session_dir, BREAKER_FILE);
+  fd = open(path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+  free(path);
+  if (fd == -1)
+    return -1;
+  if (al__lock_fd(fd, 0, 0, F_WRLCK, 1) == -1)
+    {
+      close(fd);
+      return -1;
+    }
+
+  len = pread(fd, &hdr, sizeof(hdr), 0);
+  if (len == 0)
+    {
+      memcpy(hdr.magic, BREAKER_MAGIC, sizeof(hdr.magic));
+      hdr.version = 1;
+      if (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+	  && ftruncate(fd, ENTRY_OFFSET(BREAKER_SLOTS)) == 0)
+	return fd;
+    }
+  else if (len == sizeof(hdr)
+	   && memcmp(hdr.magic, BREAKER_MAGIC, sizeof(hdr.magic)) == 0)
+    return fd;
+  close(fd);
+  return -1;
+}
+
+/* Find key's entry in the breaker file open on fd, reading it into
+ * entry and returning its index.  If there is none, return the index
+ * of a free entry, with entry cleared and given the key, or -1 if the
+ * table is full.
+ */
+static int find_entry(int fd, const char *key, struct breaker_entry *entry)
+{
+  int i, n, free_slot = -1;
+
+  i = al__hash_name(key) % BREAKER_SLOTS;
+  for (n = 0; n < BREAKER_SLOTS; n++, i = (i + 1) % BREAKER_SLOTS)
+    {
+      if (pread(fd, entry, sizeof(*entry), ENTRY_OFFSET(i))
+	  != sizeof(*entry))
+	return -1;
+      if (strncmp(entry->key, key, sizeof(entry->key)) == 0)
+	return i;
+      if (free_slot == -1 && entry->failures == 0)
+	free_slot = i;
+      if (!entry->key[0])
+	break;
+    }
+  if (free_slot == -1)
+    return -1;
+  memset(entry, 0, sizeof(*entry));
+  strncpy(entry->key, key, BREAKER_KEY_MAX);
+  return free_slot;
+}
+
+/* This is an internal function.  Its contract is to return an
+ * allocated key naming the file server holding username's home
+ * directory, from the user's first Hesiod filsys entry, or NULL if
+ * there is none or attach breaking is not enabled.  For NFS lockers
+ * the key is the server's name; for others, such as AFS lockers, which
+ * name no server, it is the directory containing the locker.
+ */
+char *al__attach_key(const char *username)
+{
+  void *hescontext;
+  char **filsys, *key = NULL, *name = NULL, *p;
+  char type[16], path[BREAKER_KEY_MAX + 1], server[BREAKER_KEY_MAX + 1];
+  int n;
+
+  if (al__config_number("attach_breaker_failures", 0) <= 0)
+    return NULL;
+  if (hesiod_init(&hescontext) != 0)
+    return NULL;
+  filsys = hesiod_resolve(hescontext, username, "filsys");
+  if (filsys && filsys[0])
+    {
+      n = sscanf(filsys[0], "%15s %119s %119s", type, path, server);
+      if (n == 3 && strcmp(type, "NFS") == 0)
+	name = server;
+      else if (n >= 2)
+	{
+	  p = strrchr(path, '/');
+	  if (p && p != path)
+	    *p = 0;
+	  name = path;
+	}
+      if (name)
+	{
+	  /* Keys are truncated to fit in the breaker file. */
+	  key = malloc(strlen(type) + strlen(name) + 2);
+	  if (key)
+	    {
+	      sprintf(key, "%s:%s", type, name);
+	      if (strlen(key) > BREAKER_KEY_MAX)
+		key[BREAKER_KEY_MAX] = 0;
+	    }
+	}
+    }
+  if (filsys)
+    hesiod_free_list(hescontext, filsys);
+  hesiod_end(hescontext);
+  return key;
+}
+
+/* This is an internal function.  Its contract is to return true if an
+ * attach from the server named by key should be attempted, either
+ * because its attaches have not been failing or because the caller's
+ * attach is to serve as a probe.
+ */
+int al__attach_allowed(const char *key)
+{
+  struct breaker_entry entry;
+  time_t now;
+  long threshold, cooldown;
+  int fd, i, allowed = 1;
+
+  threshold = al__config_number("attach_breaker_failures", 0);
+  if (!key || threshold <= 0)
+    return 1;
+  cooldown = al__config_number("attach_breaker_cooldown", DEFAULT_COOLDOWN);
+
+  fd = open_breakers();
+  if (fd == -1)
+    return 1;
+  i = find_entry(fd, key, &entry);
+  if (i != -1 && entry.failures >= threshold)
+    {
+      now = time(NULL);
+      if ((uint64_t) now < entry.open_until)
+	allowed = 0;
+      else
+	{
+	  /* Let this attach probe the server, holding off others. */
+	  entry.open_until = now + cooldown;
+	  pwrite(fd, &entry, sizeof(entry), ENTRY_OFFSET(i));
+	}
+    }
+  close(fd);
+  return allowed;
+}
+
+/* This is an internal function.  Its contract is to record the
+ * outcome of an attach from the server named by key, opening the
+ * breaker for the server after "attach_breaker_failures" failures in
+ * a row and closing it after a success.
+ */
+void al__attach_result(const char *key, int success)
+{
+  struct breaker_entry entry;
+  long threshold, cooldown;
+  int fd, i;
+
+  threshold = al__config_number("attach_breaker_failures", 0);
+  if (!key || threshold <= 0)
+    return;
+  cooldown = al__config_number("attach_breaker_cooldown", DEFAULT_COOLDOWN);
+
+  fd = open_breakers();
+  if (fd == -1)
+    return;
+  i = find_entry(fd, key, &entry);
+  if (i != -1 && (!success || entry.failures != 0))
+    {
+      if (success)
+	{
+	  entry.failures = 0;
+	  entry.open_until = 0;
+	}
+      else if (++entry.failures >= threshold)
+	entry.open_until = time(NULL) + cooldown;
+      pwrite(fd, &entry, sizeof(entry), ENTRY_OFFSET(i));
+    }
+  close(fd);
+}
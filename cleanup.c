@@ -0,0 +1,368 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements a
+ * function to clean up the accounts of every user with stale login
+ * sessions at once.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "al.h"
+#include "al_private.h"
+
+/* Users are cleaned up this many at a time, which bounds the number
+ * of session records held locked and the size of each coalesced passwd
+ * and group update.
+ */
+#define CLEANUP_BATCH		32
+
+/* Default number of detach processes to run at once. */
+#define DEFAULT_WORKERS		4
+
+struct pidset {
+  pid_t *pids;			/* Sorted */
+  int npids;
+  int valid;
+};
+
+static void snapshot_pids(struct pidset *set);
+static int pid_alive(struct pidset *set, pid_t pid,
+		     unsigned long long start);
+static int compare_pids(const void *a, const void *b);
+static int cleanup_users(struct pidset *live, time_t *next_linger);
+static int cleanup_batch(char **usernames, int n, struct pidset *live);
+static int run_detaches(const char **usernames, struct al_record **records,
+			int n);
+
+/* The al_acct_cleanup_all() function has the same effect as calling
+ * al_acct_cleanup() for every user with a session record, but:
+ *
+ * 	* The set of running processes is read once from /proc, rather
+ * 	  than testing each pid with kill().
+ *
+ * 	* Records are first read without locking, and only those
+ * 	  listing a process which has exited are locked and updated.
+ *
+ * 	* Home directories of users whose last session has ended are
+ * 	  detached by several processes at once, and their passwd and
+ * 	  group database changes are undone with one update of each
+ * 	  database per batch of users.
+ *
+ * It also runs the detaches left pending by logouts when
+ * "deferred_detach" is set (see al__revert_homedir()), and reverts the
+ * accounts of users whose linger has ended (see al__should_revert()).
+ */
+
+int al_acct_cleanup_all(void)
+{
+  struct pidset live;
+  int retval;
+
+  snapshot_pids(&live);
+  retval = cleanup_users(&live, NULL);
+  free(live.pids);
+  return retval;
+}
+
+/* This is an internal function.  Its contract is to run the detaches
+ * left pending by logouts and revert the accounts whose linger has
+ * ended, without looking for sessions which have ended.  It sets
+ * *next_linger to the time the next linger ends, or 0 if none is
+ * under way.
+ */
+int al__cleanup_deferred(time_t *next_linger)
+{
+  return cleanup_users(NULL, next_linger);
+}
+
+/* Clean up the users whose records list a process not in live (unless
+ * live is NULL), have a detach pending, or have lingered long enough.
+ * If next_linger is not NULL, set it to the time the next linger ends,
+ * or 0 if none is under way.
+ */
+static int cleanup_users(struct pidset *live, time_t *next_linger)
+{
+  struct al_record record;
+  void *iter;
+  const char *username;
+  char **usernames = NULL, **newusernames;
+  time_t now = time(NULL);
+  int nusers = 0, i, stale, retval, reterr = AL_SUCCESS;
+
+  if (next_linger)
+    *next_linger = 0;
+  iter = al__session_iter_open();
+  if (!iter)
+    return AL_ESESSION;
+  while ((username = al__session_iter_next(iter)) != NULL)
+    {
+      if (al__snapshot_session_record(username, &record) != AL_SUCCESS)
+	continue;
+      stale = record.detach_pending;
+      if (record.exists && record.npids == 0 && record.linger_until)
+	{
+	  if (record.linger_until <= now)
+	    stale = 1;
+	  else if (next_linger && (!*next_linger
+				   || record.linger_until < *next_linger))
+	    *next_linger = record.linger_until;
+	}
+      for (i = 0; live && i < record.npids && !stale; i++)
+	stale = !pid_alive(live, record.pids[i], record.starts[i]);
+      al__free_record(&record);
+      if (!stale)
+	continue;
+
+      newusernames = realloc(usernames, (nusers + 1) * sizeof(char *));
+      if (!newusernames)
+	{
+	  reterr = AL_ENOMEM;
+	  break;
+	}
+      usernames = newusernames;
+      usernames[nusers] = strdup(username);
+      if (!usernames[nusers])
+	{
+	  reterr = AL_ENOMEM;
+	  break;
+	}
+      nusers++;
+    }
+  al__session_iter_close(iter);
+
+  for (i = 0; i < nusers; i += CLEANUP_BATCH)
+    {
+      retval = cleanup_batch(usernames + i, (nusers - i < CLEANUP_BATCH)
+			     ? nusers - i : CLEANUP_BATCH, live);
+      if (retval != AL_SUCCESS)
+	reterr = retval;
+    }
+
+  for (i = 0; i < nusers; i++)
+    free(usernames[i]);
+  free(usernames);
+  return reterr;
+}
+
+/* Lock the records of the n users in usernames, remove the pids which
+ * no longer exist (unless live is NULL), and revert the accounts of
+ * those left with none once they have lingered long enough.  Run the
+ * detaches pending in the records too.
+ */
+static int cleanup_batch(char **usernames, int n, struct pidset *live)
+{
+  struct al_record records[CLEANUP_BATCH], *reverting[CLEANUP_BATCH];
+  struct al_record *detaching[CLEANUP_BATCH];
+  const char *revnames[CLEANUP_BATCH], *detnames[CLEANUP_BATCH];
+  int locked[CLEANUP_BATCH], nreverting = 0, ndetaching = 0, i, j, k;
+  int retval, reterr = AL_SUCCESS;
+
+  for (i = 0; i < n; i++)
+    {
+      retval = al__get_session_record(usernames[i], &records[i]);
+      locked[i] = (retval == AL_SUCCESS || AL_ISWARNING(retval));
+      if (retval != AL_SUCCESS)
+	{
+	  if (!locked[i])
+	    reterr = retval;
+	  continue;
+	}
+      if (!records[i].exists)
+	{
+	  if (records[i].detach_pending)
+	    {
+	      detnames[ndetaching] = usernames[i];
+	      detaching[ndetaching++] = &records[i];
+	    }
+	  continue;
+	}
+      /* Copy pids to itself, eliminating pids which don't exist. */
+      if (live)
+	{
+	  for (j = 0, k = 0; k < records[i].npids; k++)
+	    {
+	      if (pid_alive(live, records[i].pids[k], records[i].starts[k]))
+		{
+		  records[i].starts[j] = records[i].starts[k];
+		  records[i].pids[j++] = records[i].pids[k];
+		}
+	    }
+	  records[i].npids = j;
+	}
+
+      if (records[i].npids == 0 && al__should_revert(&records[i]))
+	{
+	  revnames[nreverting] = usernames[i];
+	  reverting[nreverting++] = &records[i];
+	}
+    }
+
+  /* Undo the account changes of users with no sessions left.  The
+   * home directories are detached first, while the passwd entries the
+   * detach processes run as still exist, along with those left pending.
+   */
+  for (i = 0; i < nreverting; i++)
+    {
+      detnames[ndetaching] = revnames[i];
+      detaching[ndetaching++] = reverting[i];
+    }
+  if (ndetaching > 0)
+    {
+      retval = run_detaches(detnames, detaching, ndetaching);
+      if (retval != AL_SUCCESS)
+	reterr = retval;
+    }
+  if (nreverting > 0)
+    {
+      retval = al__remove_users_from_group(revnames, reverting, nreverting);
+      if (retval != AL_SUCCESS)
+	reterr = retval;
+      retval = al__revert_users_passwd(revnames, reverting, nreverting);
+      if (retval != AL_SUCCESS)
+	reterr = retval;
+      for (i = 0; i < nreverting; i++)
+	reverting[i]->exists = 0;
+    }
+
+  /* Each record restores the signal mask saved when it was locked, so
+   * release them in the opposite order.
+   */
+  for (i = n - 1; i >= 0; i--)
+    {
+      if (locked[i])
+	{
+	  retval = al__put_session_record(&records[i]);
+	  if (retval != AL_SUCCESS)
+	    reterr = retval;
+	}
+    }
+  return reterr;
+}
+
+/* Detach the home directories of the n users, running up to
+ * "cleanup_workers" detach processes at a time.
+ */
+static int run_detaches(const char **usernames, struct al_record **records,
+			int n)
+{
+  pid_t running[CLEANUP_BATCH], pid;
+  int nrunning = 0, maxrunning, i, status, retval, reterr = AL_SUCCESS;
+
+  maxrunning = al__config_number("cleanup_workers", DEFAULT_WORKERS);
+  if (maxrunning < 1)
+    maxrunning = 1;
+  if (maxrunning > CLEANUP_BATCH)
+    maxrunning = CLEANUP_BATCH;
+
+  for (i = 0; i < n || nrunning > 0; i++)
+    {
+      /* Wait for the oldest detach if there are no free workers or no
+       * more users. */
+      if (nrunning == maxrunning || (i >= n && nrunning > 0))
+	{
+	  while (waitpid(running[0], &status, 0) < 0 && errno == EINTR)
+	    ;
+	  nrunning--;
+	  memmove(running, running + 1, nrunning * sizeof(pid_t));
+	}
+      if (i >= n)
+	continue;
+
+      retval = al__start_detach(usernames[i], records[i], &pid);
+      if (retval != AL_SUCCESS)
+	reterr = retval;
+      else if (pid > 0)
+	running[nrunning++] = pid;
+    }
+  return reterr;
+}
+
+/* Read the pids of the running processes from /proc into set.  If
+ * /proc can't be read, set->valid is left false and pid_alive() falls
+ * back to kill().
+ */
+static void snapshot_pids(struct pidset *set)
+{
+  DIR *dir;
+  struct dirent *entry;
+  pid_t *newpids;
+  int size = 0;
+  const char *p;
+
+  set->pids = NULL;
+  set->npids = 0;
+  set->valid = 0;
+  dir = opendir(PATH_PROC);
+  if (!dir)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+    {
+      for (p = entry->d_name; isdigit((unsigned char)*p); p++)
+	;
+      if (p == entry->d_name || *p)
+	continue;
+      if (set->npids == size)
+	{
+	  size = (size) ? size * 2 : 256;
+	  newpids = realloc(set->pids, size * sizeof(pid_t));
+	  if (!newpids)
+	    {
+	      closedir(dir);
+	      return;
+	    }
+	  set->pids = newpids;
+	}
+      set->pids[set->npids++] = atoi(entry->d_name);
+    }
+  closedir(dir);
+  qsort(set->pids, set->npids, sizeof(pid_t), compare_pids);
+  set->valid = 1;
+}
+
+/* Return true if pid exists and, if start is known, has not been
+ * reused.  A pid missing from the snapshot may belong to a login which
+ * started after the snapshot was taken, so it is checked with kill()
+ * before being declared dead.
+ */
+static int pid_alive(struct pidset *set, pid_t pid, unsigned long long start)
+{
+  unsigned long long now;
+
+  if (!set->valid || !bsearch(&pid, set->pids, set->npids, sizeof(pid_t),
+			      compare_pids))
+    return al__pid_alive(pid, start);
+  if (start == 0)
+    return 1;
+  now = al__pid_start_time(pid);
+  return (now == 0 || now == start);
+}
+
+static int compare_pids(const void *a, const void *b)
+{
+  pid_t pa = *(const pid_t *) a, pb = *(const pid_t *) b;
+
+  return (pa < pb) ? -1 : (pa > pb);
+}
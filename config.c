@@ -0,0 +1,157 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements
+ * functions to read tunable parameters from the configuration file.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef HAVE_PTHREAD_SIGMASK
+#include <pthread.h>
+#endif
+#include "al.h"
+#include "al_private.h"
+
+/* These variables are to be treated as constants except by
+ * test programs.
+ */
+
+char *al__config_file = PATH_CONFIG;
+
+struct config_entry {
+  char *name;
+  char *value;
+};
+
+static struct config_entry *entries;
+static int nentries, loaded;
+#ifdef HAVE_PTHREAD_SIGMASK
+static pthread_once_t load_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* Read the configuration file into entries.  Lines in the file are of
+ * the form:
+ *
+ *	keyword		value
+ *
+ * Blank lines and lines beginning with "#" are ignored.  The file is
+ * read once per process; a missing or unreadable file means every
+ * parameter takes its default value.
+ */
+static void load_config(void)
+{
+  FILE *fp;
+  char *line = NULL, *p, *q;
+  int linesize, n = 0;
+  struct config_entry *newentries;
+
+  loaded = 1;
+  fp = fopen(al__config_file, "r");
+  if (!fp)
+    return;
+
+  while (al__read_line(fp, &line, &linesize) == 0)
+    {
+      p = line;
+      while (isspace((unsigned char)*p))
+	p++;
+      if (!*p || *p == '#')
+	continue;
+      q = p;
+      while (*q && !isspace((unsigned char)*q))
+	q++;
+      if (*q)
+	*q++ = 0;
+      while (isspace((unsigned char)*q))
+	q++;
+
+      newentries = realloc(entries, (n + 1) * sizeof(struct config_entry));
+      if (!newentries)
+	break;
+      entries = newentries;
+      entries[n].name = malloc(strlen(p) + strlen(q) + 2);
+      if (!entries[n].name)
+	break;
+      strcpy(entries[n].name, p);
+      entries[n].value = entries[n].name + strlen(p) + 1;
+      strcpy(entries[n].value, q);
+      n++;
+    }
+
+  nentries = n;
+  free(line);
+  fclose(fp);
+}
+
+/* Return the value given for name in the configuration file, or NULL
+ * if it is not set.  If name appears more than once, the last value
+ * wins.
+ */
+const char *al__config_string(const char *name)
+{
+  int i;
+
+  /* Threads must not see the entries until they are complete. */
+#ifdef HAVE_PTHREAD_SIGMASK
+  pthread_once(&load_once, load_config);
+#else
+  if (!loaded)
+    load_config();
+#endif
+  for (i = nentries - 1; i >= 0; i--)
+    {
+      if (strcmp(entries[i].name, name) == 0)
+	return entries[i].value;
+    }
+  return NULL;
+}
+
+/* Return the numeric value given for name, or defval if it is not set
+ * or is not a number.
+ */
+long al__config_number(const char *name, long defval)
+{
+  const char *value = al__config_string(name);
+  char *end;
+  long n;
+
+  if (!value || !*value)
+    return defval;
+  n = strtol(value, &end, 10);
+  return (*end) ? defval : n;
+}
+
+/* Return the boolean value given for name, or defval if it is not set
+ * or is not recognizable as a boolean.
+ */
+int al__config_bool(const char *name, int defval)
+{
+  const char *value = al__config_string(name);
+
+  if (!value)
+    return defval;
+  if (strcmp(value, "yes") == 0 || strcmp(value, "true") == 0
+      || strcmp(value, "on") == 0 || strcmp(value, "1") == 0)
+    return 1;
+  if (strcmp(value, "no") == 0 || strcmp(value, "false") == 0
+      || strcmp(value, "off") == 0 || strcmp(value, "0") == 0)
+    return 0;
+  return defval;
+}
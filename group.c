@@ -50,8 +50,12 @@ struct hesgroup {
   int present;
 };
 
-static int retrieve_hesgroups(const char *username, struct hesgroup **groups,
-			      int *ngroups, gid_t *primary_gid);
+static int retrieve_hesgroups(const char *username, struct al_record *record,
+			      struct hesgroup **groups, int *ngroups,
+			      gid_t *primary_gid);
+static int add_to_nss(const char *username, struct hesgroup *hesgroups,
+		      int nhesgroups, gid_t primary_gid,
+		      struct al_record *record);
 static void free_hesgroups(struct hesgroup *hesgroups, int ngroups);
 static gid_t *retrieve_local_gids(int *nlocal);
 static int in_local_gids(gid_t *local, int nlocal, gid_t gid);
@@ -70,9 +74,21 @@ int al__add_to_group(const char *username, struct al_record *record)
   struct hesgroup *hesgroups;
 
   /* Retrieve the hesiod groups. */
-  if (retrieve_hesgroups(username, &hesgroups, &nhesgroups, &primary_gid) != 0)
+  if (retrieve_hesgroups(username, record, &hesgroups, &nhesgroups,
+			 &primary_gid) != 0)
     return AL_WGROUP;
 
+  /* If the NSS module is serving session users, record the groups in
+   * the session record instead of rewriting the group file.
+   */
+  if (al__config_bool("nss", 0))
+    {
+      status = add_to_nss(username, hesgroups, nhesgroups, primary_gid,
+			  record);
+      free_hesgroups(hesgroups, nhesgroups);
+      return status;
+    }
+
   /* Open the input and output files. */
   out = lock_group(&lockfd);
   if (!out)
@@ -240,12 +256,34 @@ int al__add_to_group(const char *username, struct al_record *record)
 }
 
 int al__remove_from_group(const char *username, struct al_record *record)
+{
+  return al__remove_users_from_group(&username, &record, 1);
+}
+
+/* This is an internal function.  Its contract is to remove each of
+ * the n users in usernames from the groups listed in the corresponding
+ * record, making a single pass over the group file.
+ */
+int al__remove_users_from_group(const char **usernames,
+				struct al_record **records, int n)
 {
   FILE *in, *out;
-  char *line = NULL, *p;
-  int i, lockfd, linesize, nlocal, status, len = strlen(username);
+  char *line = NULL, *members, *p;
+  int i, j, lockfd, linesize, nlocal = 0, status, len, nedits = 0;
   gid_t gid, *local;
 
+  /* Groups served by the NSS module go away with the session record. */
+  for (j = 0; j < n; j++)
+    {
+      if (records[j]->nss_groups)
+	al__clear_group_index(usernames[j], records[j]->nss_groups);
+      free(records[j]->nss_groups);
+      records[j]->nss_groups = NULL;
+      nedits += records[j]->ngroups;
+    }
+  if (nedits == 0)
+    return AL_SUCCESS;
+
   local = retrieve_local_gids(&nlocal);
 
   out = lock_group(&lockfd);
@@ -262,25 +300,31 @@ int al__remove_from_group(const char *username, struct al_record *record)
       return AL_EPERM;
     }
 
-  /* Copy in to out, eliminating the user from groups in record->groups. */
+  /* Copy in to out, eliminating each user from the groups in its
+   * record. */
   while ((status = al__read_line(in, &line, &linesize)) == 0)
     {
       /* Skip the group name, group password, and gid; record the gid. */
-      if (parse_to_gid(line, &p, &gid) != 0)
+      if (parse_to_gid(line, &members, &gid) != 0)
 	continue;
 
-      for (i = 0; i < record->ngroups; i++)
-	{
-	  if (record->groups[i] == gid)
-	    break;
-	}
-      if (i < record->ngroups)
+      for (j = 0; j < n; j++)
 	{
-	  /* Search for username in the membership list and remove it. */
-	  while (p)
+	  for (i = 0; i < records[j]->ngroups; i++)
+	    {
+	      if (records[j]->groups[i] == gid)
+		break;
+	    }
+	  if (i == records[j]->ngroups)
+	    continue;
+
+	  /* Search for the username in the membership list and remove
+	   * it. */
+	  len = strlen(usernames[j]);
+	  for (p = members; p; p = strchr(p, ','))
 	    {
 	      p++;
-	      if (strncmp(p, username, len) == 0
+	      if (strncmp(p, usernames[j], len) == 0
 		  && (*(p + len) == ',' || *(p + len) == 0))
 		{
 		  /* Found it; now remove it. */
@@ -289,7 +333,6 @@ int al__remove_from_group(const char *username, struct al_record *record)
 		  if (*p == 0 && *(p - 1) == ',')
 		    *(p - 1) = 0;
 		}
-	      p = strchr(p, ',');
 	    }
 	}
 
@@ -317,12 +360,58 @@ int al__remove_from_group(const char *username, struct al_record *record)
   return AL_SUCCESS;
 }
 
+/* Format the user's hesiod groups into record->nss_groups as a list of
+ * name:gid: pairs, applying the same MAX_GROUPS limit as the group file
+ * path, and add the user to the NSS module's group index.  Return
+ * AL_SUCCESS, AL_ENOMEM, or AL_WGROUP if the index cannot be updated.
+ */
+static int add_to_nss(const char *username, struct hesgroup *hesgroups,
+		      int nhesgroups, gid_t primary_gid,
+		      struct al_record *record)
+{
+  char *list, *p;
+  int i, len = 1, nentries = 0;
+
+  for (i = 0; i < nhesgroups; i++)
+    len += strlen(hesgroups[i].name) + 32;
+  list = malloc(len);
+  if (!list)
+    return AL_ENOMEM;
+  p = list;
+  *p = 0;
+  for (i = 0; i < nhesgroups; i++)
+    {
+      if (hesgroups[i].gid != primary_gid)
+	{
+	  if (nentries >= MAX_GROUPS)
+	    continue;
+	  nentries++;
+	}
+      sprintf(p, "%s:%lu:", hesgroups[i].name,
+	      (unsigned long) hesgroups[i].gid);
+      p += strlen(p);
+    }
+  if (record->nss_groups)
+    al__clear_group_index(username, record->nss_groups);
+  free(record->nss_groups);
+  record->nss_groups = NULL;
+  if (al__set_group_index(username, list) != AL_SUCCESS)
+    {
+      al__clear_group_index(username, list);
+      free(list);
+      return AL_WGROUP;
+    }
+  record->nss_groups = list;
+  return AL_SUCCESS;
+}
+
 /* Retrieve the user's hesiod groups and stuff them into *groups, with a
  * count in *ngroups.  Also put the user's primary gid into *primary_gid.
  * Return 0 on success and -1 on failure.
  */
-static int retrieve_hesgroups(const char *username, struct hesgroup **groups,
-			      int *ngroups, gid_t *primary_gid)
+static int retrieve_hesgroups(const char *username, struct al_record *record,
+			      struct hesgroup **groups, int *ngroups,
+			      gid_t *primary_gid)
 {
   char **grplistvec, **primarygidvec, *primary_name, buf[64], *p, *q;
   int n, len;
@@ -332,7 +421,7 @@ static int retrieve_hesgroups(const char *username, struct hesgroup **groups,
 
   /* Look up the user's primary group in hesiod to retrieve the primary
    * group name.  Start by finding the gid. */
-  pwd = al__getpwnam(username);
+  pwd = al__session_getpwnam(username, record);
   if (!pwd)
     return -1;
   *primary_gid = pwd->pw_gid;
@@ -565,18 +654,13 @@ static int parse_to_gid(char *s, char **p, gid_t *gid)
 
 static FILE *lock_group(int *fd)
 {
-  struct flock fl;
   FILE *fp;
 
   /* Open and lock the group lock file. */
   *fd = open(PATH_GROUP_LOCK, O_CREAT|O_RDWR|O_TRUNC, S_IWUSR|S_IRUSR);
   if (*fd < 0)
     return NULL;
-  fl.l_type = F_WRLCK;
-  fl.l_whence = SEEK_SET;
-  fl.l_start = 0;
-  fl.l_len = 0;
-  if (fcntl(*fd, F_SETLKW, &fl) < 0)
+  if (al__lock_fd(*fd, 0, 0, F_WRLCK, 1) < 0)
     {
       close(*fd);
       return NULL;
@@ -591,7 +675,6 @@ static FILE *lock_group(int *fd)
 
 static int update_group(FILE *fp, int fd)
 {
-  struct flock fl;
   int status;
 
   /* Flush out and close fp, checking for errors.  If everything is
@@ -615,28 +698,18 @@ static int update_group(FILE *fp, int fd)
     status = -1;
 
   /* Unlock and close the group lock file. */
-  fl.l_type = F_UNLCK;
-  fl.l_whence = SEEK_SET;
-  fl.l_start = 0;
-  fl.l_len = 0;
-  fcntl(fd, F_SETLKW, &fl);
+  al__lock_fd(fd, 0, 0, F_UNLCK, 1);
   close(fd);
   return (status == -1) ? AL_WGROUP : AL_SUCCESS;
 }
 
 static void discard_group_lockfile(FILE *fp, int fd)
 {
-  struct flock fl;
-
   /* Discard the group temp file. */
   fclose(fp);
   unlink(PATH_GROUP_TMP);
 
   /* Unlock and close the group lock file. */
-  fl.l_type = F_UNLCK;
-  fl.l_whence = SEEK_SET;
-  fl.l_start = 0;
-  fl.l_len = 0;
-  fcntl(fd, F_SETLKW, &fl);
+  al__lock_fd(fd, 0, 0, F_UNLCK, 1);
   close(fd);
 }
@@ -29,29 +29,280 @@ static const char rcsid[] = "$Id: homedir.c,v 1.13 1999-04-17 02:29:04 ghudson E
 #include <unistd.h>
 #include <errno.h>
 #include <pwd.h>
-#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#ifdef HAVE_PIDFD_OPEN
+#include <sys/syscall.h>
+#endif
 #include "al.h"
 #include "al_private.h"
 
+/* Longest pause between checks on the attach process when the system
+ * lacks pidfds, in milliseconds.
+ */
+#define ATTACH_POLL_MAX		50
+
+/* How long to wait for a killed attach process to exit, in
+ * milliseconds.  A process stuck on an unresponsive file server may
+ * not exit at once even when killed, and is then left unreaped.
+ */
+#define ATTACH_KILL_GRACE	1000
+
+/* Wait for the process pid until deadline (a gettimeofday() value), or
+ * indefinitely if deadline is NULL.  Return as waitpid() does, or 0 if
+ * the deadline passed first.
+ */
+static pid_t wait_until(pid_t pid, int *status, struct timeval *deadline)
+{
+  struct timeval now;
+  long remaining, pause = 1;
+  pid_t rpid;
+#ifdef HAVE_PIDFD_OPEN
+  struct pollfd pfd;
+  int n;
+#endif
+
+  if (!deadline)
+    {
+      while ((rpid = waitpid(pid, status, 0)) < 0 && errno == EINTR)
+	;
+      return rpid;
+    }
+
+#ifdef HAVE_PIDFD_OPEN
+  pfd.fd = syscall(SYS_pidfd_open, pid, 0);
+  pfd.events = POLLIN;
+#endif
+  while (1)
+    {
+      rpid = waitpid(pid, status, WNOHANG);
+      if (rpid != 0 && !(rpid == -1 && errno == EINTR))
+	break;
+      gettimeofday(&now, NULL);
+      remaining = (deadline->tv_sec - now.tv_sec) * 1000
+	+ (deadline->tv_usec - now.tv_usec) / 1000;
+      if (remaining <= 0)
+	break;
+#ifdef HAVE_PIDFD_OPEN
+      if (pfd.fd != -1)
+	{
+	  /* The pidfd becomes readable when the process exits. */
+	  n = poll(&pfd, 1, remaining);
+	  if (n == -1 && errno != EINTR)
+	    break;
+	  continue;
+	}
+#endif
+      usleep(((pause < remaining) ? pause : remaining) * 1000);
+      pause = (pause * 2 > ATTACH_POLL_MAX) ? ATTACH_POLL_MAX : pause * 2;
+    }
+#ifdef HAVE_PIDFD_OPEN
+  if (pfd.fd != -1)
+    close(pfd.fd);
+#endif
+  return rpid;
+}
+
+/* Wait for the attach process pid, for at most "attach_timeout"
+ * seconds if that is set.  If the attach takes longer, kill it along
+ * with any processes it started, and set *timed_out.  Return as
+ * waitpid() does.
+ */
+static pid_t wait_attach(pid_t pid, int *status, int *timed_out)
+{
+  struct timeval deadline;
+  long timeout;
+  pid_t rpid;
+
+  timeout = al__config_number("attach_timeout", 0);
+  if (timeout <= 0)
+    return wait_until(pid, status, NULL);
+
+  gettimeofday(&deadline, NULL);
+  deadline.tv_sec += timeout;
+  rpid = wait_until(pid, status, &deadline);
+  if (rpid != 0)
+    return rpid;
+
+  *timed_out = 1;
+  kill(-pid, SIGKILL);
+  kill(pid, SIGKILL);
+  gettimeofday(&deadline, NULL);
+  deadline.tv_usec += ATTACH_KILL_GRACE * 1000;
+  deadline.tv_sec += deadline.tv_usec / 1000000;
+  deadline.tv_usec %= 1000000;
+  rpid = wait_until(pid, status, &deadline);
+  return (rpid == 0) ? -1 : rpid;
+}
+
+/* Start attach as user (a username or uid) on behalf of username,
+ * leading its own process group.  Return its pid, or -1 if it could
+ * not be started.
+ */
+static pid_t spawn_attach(const char *username, const char *user,
+			  int havecred)
+{
+  char *argv[8];
+  int i = 0;
+
+  argv[i++] = "attach";
+  argv[i++] = "-user";
+  argv[i++] = (char *) user;
+  argv[i++] = "-quiet";
+  argv[i++] = "-nozephyr";
+  if (!havecred)
+    argv[i++] = "-nomap";
+  argv[i++] = (char *) username;
+  argv[i] = NULL;
+
+  /* Lead a process group, so that a timeout can kill any mount helpers
+   * along with attach.
+   */
+  return al__spawn(PATH_ATTACH, argv, AL__SPAWN_PGROUP, 0, 0);
+}
+
+/* If "pipeline_attach" is set in al.conf, al_acct_create() starts
+ * attaching a new user's home directory as soon as the user's Hesiod
+ * passwd entry is known, and adds the user to the passwd and group
+ * files while attach runs.  Since the user has no local passwd entry
+ * yet, attach is given the uid from Hesiod.  The attach is only
+ * started early when the user would get a passwd entry with that
+ * uid; otherwise al__setup_homedir() attaches as usual.
+ */
+
+/* This is an internal function.  Its contract is to start attaching
+ * username's home directory ahead of the user's passwd entry being set
+ * up, recording what it did in att for al__setup_homedir() or
+ * al__abandon_attach().
+ */
+void al__start_attach(const char *username, struct al_record *record,
+		      int havecred, struct al_attach *att)
+{
+  struct passwd *local_pwd, *hes_pwd, *uid_pwd = NULL, *pw;
+  void *hescontext;
+  char uid[32];
+
+  att->pid = 0;
+  att->skipped = 0;
+  att->key = NULL;
+  if (record->old_homedir || hesiod_init(&hescontext) != 0)
+    return;
+  hes_pwd = hesiod_getpwnam(hescontext, username);
+  local_pwd = al__session_getpwnam(username, record);
+  if (hes_pwd && !local_pwd)
+    uid_pwd = al__getpwuid(hes_pwd->pw_uid);
+
+  /* Only go ahead if al__add_to_passwd() would give the user the
+   * Hesiod uid, and al__setup_homedir() would attach.
+   */
+  if (hes_pwd && !uid_pwd
+      && (local_pwd || hes_pwd->pw_gid >= MIN_HES_GROUP)
+      && (!local_pwd || strcmp(local_pwd->pw_dir, hes_pwd->pw_dir) == 0)
+      && access(PATH_NOATTACH, F_OK) == -1)
+    {
+      att->key = al__attach_key(username);
+      if (!al__attach_allowed(att->key))
+	att->skipped = 1;
+      else
+	{
+	  pw = (local_pwd) ? local_pwd : hes_pwd;
+	  sprintf(uid, "%lu", (unsigned long) pw->pw_uid);
+	  al__admission_enter(&att->adm);
+	  att->pid = spawn_attach(username, uid, havecred);
+	  if (att->pid == -1)
+	    {
+	      att->pid = 0;
+	      al__admission_leave(&att->adm);
+	      free(att->key);
+	      att->key = NULL;
+	    }
+	}
+    }
+
+  al__free_passwd(uid_pwd);
+  al__free_passwd(local_pwd);
+  if (hes_pwd)
+    hesiod_free_passwd(hescontext, hes_pwd);
+  hesiod_end(hescontext);
+}
+
+/* This is an internal function.  Its contract is to wait for an attach
+ * started by al__start_attach() when account setup has failed before
+ * reaching al__setup_homedir(), noting in record if it succeeded so
+ * that the home directory is detached when the account is reverted.
+ */
+void al__abandon_attach(struct al_attach *att, struct al_record *record,
+			int havecred)
+{
+  pid_t rpid;
+  int status, timed_out = 0;
+
+  if (att->pid)
+    {
+      rpid = wait_attach(att->pid, &status, &timed_out);
+      al__admission_leave(&att->adm);
+      if (rpid == att->pid && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+	  record->attached = 1;
+	  if (havecred)
+	    record->authenticated = 1;
+	}
+      att->pid = 0;
+    }
+  free(att->key);
+  att->key = NULL;
+}
+
+/* This is an internal function.  Its contract is to set up username's
+ * home directory, attaching it or making a temporary one.  If early is
+ * not NULL, it describes the attach begun by al__start_attach(), which
+ * is finished here.
+ */
 int al__setup_homedir(const char *username, struct al_record *record,
-		      int havecred, int tmphomedir)
+		      int havecred, int tmphomedir, struct al_attach *early)
 {
   struct passwd *local_pwd, *hes_pwd;
+  struct al_admission adm;
   pid_t pid, rpid;
-  int status, fd;
-  char *tmpdir, *tmpfile, *saved_homedir;
+  int status, timed_out = 0, skipped = 0;
+  char *tmpdir, *saved_homedir, *key;
   const char *hes_homedir;
   void *hescontext;
-  DIR *dir;
-  struct dirent *entry;
 
   /* Get local password entry.  User should already have been added to
    * passwd database, so if this fails, we've already lost, so punt.
    */
-  local_pwd = al__getpwnam(username);
+  local_pwd = al__session_getpwnam(username, record);
   if (!local_pwd)
-    return AL_WNOHOMEDIR;
+    {
+      if (early)
+	al__abandon_attach(early, record, havecred);
+      return AL_WNOHOMEDIR;
+    }
+
+  /* Pick up an attach started, or skipped, before the user's passwd
+   * entry was set up.
+   */
+  if (early && (early->pid || early->skipped))
+    {
+      hes_homedir = local_pwd->pw_dir;
+      key = early->key;
+      early->key = NULL;
+      if (early->skipped)
+	{
+	  free(key);
+	  skipped = 1;
+	  goto attach_failed;
+	}
+      pid = early->pid;
+      adm = early->adm;
+      early->pid = 0;
+      goto attach_started;
+    }
+  if (early)
+    al__abandon_attach(early, record, havecred);
 
   if (record->old_homedir)
     {
@@ -93,57 +344,59 @@ int al__setup_homedir(const char *username, struct al_record *record,
       return AL_WNOATTACH;
     }
 
-  pid = fork();
-  switch (pid)
+  /* Don't wait for an attach from a file server which keeps failing. */
+  key = al__attach_key(username);
+  if (!al__attach_allowed(key))
+    {
+      free(key);
+      skipped = 1;
+      goto attach_failed;
+    }
+
+  /* Wait for a turn if too many attaches and detaches are running. */
+  al__admission_enter(&adm);
+  pid = spawn_attach(username, username, havecred);
+  if (pid == -1)
     {
-    case -1:
       /* If we can't fork, we just lose. */
+      al__admission_leave(&adm);
+      free(key);
       al__free_passwd(local_pwd);
       return AL_WNOHOMEDIR;
+    }
 
-    case 0:
-      close(STDIN_FILENO);
-      close(STDOUT_FILENO);
-      close(STDERR_FILENO);
-      fd = open("/dev/null", O_RDWR);
-      dup2(fd, STDIN_FILENO);
-      dup2(fd, STDOUT_FILENO);
-      dup2(fd, STDERR_FILENO);
+attach_started:
+  rpid = wait_attach(pid, &status, &timed_out);
+  al__admission_leave(&adm);
 
+  if (rpid == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+      access(hes_homedir, F_OK) == 0)
+    {
+      al__attach_result(key, 1);
+      free(key);
+      record->attached = 1;
       if (havecred)
+	record->authenticated = 1;
+      al__free_passwd(local_pwd);
+      if (record->old_homedir)
 	{
-	  execl(PATH_ATTACH, "attach", "-user", username, "-quiet",
-		"-nozephyr", username, (char *) NULL);
-	}
-      else
-	{
-	  execl(PATH_ATTACH, "attach", "-user", username, "-quiet",
-		"-nozephyr", "-nomap", username, (char *) NULL);
+	  if (al__change_passwd_homedir(username, record,
+					record->old_homedir) != AL_SUCCESS)
+	    return AL_WXTMPDIR;
+	  free(record->old_homedir);
+	  record->old_homedir = NULL;
 	}
-      _exit(1);
-
-    default:
-      while ((rpid = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
-	;
-
-      if (rpid == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
-	  access(hes_homedir, F_OK) == 0)
-	{
-	  record->attached = 1;
-	  al__free_passwd(local_pwd);
-	  if (record->old_homedir)
-	    {
-	      if (al__change_passwd_homedir(username,
-					    record->old_homedir) != AL_SUCCESS)
-		return AL_WXTMPDIR;
-	      free(record->old_homedir);
-	      record->old_homedir = NULL;
-	    }
-	  return AL_SUCCESS;
-	}
-      break;
+      return AL_SUCCESS;
     }
 
+  /* An attach without credentials may fail for want of them, so it
+   * says nothing about the file server unless it timed out.
+   */
+  if (timed_out || havecred)
+    al__attach_result(key, 0);
+  free(key);
+
+attach_failed:
   /* attach failed somehow.  If we already had a local homedir, we're
    * done.
    */
@@ -167,14 +420,17 @@ int al__setup_homedir(const char *username, struct al_record *record,
       return AL_ENOMEM;
     }
 
-  /* If the user's temporary directory does not exist, we need to create
-   * it.  PATH_TMPDIRS is not world-writable, so we don't have to be
-   * paranoid about the creation of the user home directory, but we do
-   * have to be careful about doing anything as root in a diretory which
-   * we've already chowned to the user.
+  /* If the user's temporary directory does not exist, we need to take
+   * one from the pool (see tmphome.c) or create it.  PATH_TMPDIRS is
+   * not world-writable, so we don't have to be paranoid about the
+   * creation of the user home directory, but we do have to be careful
+   * about doing anything as root in a diretory which we've already
+   * chowned to the user.
    */
   sprintf(tmpdir, "%s/%s", PATH_TMPDIRS, username);
-  if (access(tmpdir, F_OK) == -1)
+  if (access(tmpdir, F_OK) == -1
+      && al__claim_tmphome(tmpdir, local_pwd->pw_uid,
+			   local_pwd->pw_gid) == -1)
     {
       /* First make sure PATH_TMPDIRS exists. */
       if (access(PATH_TMPDIRS, F_OK) == -1)
@@ -190,67 +446,15 @@ int al__setup_homedir(const char *username, struct al_record *record,
 	  return AL_WNOHOMEDIR;
  	}
 
-      /* Copy files from PATH_TMPPROTO to the ephemeral directory. */
-      dir = opendir(PATH_TMPPROTO);
-      if (!dir)
+      /* Copy the prototype files into the ephemeral directory. */
+      if (al__copy_prototype(PATH_TMPPROTO, tmpdir, local_pwd->pw_uid,
+			     local_pwd->pw_gid) == -1)
 	{
 	  rmdir(tmpdir);
 	  free(tmpdir);
 	  al__free_passwd(local_pwd);
 	  return AL_WNOHOMEDIR;
 	}
-
-      while ((entry = readdir(dir)) != NULL)
-	{
-	  if (strcmp(entry->d_name, ".") == 0
-	      || strcmp(entry->d_name, "..") == 0)
-	    continue;
-
-	  /* fork to copy the file into the tmpdir. */
-	  pid = fork();
-	  switch (pid)
-	    {
-	    case -1:
-	      closedir(dir);
-	      rmdir(tmpdir);
-	      free(tmpdir);
-	      al__free_passwd(local_pwd);
-	      return AL_WNOHOMEDIR;
-
-	    case 0:
-	      close(STDIN_FILENO);
-	      close(STDOUT_FILENO);
-	      close(STDERR_FILENO);
-	      fd = open("/dev/null", O_RDWR);
-	      dup2(fd, STDIN_FILENO);
-	      dup2(fd, STDOUT_FILENO);
-	      dup2(fd, STDERR_FILENO);
-	      if (setgid(local_pwd->pw_gid) == -1
-		  || setuid(local_pwd->pw_uid) == -1)
-		_exit(1);
-	      tmpfile = malloc(strlen(PATH_TMPPROTO) + strlen(entry->d_name)
-			       + 2);
-	      if (!tmpfile)
-		_exit(1);
-	      sprintf(tmpfile, "%s/%s", PATH_TMPPROTO, entry->d_name);
-	      execlp("cp", "cp", tmpfile, tmpdir, (char *) NULL);
-	      _exit(1);
-
-	    default:
-	      while ((rpid = waitpid(pid, &status, 0) < 0) && errno == EINTR)
-		;
-	      if (rpid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		{
-		  closedir(dir);
-		  rmdir(tmpdir);
-		  free(tmpdir);
-		  al__free_passwd(local_pwd);
-		  return AL_WNOHOMEDIR;
-		}
-	      break;
-	    }
-	}
-      closedir(dir);
     }
 
   /* Update the session record.  malloc first so we will never have to
@@ -264,7 +468,7 @@ int al__setup_homedir(const char *username, struct al_record *record,
       return AL_ENOMEM;
     }
   strcpy(saved_homedir, local_pwd->pw_dir);
-  if (al__change_passwd_homedir(username, tmpdir) != AL_SUCCESS)
+  if (al__change_passwd_homedir(username, record, tmpdir) != AL_SUCCESS)
     {
       free(tmpdir);
       free(saved_homedir);
@@ -275,61 +479,152 @@ int al__setup_homedir(const char *username, struct al_record *record,
 
   free(tmpdir);
   al__free_passwd(local_pwd);
-  return AL_WTMPDIR;
+  if (timed_out)
+    return AL_WATTACHTIMEOUT;
+  return (skipped) ? AL_WATTACHSKIPPED : AL_WTMPDIR;
 }
 
-int al__revert_homedir(const char *username, struct al_record *record)
+/* This is an internal function.  Its contract is to return true if the
+ * account setup recorded in record is still in place, so that a
+ * further login session for the user need only be added to the
+ * record: the user's home directory was attached rather than replaced
+ * by a temporary one, with authentication if havecred is set, the user
+ * still has a passwd entry, and the home directory named there is
+ * still mounted, in that it is reachable and lies on a different file
+ * system from the directory containing it.
+ */
+int al__homedir_in_place(const char *username, struct al_record *record,
+			 int havecred)
 {
   struct passwd *local_pwd;
-  pid_t pid;
-  int status, fd;
-
-  local_pwd = al__getpwnam(username);
+  struct stat st, parent_st;
+  char *parent, *slash;
+  int retval = 0;
+
+  if (!record->attached || record->old_homedir
+      || (havecred && !record->authenticated))
+    return 0;
+  local_pwd = al__session_getpwnam(username, record);
   if (!local_pwd)
-    return AL_EPERM;
+    return 0;
 
-  if (record->old_homedir && !record->passwd_added)
+  /* Find the containing directory by name, since following a symlink
+   * to the mounted directory and then ".." would stay on its file
+   * system.
+   */
+  parent = malloc(strlen(local_pwd->pw_dir) + 2);
+  if (parent && stat(local_pwd->pw_dir, &st) == 0)
     {
-      if (al__change_passwd_homedir(username,
-				    record->old_homedir) != AL_SUCCESS)
+      strcpy(parent, local_pwd->pw_dir);
+      slash = parent + strlen(parent);
+      while (slash > parent + 1 && slash[-1] == '/')
+	*--slash = 0;
+      slash = strrchr(parent, '/');
+      if (slash)
 	{
-	  al__free_passwd(local_pwd);
-	  return AL_EPERM;
+	  slash[(slash == parent) ? 1 : 0] = 0;
+	  retval = (stat(parent, &parent_st) == 0
+		    && st.st_dev != parent_st.st_dev);
 	}
     }
+  free(parent);
+  al__free_passwd(local_pwd);
+  return retval;
+}
+
+/* If "deferred_detach" is set in al.conf, a logout does not wait for
+ * the user's home directory to be detached.  al__revert_homedir()
+ * instead marks the detach as pending in the session record, along
+ * with the ids to run it as, and al_acct_cleanup_all() or the session
+ * reaper runs it later with the record locked.  A login before then
+ * cancels the detach and keeps using the attached home directory.
+ */
+
+int al__revert_homedir(const char *username, struct al_record *record)
+{
+  struct al_admission adm;
+  struct passwd *local_pwd;
+  pid_t pid;
+  int status, retval;
+
+  if (record->old_homedir && !record->passwd_added && !record->nss_passwd)
+    {
+      if (al__change_passwd_homedir(username, record,
+				    record->old_homedir) != AL_SUCCESS)
+	return AL_EPERM;
+    }
 
+  if (record->attached && al__config_bool("deferred_detach", 0))
+    {
+      local_pwd = al__session_getpwnam(username, record);
+      if (!local_pwd)
+	return AL_EPERM;
+      record->detach_pending = 1;
+      record->detach_uid = local_pwd->pw_uid;
+      record->detach_gid = local_pwd->pw_gid;
+      al__free_passwd(local_pwd);
+      return AL_SUCCESS;
+    }
+
+  /* Only wait for a turn if there is a home directory to detach. */
+  adm.slot = -1;
   if (record->attached)
+    al__admission_enter(&adm);
+  retval = al__start_detach(username, record, &pid);
+  if (retval == AL_SUCCESS && pid > 0)
     {
-      pid = fork();
-      switch (pid)
-	{
-	case -1:
-	  al__free_passwd(local_pwd);
-	  return AL_ENOMEM;
-
-	case 0:
-	  close(STDIN_FILENO);
-	  close(STDOUT_FILENO);
-	  close(STDERR_FILENO);
-	  fd = open("/dev/null", O_RDWR);
-	  dup2(fd, STDIN_FILENO);
-	  dup2(fd, STDOUT_FILENO);
-	  dup2(fd, STDERR_FILENO);
-
-	  if (setgid(local_pwd->pw_gid) == -1
-	      || setuid(local_pwd->pw_uid) == -1)
-	    _exit(1);
-	  execl(PATH_DETACH, "detach", "-quiet", "-nozephyr",
-		username, (char *) NULL);
-	  _exit(1);
-
-	default:
-	  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
-	    ;
-	  break;
-	}
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+	;
+    }
+  al__admission_leave(&adm);
+  return retval;
+}
+
+/* This is an internal function.  Its contract is to start detaching
+ * the user's home directory if it was attached, setting *pid to the
+ * detach process for the caller to wait for, or to 0 if there is
+ * nothing to detach.  A pending detach runs as the ids saved in the
+ * record, and is no longer pending once it has been started.
+ */
+int al__start_detach(const char *username, struct al_record *record,
+		     pid_t *pid)
+{
+  struct passwd *local_pwd;
+  char *argv[5];
+  uid_t uid;
+  gid_t gid;
+
+  *pid = 0;
+  if (record->detach_pending)
+    {
+      uid = record->detach_uid;
+      gid = record->detach_gid;
+    }
+  else
+    {
+      local_pwd = al__session_getpwnam(username, record);
+      if (!local_pwd)
+	return AL_EPERM;
+      uid = local_pwd->pw_uid;
+      gid = local_pwd->pw_gid;
+      al__free_passwd(local_pwd);
     }
 
-  al__free_passwd(local_pwd);
+  if (!record->attached)
+    return AL_SUCCESS;
+
+  argv[0] = "detach";
+  argv[1] = "-quiet";
+  argv[2] = "-nozephyr";
+  argv[3] = (char *) username;
+  argv[4] = NULL;
+  *pid = al__spawn(PATH_DETACH, argv, AL__SPAWN_SETID, uid, gid);
+  if (*pid == -1)
+    {
+      *pid = 0;
+      return AL_ENOMEM;
+    }
+
+  record->detach_pending = 0;
   return AL_SUCCESS;
 }
@@ -0,0 +1,419 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements an
+ * NSS module (libnss_athena) which serves passwd and group entries for
+ * users with an active session record, using the Hesiod information
+ * recorded by al_acct_create() when "nss" is set in al.conf(5).
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pwd.h>
+#include <grp.h>
+#include <nss.h>
+#include "al.h"
+#include "al_private.h"
+
+static void *pwiter, *griter;
+static char *pwent_pending;
+static char *grent_pending;
+
+/* Copy s into the caller's buffer, advancing *buf and *buflen.  Return
+ * the copy, or NULL if there isn't enough room.
+ */
+static char *pack(const char *s, char **buf, size_t *buflen)
+{
+  size_t len = strlen(s) + 1;
+  char *p;
+
+  if (len > *buflen)
+    return NULL;
+  p = *buf;
+  memcpy(p, s, len);
+  *buf += len;
+  *buflen -= len;
+  return p;
+}
+
+/* Parse the passwd line from a session record into result, storing
+ * its strings in buffer.
+ */
+static enum nss_status fill_passwd(const char *line, struct passwd *result,
+				   char *buffer, size_t buflen, int *errnop)
+{
+  struct passwd *pwd;
+
+  pwd = al__parse_passwd_line(line);
+  if (!pwd)
+    return NSS_STATUS_NOTFOUND;
+  memset(result, 0, sizeof(struct passwd));
+  result->pw_uid = pwd->pw_uid;
+  result->pw_gid = pwd->pw_gid;
+  if (!(result->pw_name = pack(pwd->pw_name, &buffer, &buflen))
+      || !(result->pw_passwd = pack(pwd->pw_passwd, &buffer, &buflen))
+      || !(result->pw_gecos = pack(pwd->pw_gecos, &buffer, &buflen))
+      || !(result->pw_dir = pack(pwd->pw_dir, &buffer, &buflen))
+      || !(result->pw_shell = pack(pwd->pw_shell, &buffer, &buflen)))
+    {
+      al__free_passwd(pwd);
+      *errnop = ERANGE;
+      return NSS_STATUS_TRYAGAIN;
+    }
+  al__free_passwd(pwd);
+  return NSS_STATUS_SUCCESS;
+}
+
+/* Fill in result with a group entry, storing its member vector and
+ * strings in buffer.
+ */
+static enum nss_status fill_group(const char *name, gid_t gid,
+				  char **members, int nmembers,
+				  struct group *result, char *buffer,
+				  size_t buflen, int *errnop)
+{
+  size_t align, veclen;
+  char **mem;
+  int i;
+
+  /* The member vector goes first, suitably aligned. */
+  align = (sizeof(char *) - ((unsigned long) buffer % sizeof(char *)))
+    % sizeof(char *);
+  veclen = (nmembers + 1) * sizeof(char *);
+  if (buflen < align + veclen)
+    {
+      *errnop = ERANGE;
+      return NSS_STATUS_TRYAGAIN;
+    }
+  mem = (char **) (buffer + align);
+  buffer += align + veclen;
+  buflen -= align + veclen;
+
+  result->gr_gid = gid;
+  result->gr_mem = mem;
+  if (!(result->gr_name = pack(name, &buffer, &buflen))
+      || !(result->gr_passwd = pack("*", &buffer, &buflen)))
+    {
+      *errnop = ERANGE;
+      return NSS_STATUS_TRYAGAIN;
+    }
+  for (i = 0; i < nmembers; i++)
+    {
+      mem[i] = pack(members[i], &buffer, &buflen);
+      if (!mem[i])
+	{
+	  *errnop = ERANGE;
+	  return NSS_STATUS_TRYAGAIN;
+	}
+    }
+  mem[i] = NULL;
+  return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_athena_getpwnam_r(const char *name,
+				       struct passwd *result, char *buffer,
+				       size_t buflen, int *errnop)
+{
+  struct al_record record;
+  enum nss_status status;
+
+  if (!al__username_valid(name))
+    return NSS_STATUS_NOTFOUND;
+  if (al__snapshot_session_record(name, &record) != AL_SUCCESS)
+    return NSS_STATUS_UNAVAIL;
+  if (!record.nss_passwd)
+    {
+      al__free_record(&record);
+      return NSS_STATUS_NOTFOUND;
+    }
+  status = fill_passwd(record.nss_passwd, result, buffer, buflen, errnop);
+  al__free_record(&record);
+  return status;
+}
+
+enum nss_status _nss_athena_getpwuid_r(uid_t uid, struct passwd *result,
+				       char *buffer, size_t buflen,
+				       int *errnop)
+{
+  enum nss_status status;
+  char *name;
+
+  name = al__lookup_uid_index(uid);
+  if (!name)
+    return NSS_STATUS_NOTFOUND;
+  status = _nss_athena_getpwnam_r(name, result, buffer, buflen, errnop);
+  free(name);
+
+  /* Don't believe a stale index entry. */
+  if (status == NSS_STATUS_SUCCESS && result->pw_uid != uid)
+    return NSS_STATUS_NOTFOUND;
+  return status;
+}
+
+enum nss_status _nss_athena_endpwent(void)
+{
+  if (pwiter)
+    al__session_iter_close(pwiter);
+  pwiter = NULL;
+  free(pwent_pending);
+  pwent_pending = NULL;
+  return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_athena_setpwent(int stayopen)
+{
+  _nss_athena_endpwent();
+  pwiter = al__session_iter_open();
+  return (pwiter) ? NSS_STATUS_SUCCESS : NSS_STATUS_UNAVAIL;
+}
+
+enum nss_status _nss_athena_getpwent_r(struct passwd *result, char *buffer,
+				       size_t buflen, int *errnop)
+{
+  enum nss_status status;
+  const char *name;
+
+  if (!pwiter && _nss_athena_setpwent(0) != NSS_STATUS_SUCCESS)
+    return NSS_STATUS_UNAVAIL;
+
+  /* Hand back the entry which last didn't fit, if there is one. */
+  if (pwent_pending)
+    {
+      status = _nss_athena_getpwnam_r(pwent_pending, result, buffer, buflen,
+				      errnop);
+      if (status == NSS_STATUS_TRYAGAIN)
+	return status;
+      free(pwent_pending);
+      pwent_pending = NULL;
+      if (status == NSS_STATUS_SUCCESS)
+	return status;
+    }
+
+  while (1)
+    {
+      name = al__session_iter_next(pwiter);
+      if (!name)
+	return NSS_STATUS_NOTFOUND;
+      status = _nss_athena_getpwnam_r(name, result, buffer, buflen, errnop);
+      if (status == NSS_STATUS_TRYAGAIN)
+	{
+	  /* Hand back the same entry when called with a bigger buffer. */
+	  pwent_pending = strdup(name);
+	  return status;
+	}
+      if (status == NSS_STATUS_SUCCESS)
+	return status;
+    }
+}
+
+/* Look up a group by name (or by gid if name is NULL), collecting as
+ * members the session users the group index lists for it whose records
+ * still list the group.
+ */
+static enum nss_status lookup_group(const char *name, gid_t gid,
+				    struct group *result, char *buffer,
+				    size_t buflen, int *errnop)
+{
+  const char *p;
+  char *grname, *found = NULL, **users, **members = NULL;
+  int nusers, nmembers = 0, i;
+  gid_t grgid;
+  struct al_record record;
+  enum nss_status status = NSS_STATUS_NOTFOUND;
+
+  if (name && al__lookup_group_index(name, &gid) == -1)
+    return NSS_STATUS_NOTFOUND;
+  users = al__group_index_members(gid, &nusers);
+  if (!users)
+    return NSS_STATUS_NOTFOUND;
+  members = malloc(nusers * sizeof(char *));
+  if (!members)
+    {
+      for (i = 0; i < nusers; i++)
+	free(users[i]);
+      free(users);
+      *errnop = ENOMEM;
+      return NSS_STATUS_TRYAGAIN;
+    }
+
+  /* Don't believe stale index entries. */
+  for (i = 0; i < nusers; i++)
+    {
+      if (al__snapshot_session_record(users[i], &record) != AL_SUCCESS)
+	{
+	  free(users[i]);
+	  continue;
+	}
+      p = record.nss_groups;
+      while (p && al__next_group(&p, &grname, &grgid) == 0)
+	{
+	  if (grgid != gid || (name && strcmp(grname, name) != 0))
+	    {
+	      free(grname);
+	      continue;
+	    }
+	  members[nmembers++] = users[i];
+	  users[i] = NULL;
+	  if (!found)
+	    found = grname;
+	  else
+	    free(grname);
+	  break;
+	}
+      free(users[i]);
+      al__free_record(&record);
+    }
+  free(users);
+
+  if (found)
+    status = fill_group(found, gid, members, nmembers, result,
+			buffer, buflen, errnop);
+  free(found);
+  for (i = 0; i < nmembers; i++)
+    free(members[i]);
+  free(members);
+  return status;
+}
+
+enum nss_status _nss_athena_getgrnam_r(const char *name,
+				       struct group *result, char *buffer,
+				       size_t buflen, int *errnop)
+{
+  return lookup_group(name, 0, result, buffer, buflen, errnop);
+}
+
+enum nss_status _nss_athena_getgrgid_r(gid_t gid, struct group *result,
+				       char *buffer, size_t buflen,
+				       int *errnop)
+{
+  return lookup_group(NULL, gid, result, buffer, buflen, errnop);
+}
+
+enum nss_status _nss_athena_endgrent(void)
+{
+  if (griter)
+    al__group_iter_close(griter);
+  griter = NULL;
+  free(grent_pending);
+  grent_pending = NULL;
+  return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_athena_setgrent(int stayopen)
+{
+  _nss_athena_endgrent();
+  griter = al__group_iter_open();
+  return (griter) ? NSS_STATUS_SUCCESS : NSS_STATUS_UNAVAIL;
+}
+
+/* Enumerate the groups in the group index, each once with all of its
+ * session users as members.  Groups none of whose users still have
+ * sessions are skipped.
+ */
+enum nss_status _nss_athena_getgrent_r(struct group *result, char *buffer,
+				       size_t buflen, int *errnop)
+{
+  enum nss_status status;
+  const char *name;
+
+  if (!griter && _nss_athena_setgrent(0) != NSS_STATUS_SUCCESS)
+    return NSS_STATUS_UNAVAIL;
+
+  /* Hand back the entry which last didn't fit, if there is one. */
+  if (grent_pending)
+    {
+      status = lookup_group(grent_pending, 0, result, buffer, buflen,
+			    errnop);
+      if (status == NSS_STATUS_TRYAGAIN)
+	return status;
+      free(grent_pending);
+      grent_pending = NULL;
+      if (status == NSS_STATUS_SUCCESS)
+	return status;
+    }
+
+  while (1)
+    {
+      name = al__group_iter_next(griter);
+      if (!name)
+	return NSS_STATUS_NOTFOUND;
+      status = lookup_group(name, 0, result, buffer, buflen, errnop);
+      if (status == NSS_STATUS_TRYAGAIN)
+	{
+	  /* Hand back the same entry when called with a bigger buffer. */
+	  grent_pending = strdup(name);
+	  return status;
+	}
+      if (status == NSS_STATUS_SUCCESS)
+	return status;
+    }
+}
+
+/* Answer initgroups() from the user's own session record, so that
+ * logins don't have to enumerate every session record.
+ */
+enum nss_status _nss_athena_initgroups_dyn(const char *user, gid_t group,
+					   long int *start, long int *size,
+					   gid_t **groupsp, long int limit,
+					   int *errnop)
+{
+  struct al_record record;
+  const char *p;
+  char *grname;
+  gid_t gid, *newgroups;
+  long int newsize;
+
+  if (!al__username_valid(user))
+    return NSS_STATUS_NOTFOUND;
+  if (al__snapshot_session_record(user, &record) != AL_SUCCESS)
+    return NSS_STATUS_UNAVAIL;
+  if (!record.nss_groups)
+    {
+      al__free_record(&record);
+      return NSS_STATUS_NOTFOUND;
+    }
+
+  p = record.nss_groups;
+  while (al__next_group(&p, &grname, &gid) == 0)
+    {
+      free(grname);
+      if (gid == group)
+	continue;
+      if (*start == *size)
+	{
+	  if (limit > 0 && *size >= limit)
+	    break;
+	  newsize = (*size > 0) ? 2 * *size : 16;
+	  if (limit > 0 && newsize > limit)
+	    newsize = limit;
+	  newgroups = realloc(*groupsp, newsize * sizeof(gid_t));
+	  if (!newgroups)
+	    {
+	      al__free_record(&record);
+	      *errnop = ENOMEM;
+	      return NSS_STATUS_TRYAGAIN;
+	    }
+	  *groupsp = newgroups;
+	  *size = newsize;
+	}
+      (*groupsp)[(*start)++] = gid;
+    }
+  al__free_record(&record);
+  return NSS_STATUS_SUCCESS;
+}
@@ -15,6 +15,8 @@
 
 /* This file is part of the Athena login library.  It implements
  * functions to add and remove a user from the system passwd database.
+ * The database itself is reached through a backend (see pwfiles.c and
+ * pwmem.c) selected at run time.
  */
 
 static const char rcsid[] = "$Id: passwd.c,v 1.18 2003-10-03 18:36:35 ghudson Exp $";
@@ -24,188 +26,128 @@ static const char rcsid[] = "$Id: passwd.c,v 1.18 2003-10-03 18:36:35 ghudson Ex
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/wait.h>
-#include <fcntl.h>
 #include <string.h>
-#include <unistd.h>
-#include <signal.h>
-#include <time.h>
 #include <hesiod.h>
-#ifdef HAVE_SHADOW
-#include <shadow.h>
-#endif
 #include "al.h"
 #include "al_private.h"
 
-/* /etc/ptmp should be mode 600 on a master.passwd system, 644 otherwise. */
+static const struct al_pwbackend *backends[] = {
+  &al__passwd_backend,
+  &al__shadow_backend,
 #ifdef HAVE_MASTER_PASSWD
-#define PTMP_MODE (S_IWUSR|S_IRUSR)
-#else
-#define PTMP_MODE (S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH)
+  &al__master_backend,
 #endif
+  &al__memory_backend,
+  NULL
+};
+
+/* This is an internal function.  Its contract is to return the passwd
+ * database backend named by "passwd_backend" in al.conf(5), or the
+ * one matching the system's native passwd files if that is unset or
+ * names an unknown backend.
+ */
 
-/* To update the home directory field, we have to know which field it is. */
-#ifdef HAVE_MASTER_PASSWD
-#define HOMEDIR_FIELD 9
-#else 
-#define HOMEDIR_FIELD 6
-#endif
+const struct al_pwbackend *al__pwbackend(void)
+{
+  const char *name;
+  int i;
 
-#ifdef HAVE_LCKPWDF
-static int safe_lckpwdf(void);
+  name = al__config_string("passwd_backend");
+  for (i = 0; name && backends[i]; i++)
+    {
+      if (strcmp(backends[i]->name, name) == 0)
+	return backends[i];
+    }
+
+#if defined(HAVE_MASTER_PASSWD)
+  return &al__master_backend;
+#elif defined(HAVE_SHADOW)
+  return &al__shadow_backend;
+#else
+  return &al__passwd_backend;
 #endif
+}
 
-/* This is an internal function.  Its contract is to lock the passwd
- * database in a manner consistent with the operating system and return
- * the file handle of a temporary file (which may or may not also be
- * the lock file) into which to write the new contents of the passwd
- * file.
+/* The next couple of functions (al__getpwnam() and al__getpwuid())
+ * are here because libal, being a library, shouldn't be stomping on
+ * the static memory returned by the native operating system's
+ * getpwnam() and getpwuid() calls.  Unfortunately, we have to write a
+ * lot of code which does the same thing as libc does.  Some day we
+ * may be able to assume that all modern platforms have getpwnam_r()
+ * and getpwuid_r() and have a single, simple version of these
+ * functions.  The lookups themselves are done by the passwd database
+ * backend (see al__pwbackend()).
  */
 
-static FILE *lock_passwd(void)
+struct passwd *al__getpwnam(const char *username)
 {
-#ifdef HAVE_LCKPWDF
-  FILE *fp;
-
-  if (safe_lckpwdf() == -1)
+  /* Paranoia: don't find an empty username. */
+  if (!*username)
     return NULL;
-  fp = fopen(PATH_PASSWD_TMP, "w");
-  if (fp)
-    fchmod(fileno(fp), S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH);
-  else
-    ulckpwdf();
-  return fp;
-#else
-  int i, fd = -1;
-  FILE *fp;
+  return al__pwbackend()->getpwnam(username);
+}
 
-  for (i = 0; i < 10; i++)
-    {
-      fd = open(PATH_PASSWD_TMP, O_RDWR|O_CREAT|O_EXCL, PTMP_MODE);
-      if (fd >= 0 || errno != EEXIST)
-	break;
-      sleep(1);
-    }
-  if (fd == -1)
-    return NULL;
-  fp = fdopen(fd, "w");
-  if (fp == NULL)
-    unlink(PATH_PASSWD_TMP);
-  return fp;
-#endif
+struct passwd *al__getpwuid(uid_t uid)
+{
+  return al__pwbackend()->getpwuid(uid);
 }
 
-/* This is an internal function.  Its contract is to replace the passwd
- * file with the temporary file.
+/* This is an internal function.  Its contract is to format the Hesiod
+ * passwd entry pwd into record->nss_passwd, where the NSS module will
+ * find it, and to add the user to the NSS module's uid index.  The
+ * record is world-readable, so the password field is always "*".
  */
 
-static int update_passwd(FILE *fp)
+static int add_to_nss(const char *username, struct passwd *pwd,
+		      struct al_record *record)
 {
-#ifdef HAVE_MASTER_PASSWD
-  int pstat;
-  pid_t pid, rpid;
-#endif
-  int status;
+  char *line;
 
-  fflush(fp);
-  status = (fsync(fileno(fp)) == -1);
-  status = ferror(fp) || status;
-  if (fclose(fp) || status)
-    {
-      unlink(PATH_PASSWD_TMP);
-#ifdef HAVE_LCKPWDF
-      ulckpwdf();
-#endif
-    }
-
-  /* Replace the passwd file with the lock file. */
-#ifdef HAVE_MASTER_PASSWD
-  pid = fork();
-  if (pid == 0)
-    {
-      int fd;
-      close(STDIN_FILENO);
-      close(STDOUT_FILENO);
-      close(STDERR_FILENO);
-      fd = open("/dev/null", O_RDWR);
-      dup2(fd, STDIN_FILENO);
-      dup2(fd, STDOUT_FILENO);
-      dup2(fd, STDERR_FILENO);
-      execl(_PATH_PWD_MKDB, "pwd_mkdb", "-p", PATH_PASSWD_TMP, (char *) NULL);
-      _exit(1);
-    }
-  while ((rpid = waitpid(pid, &pstat, 0)) < 0 && errno == EINTR)
-    ;
-  if (rpid == -1 || !WIFEXITED(pstat) || WEXITSTATUS(pstat) != 0)
-    {
-      unlink(PATH_PASSWD_TMP);
-      return AL_EPASSWD;
-    }
-#else /* HAVE_MASTER_PASSWD */
-  if (rename(PATH_PASSWD_TMP, PATH_PASSWD))
+  line = malloc(strlen(pwd->pw_name) + strlen(pwd->pw_gecos)
+		+ strlen(pwd->pw_dir) + strlen(pwd->pw_shell) + 64);
+  if (!line)
+    return AL_ENOMEM;
+  sprintf(line, "%s:*:%lu:%lu:%s:%s:%s", pwd->pw_name,
+	  (unsigned long) pwd->pw_uid, (unsigned long) pwd->pw_gid,
+	  pwd->pw_gecos, pwd->pw_dir, pwd->pw_shell);
+  if (al__set_uid_index(pwd->pw_uid, username) != AL_SUCCESS)
     {
-      unlink(PATH_PASSWD_TMP);
-#ifdef HAVE_LCKPWDF
-      ulckpwdf();
-#endif
+      free(line);
       return AL_EPASSWD;
     }
-#endif /* HAVE_MASTER_PASSWD */
-
-#ifdef sgi
-  /* Kludge: nsd has a one-second granularity in checking the mod time
-   * of a file, so make sure we don't modify it twice within a second.
-   */
-  sleep(1);
-#endif
-
-  /* Unlock the passwd file if we're using System V style locking. */
-#ifdef HAVE_LCKPWDF
-  ulckpwdf();
-#endif
-
+  record->nss_passwd = line;
   return AL_SUCCESS;
 }
 
-/* This is an internal function.  Its contract is to clean up after a
- * failed attempt to write the new passwd file.
+/* This is an internal function.  Its contract is to look up username,
+ * preferring the passwd entry served from record by the NSS module to
+ * the local passwd database.  The caller frees the result with
+ * al__free_passwd().
  */
 
-static void discard_passwd_lockfile(FILE *fp)
+struct passwd *al__session_getpwnam(const char *username,
+				    struct al_record *record)
 {
-  fclose(fp);
-  unlink(PATH_PASSWD_TMP);
-#ifdef HAVE_LCKPWDF
-  ulckpwdf();
-#endif
-  return;
+  if (record->nss_passwd)
+    return al__parse_passwd_line(record->nss_passwd);
+  return al__getpwnam(username);
 }
 
 /* This is an internal function.  Its contract is to add the user to the
  * local passwd database if appropriate, and set record->passwd_added to
  * 1 if it adds a passwd line.
- *
- * There are three implementations of the passwd database which concern
- * us:
- * 	* An /etc/passwd file
- * 	* An /etc/passwd and /etc/shadow file
- * 	* An /etc/master.passwd file and associated databases
- * For simplicity, PATH_PASSWD is defined to be "/etc/passwd" on the
- * first two types of systems and to "/etc/master.passwd" on the third
- * type.
  */
 
 int al__add_to_passwd(const char *username, struct al_record *record)
 {
-  FILE *in = NULL, *out = NULL;
-#ifdef HAVE_SHADOW
-  FILE *shadow_in = NULL, *shadow_out = NULL;
-#endif
+  const struct al_pwbackend *backend = al__pwbackend();
   struct passwd *pwd, *tmppwd;
-  char buf[BUFSIZ], *line = NULL;
-  int linesize, len, found, nbytes, retval, fd;
-  void *hescontext = NULL;
+  int retval;
+  void *hescontext, *txn;
+
+  /* A user served by the NSS module has nothing more to set up. */
+  if (record->nss_passwd)
+    return AL_SUCCESS;
 
   tmppwd = al__getpwnam(username);
   if (tmppwd)
@@ -238,291 +180,166 @@ int al__add_to_passwd(const char *username, struct al_record *record)
       return AL_EBADHES;
     }
 
-  out = lock_passwd();
-  in = fopen(PATH_PASSWD, "r");
-  if (!out || !in)
-    goto cleanup;
-  do
-    {
-      nbytes = fread(buf, sizeof(char), BUFSIZ, in);
-      if (nbytes)
-	{
-	  if (!fwrite(buf, sizeof(char), nbytes, out))
-	    goto cleanup;
-	}
-    }
-  while (nbytes == BUFSIZ);
-
-  fprintf(out, "%s:%s:%lu:%lu%s:%s:%s:%s\n",
-	  pwd->pw_name,
-#ifdef HAVE_SHADOW
-	  "x",
-#else
-	  pwd->pw_passwd,
-#endif
-	  (unsigned long) pwd->pw_uid, (unsigned long) pwd->pw_gid,
-#ifdef HAVE_MASTER_PASSWD
-	  "::0:0",
-#else
-	  "",
-#endif
-	  pwd->pw_gecos, pwd->pw_dir, pwd->pw_shell);
-
-#ifdef HAVE_SHADOW
-  /* Prepare to copy shadow file to a temporary file. */
-  fd = open(PATH_SHADOW_TMP, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
-  if (fd < 0)
-    goto cleanup;
-  shadow_out = fdopen(fd, "w");
-  if (!shadow_out)
-    {
-      close(fd);
-      unlink(PATH_SHADOW_TMP);
-      goto cleanup;
-    }
-  shadow_in = fopen(PATH_SHADOW, "r");
-  if (!shadow_in)
-    goto cleanup;
-
-  /* Copy shadow file, noting if there is an entry for username. */
-  found = 0;
-  len = strlen(username);
-  while ((retval = al__read_line(shadow_in, &line, &linesize)) == 0)
+  /* If the NSS module is serving session users, record the entry in
+   * the session record instead of rewriting the passwd file.
+   */
+  if (al__config_bool("nss", 0))
     {
-      if (strncmp(username, line, len) == 0 && line[len] == ':')
-	found = 1;
-      fprintf(shadow_out, "%s\n", line);
+      retval = add_to_nss(username, pwd, record);
+      hesiod_free_passwd(hescontext, pwd);
+      hesiod_end(hescontext);
+      return retval;
     }
-  free(line);
-  if (retval == -1)
-    goto cleanup;
 
-  /* Add an entry for username if one was not already present. */
-  if (!found)
+  txn = backend->lock();
+  if (!txn)
+    retval = AL_EPASSWD;
+  else if (backend->add(txn, pwd) != AL_SUCCESS)
     {
-      fprintf(shadow_out, "%s:%s:%lu::::::\n", pwd->pw_name, pwd->pw_passwd,
-	      (unsigned long) (time(NULL) / (60 * 60 * 24)));
+      backend->abort(txn);
+      retval = AL_EPASSWD;
     }
-
-  fflush(shadow_out);
-  retval = (fsync(fileno(shadow_out)) == -1);
-  retval = ferror(shadow_out) || retval;
-  retval = fclose(shadow_out) || retval;
-  shadow_out = NULL;
-  if (retval)
-    goto cleanup;
-  retval = fclose(shadow_in);
-  shadow_in = NULL;
-  if (retval)
-    goto cleanup;
-  if (rename(PATH_SHADOW_TMP, PATH_SHADOW))
-    goto cleanup;
-#endif
-
-  retval = fclose(in);
-  in = NULL;
-  if (retval)
-    goto cleanup;
+  else
+    retval = backend->commit(txn);
   hesiod_free_passwd(hescontext, pwd);
   hesiod_end(hescontext);
-  retval = update_passwd(out);
   if (retval == AL_SUCCESS)
     record->passwd_added = 1;
   return retval;
-
-cleanup:
-  if (hescontext)
-    {
-      if (pwd)
-	hesiod_free_passwd(hescontext, pwd);
-      hesiod_end(hescontext);
-    }
-  if (in)
-    fclose(in);
-#ifdef HAVE_SHADOW
-  if (shadow_in)
-    fclose(shadow_in);
-  if (shadow_out)
-    {
-      fclose(shadow_out);
-      unlink(PATH_SHADOW_TMP);
-    }
-#endif
-  if (out)
-    discard_passwd_lockfile(out);
-  return AL_EPASSWD;
 }
 
 /* This is an internal function.  Its contract is to remove username from
- * the passwd file and shadow file if record->passwd_added is true.
+ * the passwd database if record->passwd_added is true, and to stop
+ * serving username from the NSS module.
  */
 
 int al__remove_from_passwd(const char *username, struct al_record *record)
 {
-  FILE *in = NULL, *out = NULL;
-#ifdef HAVE_SHADOW
-  FILE *shadow_in = NULL, *shadow_out = NULL;
-#endif
-  char *buf = NULL;
-  int bufsize, retval, len, fd;
-
-  if (!record->passwd_added)
-    return AL_SUCCESS;
-  
-  out = lock_passwd();
-  in = fopen(PATH_PASSWD, "r");
-  if (!out || !in)
-    goto cleanup;
-  len = strlen(username);
-
-  while ((retval = al__read_line(in, &buf, &bufsize)) == 0)
-    {
-      if (strncmp(username, buf, len) != 0 || buf[len] != ':')
-	{
-	  fputs(buf, out);
-	  fputs("\n", out);
-	}
-    }
-  if (retval == -1)
-    goto cleanup;
-  retval = fclose(in);
-  in = NULL;
-  if (retval)
-    goto cleanup;
-
-#ifdef HAVE_SHADOW
-  fd = open(PATH_SHADOW_TMP, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
-  if (fd < 0)
-    goto cleanup;
-  shadow_out = fdopen(fd, "w");
-  if (!shadow_out)
-    {
-      close(fd);
-      unlink(PATH_SHADOW_TMP);
-      goto cleanup;
-    }
-  shadow_in = fopen(PATH_SHADOW, "r");
-  if (!shadow_in)
-    goto cleanup;
+  const struct al_pwbackend *backend = al__pwbackend();
+  struct passwd *pwd;
+  void *txn;
 
-  while ((retval = al__read_line(shadow_in, &buf, &bufsize)) == 0)
+  if (record->nss_passwd)
     {
-      if (strncmp(username, buf, len) != 0 || buf[len] != ':')
+      pwd = al__parse_passwd_line(record->nss_passwd);
+      if (pwd)
 	{
-	  fputs(buf, shadow_out);
-	  fputs("\n", shadow_out);
+	  al__clear_uid_index(pwd->pw_uid);
+	  al__free_passwd(pwd);
 	}
+      free(record->nss_passwd);
+      record->nss_passwd = NULL;
     }
-  if (retval == -1)
-    goto cleanup;
-  fflush(shadow_out);
-  retval = (fsync(fileno(shadow_out)) == -1);
-  retval = ferror(shadow_out) || retval;
-  retval = fclose(shadow_out) || retval;
-  shadow_out = NULL;
-  if (retval)
-    goto cleanup;
-  retval = fclose(shadow_in);
-  shadow_in = NULL;
-  if (retval)
-    goto cleanup;
-  if (rename(PATH_SHADOW_TMP, PATH_SHADOW))
-    goto cleanup;
-#endif
 
-  free(buf);
-  return update_passwd(out);
+  if (!record->passwd_added)
+    return AL_SUCCESS;
 
-cleanup:
-  free(buf);
-#ifdef HAVE_SHADOW
-  if (shadow_in)
-    fclose(shadow_in);
-  if (shadow_out)
+  txn = backend->lock();
+  if (!txn)
+    return AL_EPASSWD;
+  if (backend->remove(txn, username) != AL_SUCCESS)
     {
-      fclose(shadow_out);
-      unlink(PATH_SHADOW_TMP);
+      backend->abort(txn);
+      return AL_EPASSWD;
     }
-#endif
-  if (in)
-    fclose(in);
-  if (out)
-    discard_passwd_lockfile(out);
-  return AL_EPASSWD;
+  return backend->commit(txn);
 }
 
-/* This is an internal function.  Its contract is to edit the passwd
- * file, changing the home directory field to homedir.
+/* This is an internal function.  Its contract is to undo the passwd
+ * changes recorded for each of the n users in usernames, as
+ * al__remove_from_passwd() does and restoring any home directory
+ * changed to a temporary one, in a single passwd database transaction.
  */
 
-int al__change_passwd_homedir(const char *username, const char *homedir)
+int al__revert_users_passwd(const char **usernames,
+			    struct al_record **records, int n)
 {
-  FILE *in = NULL, *out = NULL;
-  int bufsize, retval, len, i;
-  char *ptr1, *buf = NULL;
+  const struct al_pwbackend *backend = al__pwbackend();
+  struct al_record *record;
+  struct passwd *pwd;
+  void *txn = NULL;
+  int i, status = AL_SUCCESS;
 
-  out = lock_passwd();
-  if (!out)
-    return AL_EPASSWD;
-  in = fopen(PATH_PASSWD, "r");
-  if (!in)
+  for (i = 0; i < n; i++)
     {
-      discard_passwd_lockfile(out);
-      return AL_EPASSWD;
-    }
-  len = strlen(username);
+      record = records[i];
+      if (record->nss_passwd)
+	{
+	  pwd = al__parse_passwd_line(record->nss_passwd);
+	  if (pwd)
+	    {
+	      al__clear_uid_index(pwd->pw_uid);
+	      al__free_passwd(pwd);
+	    }
+	  free(record->nss_passwd);
+	  record->nss_passwd = NULL;
+	  continue;
+	}
+      if (!record->passwd_added && !record->old_homedir)
+	continue;
 
-  while ((retval = al__read_line(in, &buf, &bufsize)) == 0)
-    {
-      if (strncmp(username, buf, len) == 0 && buf[len] == ':')
+      if (!txn)
 	{
-	  /* Skip to colon before homedir field.  We start on
-	   * the first colon and skip HOMEDIR_FIELD-2 more). */
-	  for (ptr1 = buf + len, i = 0; ptr1 && i < HOMEDIR_FIELD - 2;
-	       ptr1 = strchr(ptr1 + 1, ':'), i++)
-	      ;
-	  if (!ptr1)
-	    continue;
-	  fwrite(buf, sizeof(char), ptr1 + 1 - buf, out);
-	  fputs(homedir, out);
-	  ptr1 = strchr(ptr1 + 1, ':');
-	  if (ptr1)
-	    fputs(ptr1, out);
-	  fputs("\n", out);
+	  txn = backend->lock();
+	  if (!txn)
+	    return AL_EPASSWD;
 	}
+      if (record->passwd_added)
+	status = backend->remove(txn, usernames[i]);
       else
+	status = backend->change_homedir(txn, usernames[i],
+					 record->old_homedir);
+      if (status != AL_SUCCESS)
 	{
-	  fputs(buf, out);
-	  fputs("\n", out);
+	  backend->abort(txn);
+	  return AL_EPASSWD;
 	}
     }
-  free(buf);
-  fclose(in);
-  if (retval == -1)
-    {
-      discard_passwd_lockfile(out);
-      return AL_EPASSWD;
-    }
 
-  return update_passwd(out);
+  return (txn) ? backend->commit(txn) : AL_SUCCESS;
 }
 
-#ifdef HAVE_LCKPWDF
-/* lckpwdf() is "for internal use only" and does not play nice with
- * alarms and the SIGALRM handler.  So we need to wrap it in a
- * function which restores the SIGALRM handler and alarm timer.
+/* This is an internal function.  Its contract is to edit the passwd
+ * database, changing the home directory field to homedir.  If the user
+ * is served by the NSS module, the passwd line in record is edited
+ * instead.
  */
-static int safe_lckpwdf(void)
+
+int al__change_passwd_homedir(const char *username, struct al_record *record,
+			      const char *homedir)
 {
-  struct sigaction act;
-  unsigned int sec;
-  int result;
-
-  sec = alarm(0);
-  sigaction(SIGALRM, NULL, &act);
-  result = lckpwdf();
-  sigaction(SIGALRM, &act, NULL);
-  alarm(sec);
-  return result;
+  const struct al_pwbackend *backend = al__pwbackend();
+  struct passwd *pwd;
+  char *buf;
+  void *txn;
+
+  if (record->nss_passwd)
+    {
+      pwd = al__parse_passwd_line(record->nss_passwd);
+      if (!pwd)
+	return AL_EPASSWD;
+      buf = malloc(strlen(record->nss_passwd) + strlen(homedir) + 1);
+      if (!buf)
+	{
+	  al__free_passwd(pwd);
+	  return AL_ENOMEM;
+	}
+      sprintf(buf, "%s:%s:%lu:%lu:%s:%s:%s", pwd->pw_name, pwd->pw_passwd,
+	      (unsigned long) pwd->pw_uid, (unsigned long) pwd->pw_gid,
+	      pwd->pw_gecos, homedir, pwd->pw_shell);
+      al__free_passwd(pwd);
+      free(record->nss_passwd);
+      record->nss_passwd = buf;
+      return AL_SUCCESS;
+    }
+
+  txn = backend->lock();
+  if (!txn)
+    return AL_EPASSWD;
+  if (backend->change_homedir(txn, username, homedir) != AL_SUCCESS)
+    {
+      backend->abort(txn);
+      return AL_EPASSWD;
+    }
+  return backend->commit(txn);
 }
-#endif
@@ -0,0 +1,711 @@
+/* Copyright 1997, 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements the
+ * passwd database backends which store entries in system files:
+ *
+ * 	* "passwd": an /etc/passwd file
+ * 	* "shadow": an /etc/passwd and /etc/shadow file
+ * 	* "master.passwd": an /etc/master.passwd file and associated
+ * 	  databases, rebuilt with pwd_mkdb (only on systems which have
+ * 	  one)
+ *
+ * All three share the same transaction code: edits are queued by the
+ * add, remove, and change_homedir operations and applied in a single
+ * rewrite of the files at commit time.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/param.h>
+#include <errno.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#ifdef HAVE_SHADOW
+#include <shadow.h>
+#endif
+#ifdef HAVE_MASTER_PASSWD
+#include <db.h>
+#include <utmp.h>
+#endif
+#include "al.h"
+#include "al_private.h"
+
+struct files_params {
+  const char *path;		/* passwd file */
+  const char *shadow_path;	/* shadow file, or NULL */
+  int homedir_field;		/* 1-based field number of homedir */
+  const char *extra_fields;	/* fields written after the gid */
+  mode_t tmp_mode;		/* mode of PATH_PASSWD_TMP */
+  int mkdb;			/* install with pwd_mkdb, not rename */
+};
+
+#define EDIT_ADD	0
+#define EDIT_REMOVE	1
+#define EDIT_HOMEDIR	2
+
+struct files_edit {
+  int type;
+  char *username;
+  char *line;			/* EDIT_ADD: passwd line */
+  char *shadow_line;		/* EDIT_ADD: shadow line */
+  char *homedir;		/* EDIT_HOMEDIR: new homedir */
+};
+
+struct files_txn {
+  const struct files_params *params;
+  FILE *out;
+  struct files_edit *edits;
+  int nedits;
+};
+
+static const struct files_params passwd_params = {
+  PATH_PASSWD, NULL, 6, "", S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH, 0
+};
+
+static const struct files_params shadow_params = {
+  PATH_PASSWD, PATH_SHADOW, 6, "", S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH, 0
+};
+
+#ifdef HAVE_MASTER_PASSWD
+/* /etc/ptmp should be mode 600 on a master.passwd system. */
+static const struct files_params master_params = {
+  PATH_MASTER_PASSWD, NULL, 9, "::0:0", S_IWUSR|S_IRUSR, 1
+};
+#endif
+
+#ifdef HAVE_LCKPWDF
+static int safe_lckpwdf(void);
+#endif
+
+/* If username is NULL, it's a lookup by uid; otherwise it's by name. */
+static struct passwd *lookup(const char *path, const char *username, uid_t uid)
+{
+  /* BSD 4.3 has /etc/passwd and /etc/passwd.{dir,pag}.  Only implement
+   * reading /etc/passwd, since the DBM routines aren't reentrant and
+   * we don't really need that level of performance in the login system
+   * anyway. */
+  FILE *fp;
+  int linesize, len = (username) ? strlen(username) : 0;
+  struct passwd *pwd;
+  char *line = NULL, *buffer;
+  const char *p;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  while (al__read_line(fp, &line, &linesize) == 0)
+    {
+      /* See if we got the right entry. */
+      if (username && (strncmp(line, username, len) != 0 || line[len] != ':'))
+	continue;
+      if (!username)
+	{
+	  p = strchr(line, ':');
+	  if (p)
+	    p = strchr(p + 1, ':');
+	  if (!p || atoi(p + 1) != uid)
+	    continue;
+	}
+
+      /* Allocate space for the return value. */
+      buffer = malloc(sizeof(struct passwd) + strlen(line) + 1);
+      if (!buffer)
+	{
+	  free(line);
+	  fclose(fp);
+	  return NULL;
+	}
+      pwd = (struct passwd *) buffer;
+      buffer += sizeof(struct passwd);
+      strcpy(buffer, line);
+
+#if defined(BSD) || defined(ultrix)
+      pwd->pw_quota = 0;
+      pwd->pw_comment = "";
+#endif
+
+      /* Set the fields of the returned structure. */
+#define BAD_LINE	{ free(pwd); break; }
+#define NEXT_FIELD	{ buffer = strchr(buffer, ':'); \
+	if (!buffer) BAD_LINE; *buffer++ = 0; }
+#define FIELD(v)	{ v = buffer; NEXT_FIELD; }
+      FIELD(pwd->pw_name);
+      FIELD(pwd->pw_passwd);
+      if (!isdigit((unsigned char)*buffer))
+	BAD_LINE;
+      pwd->pw_uid = atoi(buffer);
+      NEXT_FIELD;
+      if (!isdigit((unsigned char)*buffer))
+	BAD_LINE;
+      pwd->pw_gid = atoi(buffer);
+      NEXT_FIELD;
+      FIELD(pwd->pw_gecos);
+      FIELD(pwd->pw_dir);
+      pwd->pw_shell = buffer;
+      buffer[strlen(buffer) - 1] = 0;
+      fclose(fp);
+      free(line);
+      return pwd;
+#undef BAD_LINE
+#undef NEXT_FIELD
+#undef FIELD
+    }
+
+  /* We lost. */
+  free(line);
+  fclose(fp);
+  return NULL;
+}
+
+static struct passwd *passwd_getpwnam(const char *username)
+{
+  return lookup(PATH_PASSWD, username, 0);
+}
+
+static struct passwd *passwd_getpwuid(uid_t uid)
+{
+  return lookup(PATH_PASSWD, NULL, uid);
+}
+
+#ifdef HAVE_MASTER_PASSWD
+static struct passwd *db_lookup(const DBT *key);
+
+static struct passwd *master_getpwnam(const char *username)
+{
+  DBT key;
+  char buf[UT_NAMESIZE + 1];
+  int len;
+
+  len = strlen(username);
+  if (len > UT_NAMESIZE)
+    len = UT_NAMESIZE;
+  buf[0] = _PW_KEYBYNAME;
+  memcpy(buf + 1, username, len);
+  key.data = buf;
+  key.size = len + 1;
+  return db_lookup(&key);
+}
+
+static struct passwd *master_getpwuid(uid_t uid)
+{
+  DBT key;
+  char buf[128];
+
+  sprintf(buf, "%c%d", _PW_KEYBYUID, (int) uid);
+  key.data = buf;
+  key.size = strlen(buf);
+  return db_lookup(&key);
+}
+
+static struct passwd *db_lookup(const DBT *key)
+{
+  DB *db;
+  DBT value;
+  char *buffer;
+  struct passwd *pwd;
+
+  /* Open the insecure or secure database depending on whether we're root. */
+  db = _dbopen(_PATH_SMP_DB, O_RDONLY, 0, DB_HASH, NULL);
+  if (!db)
+    db = _dbopen(_PATH_MP_DB, O_RDONLY, 0, DB_HASH, NULL);
+  if (!db)
+    return NULL;
+
+  /* Look up the username. */
+  if (db->get(db, key, &value, 0) != 0)
+    {
+      db->close(db);
+      return NULL;
+    }
+  buffer = malloc(sizeof(struct passwd) + value.size);
+  if (!buffer)
+    {
+      db->close(db);
+      return NULL;
+    }
+  pwd = (struct passwd *) buffer;
+  buffer += sizeof(struct passwd);
+  memcpy(buffer, value.data, value.size);
+#define FIELD(v) v = buffer; buffer += strlen(buffer) + 1
+  FIELD(pwd->pw_name);
+  FIELD(pwd->pw_passwd);
+  memcpy(&pwd->pw_uid, buffer, sizeof(int));
+  memcpy(&pwd->pw_gid, buffer + sizeof(int), sizeof(int));
+  memcpy(&pwd->pw_change, buffer + 2 * sizeof(int), sizeof(time_t));
+  buffer += 2 * sizeof(int) + sizeof(time_t);
+  FIELD(pwd->pw_class);
+  FIELD(pwd->pw_gecos);
+  FIELD(pwd->pw_dir);
+  FIELD(pwd->pw_shell);
+  memcpy(&pwd->pw_expire, buffer, sizeof(time_t));
+#undef FIELD
+  db->close(db);
+  return pwd;
+}
+#endif /* HAVE_MASTER_PASSWD */
+
+/* Lock the passwd database in a manner consistent with the operating
+ * system and start a transaction whose output goes to a temporary file
+ * (which may or may not also be the lock file).
+ */
+static void *files_lock(const struct files_params *params)
+{
+  struct files_txn *txn;
+  FILE *fp;
+#ifndef HAVE_LCKPWDF
+  int i, fd = -1;
+#endif
+
+  txn = malloc(sizeof(struct files_txn));
+  if (!txn)
+    return NULL;
+
+#ifdef HAVE_LCKPWDF
+  if (safe_lckpwdf() == -1)
+    {
+      free(txn);
+      return NULL;
+    }
+  fp = fopen(PATH_PASSWD_TMP, "w");
+  if (fp)
+    fchmod(fileno(fp), params->tmp_mode);
+  else
+    ulckpwdf();
+#else
+  for (i = 0; i < 10; i++)
+    {
+      fd = open(PATH_PASSWD_TMP, O_RDWR|O_CREAT|O_EXCL, params->tmp_mode);
+      if (fd >= 0 || errno != EEXIST)
+	break;
+      sleep(1);
+    }
+  fp = (fd == -1) ? NULL : fdopen(fd, "w");
+  if (fd != -1 && fp == NULL)
+    {
+      close(fd);
+      unlink(PATH_PASSWD_TMP);
+    }
+#endif
+
+  if (!fp)
+    {
+      free(txn);
+      return NULL;
+    }
+  txn->params = params;
+  txn->out = fp;
+  txn->edits = NULL;
+  txn->nedits = 0;
+  return txn;
+}
+
+static void *passwd_lock(void)
+{
+  return files_lock(&passwd_params);
+}
+
+static void *shadow_lock(void)
+{
+  return files_lock(&shadow_params);
+}
+
+#ifdef HAVE_MASTER_PASSWD
+static void *master_lock(void)
+{
+  return files_lock(&master_params);
+}
+#endif
+
+/* Free a transaction's memory. */
+static void free_txn(struct files_txn *txn)
+{
+  int i;
+
+  for (i = 0; i < txn->nedits; i++)
+    {
+      free(txn->edits[i].username);
+      free(txn->edits[i].line);
+      free(txn->edits[i].shadow_line);
+      free(txn->edits[i].homedir);
+    }
+  free(txn->edits);
+  free(txn);
+}
+
+/* Abandon a transaction, discarding the temporary file and releasing
+ * the lock.
+ */
+static void files_abort(void *txnp)
+{
+  struct files_txn *txn = txnp;
+
+  fclose(txn->out);
+  unlink(PATH_PASSWD_TMP);
+#ifdef HAVE_LCKPWDF
+  ulckpwdf();
+#endif
+  free_txn(txn);
+}
+
+/* Queue an edit.  Return a pointer to it, or NULL if out of memory. */
+static struct files_edit *new_edit(struct files_txn *txn, int type,
+				   const char *username)
+{
+  struct files_edit *edits, *edit;
+
+  edits = realloc(txn->edits, (txn->nedits + 1) * sizeof(struct files_edit));
+  if (!edits)
+    return NULL;
+  txn->edits = edits;
+  edit = &edits[txn->nedits];
+  edit->type = type;
+  edit->line = edit->shadow_line = edit->homedir = NULL;
+  edit->username = strdup(username);
+  if (!edit->username)
+    return NULL;
+  txn->nedits++;
+  return edit;
+}
+
+static int files_add(void *txnp, const struct passwd *pwd)
+{
+  struct files_txn *txn = txnp;
+  const struct files_params *params = txn->params;
+  struct files_edit *edit;
+  int len;
+
+  edit = new_edit(txn, EDIT_ADD, pwd->pw_name);
+  if (!edit)
+    return AL_ENOMEM;
+  len = strlen(pwd->pw_name) + strlen(pwd->pw_passwd) + strlen(pwd->pw_gecos)
+    + strlen(pwd->pw_dir) + strlen(pwd->pw_shell) + 64;
+  edit->line = malloc(len);
+  if (params->shadow_path)
+    edit->shadow_line = malloc(len);
+  if (!edit->line || (params->shadow_path && !edit->shadow_line))
+    return AL_ENOMEM;
+
+  sprintf(edit->line, "%s:%s:%lu:%lu%s:%s:%s:%s", pwd->pw_name,
+	  (params->shadow_path) ? "x" : pwd->pw_passwd,
+	  (unsigned long) pwd->pw_uid, (unsigned long) pwd->pw_gid,
+	  params->extra_fields,
+	  pwd->pw_gecos, pwd->pw_dir, pwd->pw_shell);
+  if (params->shadow_path)
+    {
+      sprintf(edit->shadow_line, "%s:%s:%lu::::::", pwd->pw_name,
+	      pwd->pw_passwd, (unsigned long) (time(NULL) / (60 * 60 * 24)));
+    }
+  return AL_SUCCESS;
+}
+
+static int files_remove(void *txnp, const char *username)
+{
+  return (new_edit(txnp, EDIT_REMOVE, username)) ? AL_SUCCESS : AL_ENOMEM;
+}
+
+static int files_change_homedir(void *txnp, const char *username,
+				const char *homedir)
+{
+  struct files_edit *edit;
+
+  edit = new_edit(txnp, EDIT_HOMEDIR, username);
+  if (!edit)
+    return AL_ENOMEM;
+  edit->homedir = strdup(homedir);
+  return (edit->homedir) ? AL_SUCCESS : AL_ENOMEM;
+}
+
+/* Return the last queued edit of a non-add type which applies to the
+ * passwd or shadow line in line, or NULL if there is none.
+ */
+static struct files_edit *find_edit(struct files_txn *txn, const char *line)
+{
+  int i, len;
+
+  for (i = txn->nedits - 1; i >= 0; i--)
+    {
+      if (txn->edits[i].type == EDIT_ADD)
+	continue;
+      len = strlen(txn->edits[i].username);
+      if (strncmp(txn->edits[i].username, line, len) == 0
+	  && line[len] == ':')
+	return &txn->edits[i];
+    }
+  return NULL;
+}
+
+/* Copy the passwd file into the transaction's temporary file, applying
+ * the queued edits.  Return 0 on success, -1 on failure.
+ */
+static int write_passwd(struct files_txn *txn)
+{
+  const struct files_params *params = txn->params;
+  struct files_edit *edit;
+  FILE *in;
+  char *buf = NULL, *ptr1;
+  int bufsize, retval, i;
+
+  in = fopen(params->path, "r");
+  if (!in)
+    return -1;
+
+  while ((retval = al__read_line(in, &buf, &bufsize)) == 0)
+    {
+      edit = find_edit(txn, buf);
+      if (edit && edit->type == EDIT_REMOVE)
+	continue;
+      if (edit && edit->type == EDIT_HOMEDIR)
+	{
+	  /* Skip to colon before homedir field.  We start on
+	   * the first colon and skip homedir_field-2 more). */
+	  for (ptr1 = buf + strlen(edit->username), i = 0;
+	       ptr1 && i < params->homedir_field - 2;
+	       ptr1 = strchr(ptr1 + 1, ':'), i++)
+	      ;
+	  if (!ptr1)
+	    continue;
+	  fwrite(buf, sizeof(char), ptr1 + 1 - buf, txn->out);
+	  fputs(edit->homedir, txn->out);
+	  ptr1 = strchr(ptr1 + 1, ':');
+	  if (ptr1)
+	    fputs(ptr1, txn->out);
+	  fputs("\n", txn->out);
+	}
+      else
+	{
+	  fputs(buf, txn->out);
+	  fputs("\n", txn->out);
+	}
+    }
+  free(buf);
+  if (fclose(in) || retval == -1)
+    return -1;
+
+  for (i = 0; i < txn->nedits; i++)
+    {
+      if (txn->edits[i].type == EDIT_ADD)
+	fprintf(txn->out, "%s\n", txn->edits[i].line);
+    }
+  return 0;
+}
+
+/* Replace the shadow file, applying the queued edits.  An added user
+ * who already has a shadow entry keeps it.  Return 0 on success, -1 on
+ * failure.
+ */
+static int write_shadow(struct files_txn *txn)
+{
+  const struct files_params *params = txn->params;
+  struct files_edit *edit;
+  FILE *in = NULL, *out = NULL;
+  char *buf = NULL;
+  int bufsize, retval, fd, i, len;
+
+  fd = open(PATH_SHADOW_TMP, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
+  if (fd < 0)
+    return -1;
+  out = fdopen(fd, "w");
+  if (!out)
+    {
+      close(fd);
+      unlink(PATH_SHADOW_TMP);
+      return -1;
+    }
+  in = fopen(params->shadow_path, "r");
+  if (!in)
+    goto cleanup;
+
+  while ((retval = al__read_line(in, &buf, &bufsize)) == 0)
+    {
+      edit = find_edit(txn, buf);
+      if (edit && edit->type == EDIT_REMOVE)
+	continue;
+
+      /* Note if there is already an entry for a user being added. */
+      for (i = 0; i < txn->nedits; i++)
+	{
+	  edit = &txn->edits[i];
+	  len = strlen(edit->username);
+	  if (edit->type == EDIT_ADD && strncmp(edit->username, buf, len) == 0
+	      && buf[len] == ':')
+	    {
+	      free(edit->shadow_line);
+	      edit->shadow_line = NULL;
+	    }
+	}
+      fprintf(out, "%s\n", buf);
+    }
+  if (retval == -1)
+    goto cleanup;
+
+  /* Add entries for users which did not already have one. */
+  for (i = 0; i < txn->nedits; i++)
+    {
+      if (txn->edits[i].type == EDIT_ADD && txn->edits[i].shadow_line)
+	fprintf(out, "%s\n", txn->edits[i].shadow_line);
+    }
+
+  fflush(out);
+  retval = (fsync(fileno(out)) == -1);
+  retval = ferror(out) || retval;
+  retval = fclose(out) || retval;
+  out = NULL;
+  if (retval)
+    goto cleanup;
+  retval = fclose(in);
+  in = NULL;
+  if (retval)
+    goto cleanup;
+  if (rename(PATH_SHADOW_TMP, params->shadow_path))
+    goto cleanup;
+  free(buf);
+  return 0;
+
+cleanup:
+  free(buf);
+  if (in)
+    fclose(in);
+  if (out)
+    {
+      fclose(out);
+      unlink(PATH_SHADOW_TMP);
+    }
+  return -1;
+}
+
+/* Move the temporary file into place as the passwd file, running
+ * pwd_mkdb if the backend's databases need rebuilding.  Return 0 on
+ * success, -1 on failure.
+ */
+static int install_passwd(const struct files_params *params)
+{
+#ifdef HAVE_MASTER_PASSWD
+  static char *argv[] = { "pwd_mkdb", "-p", PATH_PASSWD_TMP, NULL };
+  pid_t pid, rpid;
+  int pstat;
+
+  if (params->mkdb)
+    {
+      pid = al__spawn(_PATH_PWD_MKDB, argv, 0, 0, 0);
+      if (pid == -1)
+	return -1;
+      while ((rpid = waitpid(pid, &pstat, 0)) < 0 && errno == EINTR)
+	;
+      if (rpid == -1 || !WIFEXITED(pstat) || WEXITSTATUS(pstat) != 0)
+	return -1;
+      return 0;
+    }
+#endif
+
+  return (rename(PATH_PASSWD_TMP, params->path) == 0) ? 0 : -1;
+}
+
+/* Apply the queued edits, replace the passwd file with the temporary
+ * file, and release the lock.
+ */
+static int files_commit(void *txnp)
+{
+  struct files_txn *txn = txnp;
+  const struct files_params *params = txn->params;
+  int status;
+
+  if (write_passwd(txn) == -1
+      || (params->shadow_path && write_shadow(txn) == -1))
+    {
+      files_abort(txn);
+      return AL_EPASSWD;
+    }
+
+  fflush(txn->out);
+  status = (fsync(fileno(txn->out)) == -1);
+  status = ferror(txn->out) || status;
+  status = fclose(txn->out) || status;
+  txn->out = NULL;
+
+  /* Replace the passwd file with the lock file. */
+  if (status || install_passwd(params) == -1)
+    {
+      unlink(PATH_PASSWD_TMP);
+#ifdef HAVE_LCKPWDF
+      ulckpwdf();
+#endif
+      free_txn(txn);
+      return AL_EPASSWD;
+    }
+
+#ifdef sgi
+  /* Kludge: nsd has a one-second granularity in checking the mod time
+   * of a file, so make sure we don't modify it twice within a second.
+   */
+  sleep(1);
+#endif
+
+  /* Unlock the passwd file if we're using System V style locking. */
+#ifdef HAVE_LCKPWDF
+  ulckpwdf();
+#endif
+
+  free_txn(txn);
+  return AL_SUCCESS;
+}
+
+const struct al_pwbackend al__passwd_backend = {
+  "passwd", passwd_getpwnam, passwd_getpwuid, passwd_lock, files_add,
+  files_remove, files_change_homedir, files_commit, files_abort
+};
+
+const struct al_pwbackend al__shadow_backend = {
+  "shadow", passwd_getpwnam, passwd_getpwuid, shadow_lock, files_add,
+  files_remove, files_change_homedir, files_commit, files_abort
+};
+
+#ifdef HAVE_MASTER_PASSWD
+const struct al_pwbackend al__master_backend = {
+  "master.passwd", master_getpwnam, master_getpwuid, master_lock, files_add,
+  files_remove, files_change_homedir, files_commit, files_abort
+};
+#endif
+
+#ifdef HAVE_LCKPWDF
+/* lckpwdf() is "for internal use only" and does not play nice with
+ * alarms and the SIGALRM handler.  So we need to wrap it in a
+ * function which restores the SIGALRM handler and alarm timer.
+ */
+static int safe_lckpwdf(void)
+{
+  struct sigaction act;
+  unsigned int sec;
+  int result;
+
+  sec = alarm(0);
+  sigaction(SIGALRM, NULL, &act);
+  result = lckpwdf();
+  sigaction(SIGALRM, &act, NULL);
+  alarm(sec);
+  return result;
+}
+#endif
@@ -0,0 +1,236 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements the
+ * "memory" passwd database backend, which keeps entries in the memory
+ * of the current process.  It is useful for measuring the account
+ * creation and reversion logic without filesystem noise, and for
+ * test programs; entries added by one process are not visible to any
+ * other.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include "al.h"
+#include "al_private.h"
+
+static struct passwd **entries;
+static int nentries;
+
+/* Return a copy of pwd, with homedir in place of its home directory
+ * if homedir is not NULL, allocated as a single block so that
+ * al__free_passwd() can free it.
+ */
+static struct passwd *copy_passwd(const struct passwd *pwd,
+				  const char *homedir)
+{
+  struct passwd *copy;
+  char *p;
+
+  if (!homedir)
+    homedir = pwd->pw_dir;
+  copy = malloc(sizeof(struct passwd) + strlen(pwd->pw_name)
+		+ strlen(pwd->pw_passwd) + strlen(pwd->pw_gecos)
+		+ strlen(homedir) + strlen(pwd->pw_shell) + 5);
+  if (!copy)
+    return NULL;
+  *copy = *pwd;
+  p = (char *) (copy + 1);
+#define FIELD(v, s) { v = p; strcpy(p, s); p += strlen(p) + 1; }
+  FIELD(copy->pw_name, pwd->pw_name);
+  FIELD(copy->pw_passwd, pwd->pw_passwd);
+  FIELD(copy->pw_gecos, pwd->pw_gecos);
+  FIELD(copy->pw_dir, homedir);
+  FIELD(copy->pw_shell, pwd->pw_shell);
+#undef FIELD
+#ifdef HAVE_MASTER_PASSWD
+  copy->pw_class = "";
+#endif
+  return copy;
+}
+
+static int find(const char *username)
+{
+  int i;
+
+  for (i = 0; i < nentries; i++)
+    {
+      if (strcmp(entries[i]->pw_name, username) == 0)
+	return i;
+    }
+  return -1;
+}
+
+static struct passwd *mem_getpwnam(const char *username)
+{
+  int i = find(username);
+
+  return (i == -1) ? NULL : copy_passwd(entries[i], NULL);
+}
+
+static struct passwd *mem_getpwuid(uid_t uid)
+{
+  int i;
+
+  for (i = 0; i < nentries; i++)
+    {
+      if (entries[i]->pw_uid == uid)
+	return copy_passwd(entries[i], NULL);
+    }
+  return NULL;
+}
+
+/* There is no one else to lock out, so edits take effect immediately.
+ * So that an aborted transaction can be undone, the transaction keeps
+ * a copy of the entries array as it was when the transaction began.
+ * Entries removed or replaced during the transaction are freed only
+ * when it commits, and entries it created only when it aborts.
+ */
+struct mem_txn {
+  struct passwd **saved;	/* Entries array at the start */
+  int nsaved;
+  struct passwd **dropped;	/* Entries to free on commit */
+  int ndropped;
+  struct passwd **created;	/* Entries to free on abort */
+  int ncreated;
+};
+
+static int push(struct passwd ***list, int *n, struct passwd *pwd)
+{
+  struct passwd **newlist;
+
+  newlist = realloc(*list, (*n + 1) * sizeof(struct passwd *));
+  if (!newlist)
+    return AL_ENOMEM;
+  *list = newlist;
+  newlist[(*n)++] = pwd;
+  return AL_SUCCESS;
+}
+
+static void free_txn(struct mem_txn *txn)
+{
+  free(txn->saved);
+  free(txn->dropped);
+  free(txn->created);
+  free(txn);
+}
+
+static void *mem_lock(void)
+{
+  struct mem_txn *txn;
+
+  txn = calloc(1, sizeof(struct mem_txn));
+  if (!txn)
+    return NULL;
+  if (nentries > 0)
+    {
+      txn->saved = malloc(nentries * sizeof(struct passwd *));
+      if (!txn->saved)
+	{
+	  free(txn);
+	  return NULL;
+	}
+      memcpy(txn->saved, entries, nentries * sizeof(struct passwd *));
+    }
+  txn->nsaved = nentries;
+  return txn;
+}
+
+static int mem_add(void *txnp, const struct passwd *pwd)
+{
+  struct mem_txn *txn = txnp;
+  struct passwd *copy;
+
+  copy = copy_passwd(pwd, NULL);
+  if (!copy)
+    return AL_ENOMEM;
+  if (push(&txn->created, &txn->ncreated, copy) != AL_SUCCESS)
+    {
+      free(copy);
+      return AL_ENOMEM;
+    }
+  /* On failure, the copy is freed with the created entries on abort. */
+  return push(&entries, &nentries, copy);
+}
+
+static int mem_remove(void *txnp, const char *username)
+{
+  struct mem_txn *txn = txnp;
+  int i = find(username);
+
+  if (i != -1)
+    {
+      if (push(&txn->dropped, &txn->ndropped, entries[i]) != AL_SUCCESS)
+	return AL_ENOMEM;
+      entries[i] = entries[--nentries];
+    }
+  return AL_SUCCESS;
+}
+
+static int mem_change_homedir(void *txnp, const char *username,
+			      const char *homedir)
+{
+  struct mem_txn *txn = txnp;
+  struct passwd *copy;
+  int i = find(username);
+
+  if (i == -1)
+    return AL_EPASSWD;
+  copy = copy_passwd(entries[i], homedir);
+  if (!copy)
+    return AL_ENOMEM;
+  if (push(&txn->created, &txn->ncreated, copy) != AL_SUCCESS)
+    {
+      free(copy);
+      return AL_ENOMEM;
+    }
+  if (push(&txn->dropped, &txn->ndropped, entries[i]) != AL_SUCCESS)
+    return AL_ENOMEM;
+  entries[i] = copy;
+  return AL_SUCCESS;
+}
+
+static int mem_commit(void *txnp)
+{
+  struct mem_txn *txn = txnp;
+  int i;
+
+  for (i = 0; i < txn->ndropped; i++)
+    free(txn->dropped[i]);
+  free_txn(txn);
+  return AL_SUCCESS;
+}
+
+static void mem_abort(void *txnp)
+{
+  struct mem_txn *txn = txnp;
+  int i;
+
+  for (i = 0; i < txn->ncreated; i++)
+    free(txn->created[i]);
+  free(entries);
+  entries = txn->saved;
+  nentries = txn->nsaved;
+  txn->saved = NULL;
+  free_txn(txn);
+}
+
+const struct al_pwbackend al__memory_backend = {
+  "memory", mem_getpwnam, mem_getpwuid, mem_lock, mem_add, mem_remove,
+  mem_change_homedir, mem_commit, mem_abort
+};
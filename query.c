@@ -0,0 +1,70 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements
+ * functions to examine a user's session record without modifying it.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "al.h"
+#include "al_private.h"
+
+/* The al_session_query() function reads username's session record
+ * into session.  It takes no locks and leaves the signal state alone,
+ * so it never waits for or delays a login in progress, and does not
+ * create a record if there is none.
+ */
+
+int al_session_query(const char *username, struct al_session *session)
+{
+  struct al_record record;
+  int retval;
+
+  memset(session, 0, sizeof(struct al_session));
+  if (!al__username_valid(username))
+    return AL_EPERM;
+
+  retval = al__snapshot_session_record(username, &record);
+  if (retval != AL_SUCCESS)
+    return retval;
+
+  /* Hand the record's fields over to the caller. */
+  session->exists = record.exists;
+  session->passwd_added = record.passwd_added;
+  session->attached = record.attached;
+  session->old_homedir = record.old_homedir;
+  session->groups = record.groups;
+  session->ngroups = record.ngroups;
+  session->pids = record.pids;
+  session->npids = record.npids;
+  free(record.starts);
+  free(record.nss_passwd);
+  free(record.nss_groups);
+  return AL_SUCCESS;
+}
+
+void al_free_session(struct al_session *session)
+{
+  free(session->old_homedir);
+  free(session->groups);
+  free(session->pids);
+  memset(session, 0, sizeof(struct al_session));
+}
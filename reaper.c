@@ -0,0 +1,508 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements a
+ * session reaper, which reverts a user's account as soon as the
+ * user's last login session exits.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "al.h"
+#include "al_private.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_PIDFD_OPEN)
+#define USE_PIDFD
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#endif
+
+extern char *al__session_dir;
+
+/* Where the system supports it, the reaper holds a pidfd for each pid
+ * listed in a session record and waits for them with epoll; a pidfd
+ * becomes readable when its process exits, and the pid is then removed
+ * with al_acct_revert().  New pids are found by watching the session
+ * directory with inotify, which sees records of the flat files layout
+ * being written, and by rescanning every record every
+ * "reaper_interval" seconds, which catches the rest.  Elsewhere, the
+ * reaper calls al_acct_cleanup_all() every "reaper_interval" seconds.
+ *
+ * When "deferred_detach" is set, the reaper also runs the detaches left
+ * pending by logouts, its own included, once it has seen one pending
+ * and before it next waits.  Likewise, when "linger" is set, it wakes
+ * when the earliest linger it has seen ends, to revert the accounts of
+ * users who have not logged back in.
+ */
+
+#define DEFAULT_INTERVAL	60
+#define WATCH_BUCKETS		1021
+#define MAX_EVENTS		64
+
+struct watch {
+  pid_t pid;
+  unsigned long long start;	/* Start time from the session record */
+  int fd;			/* pidfd */
+  unsigned int generation;	/* Scan which last saw the pid */
+  char *username;
+  struct watch *next;
+};
+
+struct al_reaper {
+  int epfd;			/* -1 if polling with al_acct_cleanup_all() */
+  int inotify_fd;
+  unsigned int generation;
+  time_t next_scan;
+  long interval;
+  int pending;			/* A detach may have been left pending */
+  time_t linger_until;		/* Earliest linger end seen, or 0 */
+  struct watch *watches[WATCH_BUCKETS];
+};
+
+#ifdef USE_PIDFD
+static int scan_all(struct al_reaper *reaper);
+static int scan_user(struct al_reaper *reaper, const char *username,
+		     int sweep_user);
+static int add_watch(struct al_reaper *reaper, const char *username,
+		     pid_t pid, unsigned long long start);
+static void remove_watch(struct al_reaper *reaper, struct watch *w);
+static void sweep(struct al_reaper *reaper, const char *username);
+static int read_notifications(struct al_reaper *reaper);
+static int revert_session(struct al_reaper *reaper, const char *username,
+			  pid_t pid, unsigned long long start);
+static void note_linger(struct al_reaper *reaper, time_t until);
+#endif
+
+/* The al_reaper_open() function creates a session reaper, to be run
+ * with al_reaper_run() by a process with the privileges needed to
+ * revert accounts.
+ */
+
+int al_reaper_open(struct al_reaper **reaper)
+{
+  struct al_reaper *r;
+#ifdef USE_PIDFD
+  struct epoll_event event;
+  int fd;
+#endif
+
+  r = calloc(1, sizeof(struct al_reaper));
+  if (!r)
+    return AL_ENOMEM;
+  r->epfd = -1;
+  r->inotify_fd = -1;
+  r->interval = al__config_number("reaper_interval", DEFAULT_INTERVAL);
+  if (r->interval <= 0)
+    r->interval = DEFAULT_INTERVAL;
+
+#ifdef USE_PIDFD
+  /* Fall back to polling if the running kernel lacks pidfds. */
+  fd = syscall(SYS_pidfd_open, getpid(), 0);
+  if (fd != -1)
+    {
+      close(fd);
+      r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+#ifdef HAVE_SYS_INOTIFY_H
+  if (r->epfd != -1)
+    {
+      r->inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+      if (r->inotify_fd != -1
+	  && inotify_add_watch(r->inotify_fd, al__session_dir,
+			       IN_MODIFY|IN_MOVED_TO) == -1)
+	{
+	  close(r->inotify_fd);
+	  r->inotify_fd = -1;
+	}
+      if (r->inotify_fd != -1)
+	{
+	  memset(&event, 0, sizeof(event));
+	  event.events = EPOLLIN;
+	  event.data.ptr = NULL;
+	  epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->inotify_fd, &event);
+	}
+    }
+#endif
+#endif
+
+  *reaper = r;
+  return AL_SUCCESS;
+}
+
+/* The al_reaper_fd() function returns a descriptor which becomes
+ * readable when al_reaper_run() has work to do, for callers with their
+ * own event loop, or -1 if the reaper only polls.  Such callers must
+ * still call al_reaper_run() at least every "reaper_interval" seconds.
+ */
+
+int al_reaper_fd(struct al_reaper *reaper)
+{
+  return reaper->epfd;
+}
+
+/* The al_reaper_run() function waits up to timeout milliseconds (or
+ * indefinitely if timeout is negative) for login sessions to exit,
+ * reverting the accounts of users whose last session has exited.  It
+ * returns early after handling any exits.
+ */
+
+int al_reaper_run(struct al_reaper *reaper, int timeout)
+{
+  time_t now;
+  long wait;
+  int retval, reterr = AL_SUCCESS;
+#ifdef USE_PIDFD
+  struct epoll_event events[MAX_EVENTS];
+  struct watch *w;
+  char *username;
+  unsigned long long start;
+  pid_t pid;
+  int i, n, notified = 0;
+#endif
+
+  now = time(NULL);
+  if (now >= reaper->next_scan)
+    {
+#ifdef USE_PIDFD
+      if (reaper->epfd != -1)
+	reterr = scan_all(reaper);
+      else
+#endif
+	reterr = al_acct_cleanup_all();
+      reaper->next_scan = now + reaper->interval;
+    }
+
+  if (reaper->pending || (reaper->linger_until && now >= reaper->linger_until))
+    {
+      reaper->pending = 0;
+      retval = al__cleanup_deferred(&reaper->linger_until);
+      if (retval != AL_SUCCESS)
+	reterr = retval;
+    }
+
+  wait = (reaper->next_scan - now) * 1000;
+  if (reaper->linger_until && (reaper->linger_until - now) * 1000 < wait)
+    wait = (reaper->linger_until - now) * 1000;
+  if (timeout >= 0 && timeout < wait)
+    wait = timeout;
+
+#ifdef USE_PIDFD
+  if (reaper->epfd != -1)
+    {
+      n = epoll_wait(reaper->epfd, events, MAX_EVENTS, wait);
+      if (n == -1)
+	return (errno == EINTR) ? reterr : AL_ESESSION;
+
+      /* Handle exits first, since rescanning a record may free other
+       * watches in events.
+       */
+      for (i = 0; i < n; i++)
+	{
+	  w = events[i].data.ptr;
+	  if (!w)
+	    {
+	      notified = 1;
+	      continue;
+	    }
+	  username = w->username;
+	  pid = w->pid;
+	  start = w->start;
+	  w->username = NULL;
+	  remove_watch(reaper, w);
+	  retval = revert_session(reaper, username, pid, start);
+	  if (retval != AL_SUCCESS)
+	    reterr = retval;
+	  free(username);
+	}
+      if (notified)
+	{
+	  retval = read_notifications(reaper);
+	  if (retval != AL_SUCCESS)
+	    reterr = retval;
+	}
+      return reterr;
+    }
+#endif
+
+  poll(NULL, 0, wait);
+  return reterr;
+}
+
+/* The al_reaper_close() function frees a session reaper. */
+
+void al_reaper_close(struct al_reaper *reaper)
+{
+  struct watch *w, *next;
+  int i;
+
+  for (i = 0; i < WATCH_BUCKETS; i++)
+    {
+      for (w = reaper->watches[i]; w; w = next)
+	{
+	  next = w->next;
+	  close(w->fd);
+	  free(w->username);
+	  free(w);
+	}
+    }
+  if (reaper->inotify_fd != -1)
+    close(reaper->inotify_fd);
+  if (reaper->epfd != -1)
+    close(reaper->epfd);
+  free(reaper);
+}
+
+#ifdef USE_PIDFD
+
+/* Watch every pid in every session record, and stop watching pids
+ * which have left their records.
+ */
+static int scan_all(struct al_reaper *reaper)
+{
+  void *iter;
+  const char *username;
+  int retval, reterr = AL_SUCCESS;
+
+  iter = al__session_iter_open();
+  if (!iter)
+    return AL_ESESSION;
+  reaper->generation++;
+  while ((username = al__session_iter_next(iter)) != NULL)
+    {
+      retval = scan_user(reaper, username, 0);
+      if (retval != AL_SUCCESS)
+	reterr = retval;
+    }
+  al__session_iter_close(iter);
+  sweep(reaper, NULL);
+  return reterr;
+}
+
+/* Watch every pid in username's session record.  If sweep_user is set,
+ * stop watching username's pids which have left the record.
+ */
+static int scan_user(struct al_reaper *reaper, const char *username,
+		     int sweep_user)
+{
+  struct al_record record;
+  struct watch *w;
+  int i, retval, reterr = AL_SUCCESS;
+
+  if (al__snapshot_session_record(username, &record) != AL_SUCCESS)
+    return AL_SUCCESS;
+  if (record.detach_pending)
+    reaper->pending = 1;
+  if (record.exists && record.npids == 0 && record.linger_until)
+    note_linger(reaper, record.linger_until);
+  if (sweep_user)
+    reaper->generation++;
+
+  for (i = 0; i < record.npids; i++)
+    {
+      for (w = reaper->watches[record.pids[i] % WATCH_BUCKETS]; w;
+	   w = w->next)
+	{
+	  if (w->pid == record.pids[i] && w->start == record.starts[i]
+	      && strcmp(w->username, username) == 0)
+	    break;
+	}
+      if (w)
+	w->generation = reaper->generation;
+      else
+	{
+	  retval = add_watch(reaper, username, record.pids[i],
+			     record.starts[i]);
+	  if (retval != AL_SUCCESS)
+	    reterr = retval;
+	}
+    }
+  al__free_record(&record);
+
+  if (sweep_user)
+    sweep(reaper, username);
+  return reterr;
+}
+
+/* Start watching pid, which started at time start, on username's
+ * behalf.  If pid has already exited or been reused, remove it from
+ * username's record right away.
+ */
+static int add_watch(struct al_reaper *reaper, const char *username,
+		     pid_t pid, unsigned long long start)
+{
+  struct epoll_event event;
+  struct watch *w;
+  unsigned long long now;
+  int fd;
+
+  fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd == -1)
+    {
+      return (errno == ESRCH) ? revert_session(reaper, username, pid, start)
+	: AL_ESESSION;
+    }
+
+  /* The pidfd was opened first, so if the start times match, it
+   * refers to the login session's process.
+   */
+  now = (start) ? al__pid_start_time(pid) : 0;
+  if (now && now != start)
+    {
+      close(fd);
+      return revert_session(reaper, username, pid, start);
+    }
+
+  w = malloc(sizeof(struct watch));
+  if (w)
+    w->username = strdup(username);
+  if (!w || !w->username)
+    {
+      free(w);
+      close(fd);
+      return AL_ENOMEM;
+    }
+  w->pid = pid;
+  w->start = start;
+  w->fd = fd;
+  w->generation = reaper->generation;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = w;
+  if (epoll_ctl(reaper->epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+      close(fd);
+      free(w->username);
+      free(w);
+      return AL_ESESSION;
+    }
+
+  w->next = reaper->watches[pid % WATCH_BUCKETS];
+  reaper->watches[pid % WATCH_BUCKETS] = w;
+  return AL_SUCCESS;
+}
+
+/* Remove pid, which started at time start, from username's record,
+ * noting any detach or linger left for later.
+ */
+static int revert_session(struct al_reaper *reaper, const char *username,
+			  pid_t pid, unsigned long long start)
+{
+  long linger;
+
+  if (al__config_bool("deferred_detach", 0))
+    reaper->pending = 1;
+  linger = al__config_number("linger", 0);
+  if (linger > 0)
+    note_linger(reaper, time(NULL) + linger);
+  return al__revert_session(username, pid, start);
+}
+
+/* Make sure the reaper wakes by time until to end a linger. */
+static void note_linger(struct al_reaper *reaper, time_t until)
+{
+  if (!reaper->linger_until || until < reaper->linger_until)
+    reaper->linger_until = until;
+}
+
+static void remove_watch(struct al_reaper *reaper, struct watch *w)
+{
+  struct watch **wp;
+
+  for (wp = &reaper->watches[w->pid % WATCH_BUCKETS]; *wp; wp = &(*wp)->next)
+    {
+      if (*wp == w)
+	{
+	  *wp = w->next;
+	  break;
+	}
+    }
+  close(w->fd);
+  free(w->username);
+  free(w);
+}
+
+/* Stop watching pids (of username, if it is not NULL) which were not
+ * seen by the current scan.
+ */
+static void sweep(struct al_reaper *reaper, const char *username)
+{
+  struct watch **wp, *w;
+  int i;
+
+  for (i = 0; i < WATCH_BUCKETS; i++)
+    {
+      wp = &reaper->watches[i];
+      while (*wp)
+	{
+	  w = *wp;
+	  if (w->generation != reaper->generation
+	      && (!username || strcmp(w->username, username) == 0))
+	    {
+	      *wp = w->next;
+	      close(w->fd);
+	      free(w->username);
+	      free(w);
+	    }
+	  else
+	    wp = &w->next;
+	}
+    }
+}
+
+/* Rescan the records named by pending inotify events. */
+static int read_notifications(struct al_reaper *reaper)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  char buf[4096], *p;
+  struct inotify_event *event;
+  ssize_t len;
+  int retval, reterr = AL_SUCCESS;
+
+  while ((len = read(reaper->inotify_fd, buf, sizeof(buf))) > 0)
+    {
+      for (p = buf; p < buf + len; p += sizeof(*event) + event->len)
+	{
+	  event = (struct inotify_event *) p;
+	  if (event->mask & IN_Q_OVERFLOW)
+	    reaper->next_scan = 0;
+	  if (event->len == 0 || (event->mask & IN_ISDIR)
+	      || !al__username_valid(event->name))
+	    continue;
+	  retval = scan_user(reaper, event->name, 1);
+	  if (retval != AL_SUCCESS)
+	    reterr = retval;
+	}
+    }
+  return reterr;
+#else
+  return AL_SUCCESS;
+#endif
+}
+
+#endif /* USE_PIDFD */
@@ -0,0 +1,644 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements a
+ * session record store kept in a single memory-mapped file.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD_SIGMASK
+#include <pthread.h>
+#endif
+#include "al.h"
+#include "al_private.h"
+
+extern char *al__session_dir;
+
+/* The database lives in the session directory under a name which
+ * cannot be a username.  It begins with a header block, followed by a
+ * fixed number of slots, each holding one user's session record in the
+ * binary format described in session.c.  Slots are found by hashing the
+ * username and probing linearly until a never-used slot is reached.
+ * Once used, a slot stays used; a slot holding an empty record may be
+ * handed to another user, which leaves every probe chain intact.
+ *
+ * Each slot is locked with an fcntl lock on its byte range while its
+ * record is being updated, and the first byte of the header is locked
+ * while a slot is being claimed.  Since closing any descriptor for the
+ * file would drop all of the process's locks on it, the database stays
+ * open for the life of the process.  In threads mode, the locks are
+ * open file description locks instead, which do not conflict with other
+ * locks taken through the same descriptor, so each record is locked
+ * through a descriptor of its own.
+ *
+ * A record too large for its slot, such as one with hundreds of pids,
+ * is kept in a file of its own in DB_OVERFLOW_DIR, named by the
+ * username, and the slot's length is set to DB_LEN_OVERFLOW.  The file
+ * is protected by the slot's lock, and is replaced by renaming so that
+ * readers without the lock see a whole record.
+ */
+
+#define DB_FILE			".db"
+#define DB_MAGIC		"ALSD"
+#define DB_VERSION		1
+#define DB_SLOT_SIZE		4096
+#define DB_NAME_MAX		63
+#define DB_DEFAULT_SLOTS	4096
+#define DB_MAX_SLOTS		(1 << 20)
+#define DB_OVERFLOW_DIR		".db-overflow"
+#define DB_LEN_OVERFLOW		0xffffffff
+
+struct db_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t nslots;
+  uint32_t slot_size;
+};
+
+struct db_slot {
+  uint32_t used;		/* Nonzero once the slot has been claimed */
+  uint32_t len;			/* Length of the record in data */
+  char name[DB_NAME_MAX + 1];
+  char data[DB_SLOT_SIZE - 2 * sizeof(uint32_t) - DB_NAME_MAX - 1];
+};
+
+struct db_iter {
+  uint32_t next;
+  char name[DB_NAME_MAX + 1];
+};
+
+static int db_fd = -1, db_writable;
+static char *db_map;
+static size_t db_mapsize;
+static uint32_t db_nslots;
+#ifdef HAVE_PTHREAD_SIGMASK
+static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define SLOT_OFFSET(i)	((off_t) DB_SLOT_SIZE * ((i) + 1))
+#define SLOT(i)		((struct db_slot *) (db_map + SLOT_OFFSET(i)))
+
+static char *db_path(void)
+{
+  char *path;
+
+  path = malloc(strlen(al__session_dir) + sizeof(DB_FILE) + 1);
+  if (path)
+    sprintf(path, "%s/%s", al__session_dir, DB_FILE);
+  return path;
+}
+
+/* Open and map the database, creating it if writable is set.  Return
+ * 0 on success or -1 on failure with errno set.
+ */
+static int db_open_locked(int writable);
+
+static int db_open(int writable)
+{
+  int retval;
+
+#ifdef HAVE_PTHREAD_SIGMASK
+  pthread_mutex_lock(&db_mutex);
+  retval = db_open_locked(writable);
+  pthread_mutex_unlock(&db_mutex);
+#else
+  retval = db_open_locked(writable);
+#endif
+  return retval;
+}
+
+static int db_open_locked(int writable)
+{
+  struct db_header hdr;
+  struct stat st;
+  char *path, *map;
+  long nslots;
+  int fd, nss;
+
+  if (db_map && (db_writable || !writable))
+    return 0;
+
+  /* A read-only descriptor never holds locks, so it can be replaced.
+   * Other threads may still be reading the old mapping, so in threads
+   * mode it is left in place.
+   */
+  if (db_map)
+    {
+      if (!al__threaded())
+	munmap(db_map, db_mapsize);
+      close(db_fd);
+      db_map = NULL;
+      db_fd = -1;
+    }
+
+  path = db_path();
+  if (!path)
+    return -1;
+  nss = al__config_bool("nss", 0);
+  if (writable)
+    fd = open(path, O_RDWR|O_CREAT, (nss) ? 0644 : 0600);
+  else
+    fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1)
+    return -1;
+
+  if (writable)
+    {
+      /* Initialize a new database under the header lock. */
+      al__lock_fd(fd, 0, 1, F_WRLCK, 1);
+      if (fstat(fd, &st) == 0 && st.st_size == 0)
+	{
+	  nslots = al__config_number("session_db_slots", DB_DEFAULT_SLOTS);
+	  if (nslots <= 0 || nslots > DB_MAX_SLOTS)
+	    nslots = DB_DEFAULT_SLOTS;
+	  memcpy(hdr.magic, DB_MAGIC, sizeof(hdr.magic));
+	  hdr.version = DB_VERSION;
+	  hdr.nslots = nslots;
+	  hdr.slot_size = DB_SLOT_SIZE;
+	  if (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+	    ftruncate(fd, SLOT_OFFSET(nslots));
+	}
+      al__lock_fd(fd, 0, 1, F_UNLCK, 0);
+
+      /* The NSS module reads the database with the privileges of
+       * whatever process looks a user up.
+       */
+      if (nss)
+	fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    }
+
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+      || memcmp(hdr.magic, DB_MAGIC, sizeof(hdr.magic)) != 0
+      || hdr.version != DB_VERSION || hdr.slot_size != DB_SLOT_SIZE
+      || hdr.nslots == 0 || hdr.nslots > DB_MAX_SLOTS
+      || fstat(fd, &st) == -1 || st.st_size < SLOT_OFFSET(hdr.nslots))
+    {
+      close(fd);
+      errno = EINVAL;
+      return -1;
+    }
+
+  map = mmap(NULL, SLOT_OFFSET(hdr.nslots),
+	     (writable) ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      close(fd);
+      return -1;
+    }
+  db_fd = fd;
+  db_map = map;
+  db_mapsize = SLOT_OFFSET(hdr.nslots);
+  db_nslots = hdr.nslots;
+  db_writable = writable;
+  return 0;
+}
+
+/* Return the slot holding username's record, or -1 if there is none.
+ * Without the slot lock, the answer is only a hint.
+ */
+static long find_slot(const char *username)
+{
+  struct db_slot *slot;
+  uint32_t i, n;
+
+  i = al__hash_name(username) % db_nslots;
+  for (n = 0; n < db_nslots; n++, i = (i + 1) % db_nslots)
+    {
+      slot = SLOT(i);
+      if (!slot->used)
+	return -1;
+      if (strncmp(slot->name, username, sizeof(slot->name)) == 0)
+	return i;
+    }
+  return -1;
+}
+
+/* With the header locked, claim a slot on username's probe chain,
+ * taking either a never-used slot or one holding another user's empty
+ * record, whichever comes first.  Return the slot, locked through fd,
+ * or -1 if the database is full.
+ */
+static long claim_slot(int fd, const char *username)
+{
+  struct db_slot *slot;
+  uint32_t i, n;
+
+  i = al__hash_name(username) % db_nslots;
+  for (n = 0; n < db_nslots; n++, i = (i + 1) % db_nslots)
+    {
+      slot = SLOT(i);
+      if (slot->used)
+	{
+	  /* Skip slots which are busy or hold a record. */
+	  if (al__lock_fd(fd, SLOT_OFFSET(i), DB_SLOT_SIZE, F_WRLCK, 0) == -1)
+	    continue;
+	  if (slot->len != 0)
+	    {
+	      al__lock_fd(fd, SLOT_OFFSET(i), DB_SLOT_SIZE, F_UNLCK, 0);
+	      continue;
+	    }
+	}
+      else
+	al__lock_fd(fd, SLOT_OFFSET(i), DB_SLOT_SIZE, F_WRLCK, 1);
+
+      memset(slot->name, 0, sizeof(slot->name));
+      strcpy(slot->name, username);
+      slot->len = 0;
+      slot->used = 1;
+      return i;
+    }
+  return -1;
+}
+
+/* Return the path of username's overflow file, with a leading "." on
+ * the file name if temp is set, or NULL if out of memory.
+ */
+static char *overflow_path(const char *username, int temp)
+{
+  char *path;
+
+  path = malloc(strlen(al__session_dir) + sizeof(DB_OVERFLOW_DIR)
+		+ strlen(username) + 3);
+  if (path)
+    {
+      sprintf(path, "%s/%s/%s%s", al__session_dir, DB_OVERFLOW_DIR,
+	      (temp) ? "." : "", username);
+    }
+  return path;
+}
+
+/* Replace username's overflow file with the len bytes of buf.  Return
+ * 0 on success or -1 on failure.
+ */
+static int write_overflow(const char *username, const char *buf, size_t len)
+{
+  char *dir, *temp = NULL, *path = NULL;
+  int fd = -1, nss, retval = -1;
+
+  nss = al__config_bool("nss", 0);
+  dir = malloc(strlen(al__session_dir) + sizeof(DB_OVERFLOW_DIR) + 1);
+  if (!dir)
+    return -1;
+  sprintf(dir, "%s/%s", al__session_dir, DB_OVERFLOW_DIR);
+  if (mkdir(dir, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1
+      && errno != EEXIST)
+    goto cleanup;
+
+  temp = overflow_path(username, 1);
+  path = overflow_path(username, 0);
+  if (!temp || !path)
+    goto cleanup;
+  fd = open(temp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, (nss) ? 0644 : 0600);
+  if (fd == -1)
+    goto cleanup;
+  if (nss)
+    fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (write(fd, buf, len) != (ssize_t) len
+      || (al__config_bool("session_sync", 0) && al__sync_fd(fd) == -1))
+    {
+      unlink(temp);
+      goto cleanup;
+    }
+  if (rename(temp, path) == -1)
+    {
+      unlink(temp);
+      goto cleanup;
+    }
+  retval = 0;
+
+cleanup:
+  if (fd != -1)
+    close(fd);
+  free(dir);
+  free(temp);
+  free(path);
+  return retval;
+}
+
+static void remove_overflow(const char *username)
+{
+  char *path;
+
+  path = overflow_path(username, 0);
+  if (path)
+    unlink(path);
+  free(path);
+}
+
+/* Read username's overflow file into an allocated buffer.  Return 0 on
+ * success or -1 on failure with errno set.
+ */
+static int read_overflow(const char *username, char **bufp, size_t *lenp)
+{
+  struct stat st;
+  char *path, *buf;
+  ssize_t len;
+  int fd;
+
+  path = overflow_path(username, 0);
+  if (!path)
+    return -1;
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  free(path);
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &st) == -1)
+    {
+      close(fd);
+      return -1;
+    }
+  buf = malloc(st.st_size + 1);
+  if (!buf)
+    {
+      close(fd);
+      return -1;
+    }
+  len = pread(fd, buf, st.st_size, 0);
+  close(fd);
+  if (len != st.st_size)
+    {
+      free(buf);
+      errno = EIO;
+      return -1;
+    }
+  buf[len] = 0;
+  *bufp = buf;
+  *lenp = len;
+  return 0;
+}
+
+static int read_slot(struct db_slot *slot, const char *username,
+		     struct al_record *record);
+
+/* Parse the record in the overflow file for slot into record, as
+ * read_slot() does.
+ */
+static int read_overflow_slot(struct db_slot *slot, const char *username,
+			      struct al_record *record)
+{
+  char name[DB_NAME_MAX + 1], *buf;
+  size_t len;
+  int retval;
+
+  memcpy(name, slot->name, sizeof(name));
+  name[DB_NAME_MAX] = 0;
+  if (read_overflow(name, &buf, &len) == -1)
+    {
+      if (errno != ENOENT)
+	return AL_ESESSION;
+
+      /* Without the slot lock, the record may have just moved back
+       * into the slot.
+       */
+      if (!username && slot->len != DB_LEN_OVERFLOW)
+	return read_slot(slot, NULL, record);
+      return AL_WBADSESSION;
+    }
+  if (username && al__cached_session_record(username, buf, len, record))
+    retval = AL_SUCCESS;
+  else
+    retval = al__parse_session_record(buf, len, record);
+  free(buf);
+  return retval;
+}
+
+/* Parse the record in slot into record, or take it from the record
+ * cache if username is not NULL.
+ */
+static int read_slot(struct db_slot *slot, const char *username,
+		     struct al_record *record)
+{
+  uint32_t len;
+  char *buf;
+  int retval;
+
+  len = slot->len;
+  if (len == DB_LEN_OVERFLOW)
+    return read_overflow_slot(slot, username, record);
+  if (len > sizeof(slot->data))
+    return AL_WBADSESSION;
+  if (username && al__cached_session_record(username, slot->data, len,
+					    record))
+    return AL_SUCCESS;
+  buf = malloc(len + 1);
+  if (!buf)
+    return AL_ESESSION;
+  memcpy(buf, slot->data, len);
+  retval = al__parse_session_record(buf, len, record);
+  free(buf);
+  return retval;
+}
+
+static int db_exists(const char *username)
+{
+  if (db_open(0) == -1)
+    return 0;
+  return (find_slot(username) != -1);
+}
+
+/* Release the lock on record's slot, and in threads mode, the
+ * descriptor it was taken through.
+ */
+static void release_slot(struct al_record *record)
+{
+  if (record->fd == -1)
+    al__lock_fd(db_fd, SLOT_OFFSET(record->slot), DB_SLOT_SIZE, F_UNLCK, 0);
+  else
+    {
+      al__lock_fd(record->fd, SLOT_OFFSET(record->slot), DB_SLOT_SIZE,
+		  F_UNLCK, 0);
+      close(record->fd);
+    }
+}
+
+static int db_get(const char *username, struct al_record *record)
+{
+  char *path;
+  long i;
+  int fd, retval;
+
+  if (strlen(username) > DB_NAME_MAX || db_open(1) == -1)
+    return AL_ESESSION;
+
+  record->fd = -1;
+  fd = db_fd;
+  if (al__threaded())
+    {
+      path = db_path();
+      fd = (path) ? open(path, O_RDWR) : -1;
+      free(path);
+      if (fd == -1)
+	return AL_ESESSION;
+      record->fd = fd;
+    }
+
+  while (1)
+    {
+      i = find_slot(username);
+      if (i == -1)
+	{
+	  al__lock_fd(fd, 0, 1, F_WRLCK, 1);
+	  if (find_slot(username) == -1)
+	    {
+	      i = claim_slot(fd, username);
+	      al__lock_fd(fd, 0, 1, F_UNLCK, 0);
+	      if (i == -1)
+		{
+		  if (record->fd != -1)
+		    close(record->fd);
+		  return AL_ESESSION;
+		}
+	      break;
+	    }
+	  al__lock_fd(fd, 0, 1, F_UNLCK, 0);
+	  continue;
+	}
+
+      if (al__lock_record(fd, SLOT_OFFSET(i), DB_SLOT_SIZE) == -1)
+	{
+	  if (record->fd != -1)
+	    close(record->fd);
+	  return AL_ELOCKTIMEOUT;
+	}
+      if (strncmp(SLOT(i)->name, username, DB_NAME_MAX + 1) == 0)
+	break;
+
+      /* The slot was handed to another user while we waited. */
+      al__lock_fd(fd, SLOT_OFFSET(i), DB_SLOT_SIZE, F_UNLCK, 0);
+    }
+
+  record->slot = i;
+  retval = read_slot(SLOT(i), username, record);
+  if (retval == AL_ESESSION)
+    release_slot(record);
+  return retval;
+}
+
+static int db_snapshot(const char *username, struct al_record *record)
+{
+  long i;
+
+  record->slot = -1;
+  if (db_open(0) == -1)
+    return (errno == ENOENT) ? AL_SUCCESS : AL_ESESSION;
+  i = find_slot(username);
+  return (i == -1) ? AL_SUCCESS : read_slot(SLOT(i), NULL, record);
+}
+
+static int db_put(struct al_record *record)
+{
+  struct db_slot *slot = SLOT(record->slot);
+  char *buf, *page;
+  size_t len, pagesize;
+  int retval = AL_SUCCESS, overflowed = (slot->len == DB_LEN_OVERFLOW);
+
+  if (record->exists || record->detach_pending)
+    {
+      buf = al__encode_session_record(record, &len);
+      if (!buf)
+	retval = AL_ESESSION;
+      else if (len <= sizeof(slot->data))
+	{
+	  memcpy(slot->data, buf, len);
+	  slot->len = len;
+	}
+      else if (write_overflow(slot->name, buf, len) == 0)
+	slot->len = DB_LEN_OVERFLOW;
+      else
+	retval = AL_ESESSION;
+      free(buf);
+    }
+  else
+    slot->len = 0;
+
+  /* Remove an overflow file only once the slot no longer points to it. */
+  if (overflowed && slot->len != DB_LEN_OVERFLOW)
+    remove_overflow(slot->name);
+
+  /* Flush the pages holding the slot, which need not be aligned to
+   * the system's page size.
+   */
+  if (retval == AL_SUCCESS && al__config_bool("session_sync", 0))
+    {
+      pagesize = sysconf(_SC_PAGESIZE);
+      page = db_map + SLOT_OFFSET(record->slot) / pagesize * pagesize;
+      if (msync(page, (char *) slot + DB_SLOT_SIZE - page, MS_SYNC) == -1)
+	retval = AL_ESESSION;
+    }
+
+  release_slot(record);
+  return retval;
+}
+
+static void *db_iter_open(void)
+{
+  struct db_iter *iter;
+
+  if (db_open(0) == -1 && errno != ENOENT)
+    return NULL;
+  iter = malloc(sizeof(struct db_iter));
+  if (iter)
+    iter->next = 0;
+  return iter;
+}
+
+static const char *db_iter_next(void *iter)
+{
+  struct db_iter *it = (struct db_iter *) iter;
+  struct db_slot *slot;
+
+  if (!it || !db_map)
+    return NULL;
+  while (it->next < db_nslots)
+    {
+      slot = SLOT(it->next++);
+      if (!slot->used)
+	continue;
+      memcpy(it->name, slot->name, sizeof(it->name));
+      it->name[DB_NAME_MAX] = 0;
+      if (al__username_valid(it->name))
+	return it->name;
+    }
+  return NULL;
+}
+
+static void db_iter_close(void *iter)
+{
+  free(iter);
+}
+
+const struct al_sessstore al__db_store = {
+  "db",
+  db_exists,
+  db_get,
+  db_snapshot,
+  db_put,
+  db_iter_open,
+  db_iter_next,
+  db_iter_close
+};
@@ -21,13 +21,21 @@ static const char rcsid[] = "$Id: session.c,v 1.12 2006-01-14 16:31:15 rbasch Ex
 
 #include <ctype.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD_SIGMASK
+#include <pthread.h>
+#endif
 #include "al.h"
 #include "al_private.h"
 
@@ -44,293 +52,1869 @@ char *al__session_dir = PATH_SESSIONS;
 static void zero_record(struct al_record *r)
 {
   r->exists = r->passwd_added = r->attached = r->ngroups = r->npids = 0;
+  r->authenticated = 0;
+  r->detach_pending = 0;
+  r->detach_uid = 0;
+  r->detach_gid = 0;
+  r->linger_until = 0;
+  r->generation = r->checksum = 0;
+  r->maxpids = 0;
   r->old_homedir = NULL;
   r->groups = NULL;
   r->pids = NULL;
+  r->starts = NULL;
+  r->nss_passwd = NULL;
+  r->nss_groups = NULL;
+}
+
+/* Session records are stored in a binary format, so that a record can
+ * be read with a single pread() and written with a single pwrite().
+ * A record consists of a fixed header (struct record_header), followed
+ * by ngroups gids and npids pids, each a 32-bit unsigned integer, and
+ * the start times of the npids pids, each a 64-bit unsigned integer
+ * (zero if unknown), followed by the old home directory, the NSS passwd
+ * line, and the NSS group list, each of the length given in the header
+ * and without a terminator.  A string length of zero means the field
+ * is not set.  All integers are in host byte order; the records never
+ * leave the machine.  Version 1 records have no start times.
+ *
+ * Since version 3, the header ends with a generation number, which is
+ * incremented each time the record is written, and a checksum of the
+ * whole record, computed with the checksum field zeroed, so that a
+ * record torn by a crash or read mid-write is rejected rather than
+ * misread.  Older headers lack both fields.
+ *
+ * Since version 4, the header ends with the uid and gid to run a
+ * pending detach as.  A logout which leaves the user's home directory
+ * to be detached later (see al__revert_homedir()) leaves a record with
+ * only the detach pending, which does not count as existing; the
+ * user's passwd entry is gone by the time the detach runs.
+ *
+ * Since version 5, the header ends with the time at which a record
+ * whose last session has ended stops lingering (see al__should_revert()
+ * in acct.c), or zero.
+ *
+ * Records in the older text format (see parse_text_record() below)
+ * are still accepted, and are rewritten in the binary format the next
+ * time they are put.
+ */
+
+#define RECORD_MAGIC		"ALSR"
+#define RECORD_VERSION		5
+
+#define RECORD_PASSWD_ADDED	0x1
+#define RECORD_ATTACHED		0x2
+#define RECORD_AUTHENTICATED	0x4
+#define RECORD_DETACH_PENDING	0x8
+
+struct record_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t size;		/* Size of the whole record in bytes */
+  uint32_t flags;
+  uint32_t ngroups;
+  uint32_t npids;
+  uint32_t old_homedir_len;
+  uint32_t nss_passwd_len;
+  uint32_t nss_groups_len;
+  uint32_t generation;
+  uint32_t checksum;
+  uint32_t detach_uid;
+  uint32_t detach_gid;
+  uint32_t linger_until;
+};
+
+/* The size of the header in records before version 3, and in
+ * version 3 and 4 records.
+ */
+#define OLD_HEADER_SIZE		offsetof(struct record_header, generation)
+#define V3_HEADER_SIZE		offsetof(struct record_header, detach_uid)
+#define V4_HEADER_SIZE		offsetof(struct record_header, linger_until)
+
+/* Most records fit in this many bytes, and so take one read. */
+#define RECORD_READ_SIZE	1024
+
+/* Number of times to read a record which looks malformed without
+ * locking it.
+ */
+#define SNAPSHOT_TRIES		3
+
+/* This is an internal function.  Its contract is to return an
+ * allocated copy of the len bytes at p as a string, or NULL if len is
+ * zero.  It sets *error if it runs out of memory.
+ */
+static char *copy_field(const char *p, uint32_t len, int *error)
+{
+  char *s;
+
+  if (len == 0)
+    return NULL;
+  s = malloc(len + 1);
+  if (!s)
+    {
+      *error = 1;
+      return NULL;
+    }
+  memcpy(s, p, len);
+  s[len] = 0;
+  return s;
+}
+
+/* This is an internal function.  Its contract is to return a 32-bit
+ * FNV-1a checksum of the len bytes of the record in buf, treating its
+ * checksum field as zero.
+ */
+static uint32_t record_checksum(const char *buf, size_t len)
+{
+  uint32_t h = 2166136261U;
+  size_t i, skip = offsetof(struct record_header, checksum);
+
+  for (i = 0; i < len; i++)
+    {
+      h ^= (i >= skip && i < skip + 4) ? 0 : (unsigned char) buf[i];
+      h *= 16777619U;
+    }
+  return h;
+}
+
+/* This is an internal function.  Its contract is to parse a binary
+ * session record of len bytes from buf into record, returning
+ * AL_SUCCESS, AL_WBADSESSION, or AL_ESESSION.
+ */
+static int parse_binary_record(const char *buf, size_t len,
+			       struct al_record *record)
+{
+  struct record_header hdr;
+  const char *p;
+  size_t need, ids, hdrsize;
+  uint32_t val, i;
+  uint64_t start;
+  int error = 0;
+
+  if (len < OLD_HEADER_SIZE)
+    return AL_WBADSESSION;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(&hdr, buf, OLD_HEADER_SIZE);
+  if (hdr.version < 1 || hdr.version > RECORD_VERSION)
+    return AL_WBADSESSION;
+  if (hdr.version >= 5)
+    hdrsize = sizeof(hdr);
+  else if (hdr.version == 4)
+    hdrsize = V4_HEADER_SIZE;
+  else
+    hdrsize = (hdr.version == 3) ? V3_HEADER_SIZE : OLD_HEADER_SIZE;
+  if (len < hdrsize)
+    return AL_WBADSESSION;
+  memcpy(&hdr, buf, hdrsize);
+
+  /* Make sure the counts and lengths add up to the size of the record,
+   * bounding each by len first so the sum cannot overflow.
+   */
+  if (hdr.ngroups > len / 4 || hdr.npids > len / 4
+      || hdr.old_homedir_len > len || hdr.nss_passwd_len > len
+      || hdr.nss_groups_len > len)
+    return AL_WBADSESSION;
+  ids = 4 * ((size_t) hdr.ngroups + hdr.npids);
+  if (hdr.version >= 2)
+    ids += 8 * (size_t) hdr.npids;
+  need = hdrsize + ids + hdr.old_homedir_len + hdr.nss_passwd_len
+    + hdr.nss_groups_len;
+  if (need != hdr.size || need > len)
+    return AL_WBADSESSION;
+  if (hdr.version >= 3 && record_checksum(buf, need) != hdr.checksum)
+    return AL_WBADSESSION;
+  p = buf + hdrsize;
+  if (memchr(p + ids, 0, need - hdrsize - ids))
+    return AL_WBADSESSION;
+  record->generation = hdr.generation;
+
+  record->passwd_added = ((hdr.flags & RECORD_PASSWD_ADDED) != 0);
+  record->attached = ((hdr.flags & RECORD_ATTACHED) != 0);
+  record->authenticated = ((hdr.flags & RECORD_AUTHENTICATED) != 0);
+  record->detach_pending = ((hdr.flags & RECORD_DETACH_PENDING) != 0);
+  record->detach_uid = hdr.detach_uid;
+  record->detach_gid = hdr.detach_gid;
+  record->linger_until = hdr.linger_until;
+
+  record->groups = malloc((hdr.ngroups + 1) * sizeof(gid_t));
+  record->pids = malloc((hdr.npids + 1) * sizeof(pid_t));
+  record->starts = calloc(hdr.npids + 1, sizeof(unsigned long long));
+  if (!record->groups || !record->pids || !record->starts)
+    return AL_ESESSION;
+  record->maxpids = hdr.npids + 1;
+  for (i = 0; i < hdr.ngroups; i++, p += 4)
+    {
+      memcpy(&val, p, 4);
+      record->groups[i] = val;
+    }
+  record->ngroups = hdr.ngroups;
+  for (i = 0; i < hdr.npids; i++, p += 4)
+    {
+      memcpy(&val, p, 4);
+      record->pids[i] = val;
+    }
+  record->npids = hdr.npids;
+  for (i = 0; hdr.version >= 2 && i < hdr.npids; i++, p += 8)
+    {
+      memcpy(&start, p, 8);
+      record->starts[i] = start;
+    }
+
+  record->old_homedir = copy_field(p, hdr.old_homedir_len, &error);
+  p += hdr.old_homedir_len;
+  record->nss_passwd = copy_field(p, hdr.nss_passwd_len, &error);
+  p += hdr.nss_passwd_len;
+  record->nss_groups = copy_field(p, hdr.nss_groups_len, &error);
+  if (error)
+    return AL_ESESSION;
+
+  record->exists = !record->detach_pending;
+  return AL_SUCCESS;
+}
+
+/* This is an internal function.  Its contract is to return the next
+ * line of a text record from *pos, terminated in place, or NULL if
+ * there are no more lines before end.  *end must be writable.
+ */
+static char *next_line(char **pos, char *end)
+{
+  char *line = *pos, *nl;
+
+  if (line >= end)
+    return NULL;
+  nl = memchr(line, '\n', end - line);
+  if (!nl)
+    nl = end;
+  *nl = 0;
+  *pos = nl + 1;
+  return line;
+}
+
+/* This is an internal function.  Its contract is to parse a list of
+ * zero or more numbers each followed by a colon from line into an
+ * allocated array with one extra slot, returning the number of
+ * entries, -1 if the list is malformed, or -2 if it runs out of
+ * memory.
+ */
+static int parse_id_list(const char *line, unsigned long **ids)
+{
+  const char *p;
+  int n = 0, i;
+
+  for (p = line; *p; p++)
+    {
+      if (!isdigit((unsigned char)*p) || !(p = strchr(p, ':')))
+	return -1;
+      n++;
+    }
+  *ids = malloc((n + 1) * sizeof(unsigned long));
+  if (!*ids)
+    return -2;
+  i = 0;
+  for (p = line; *p; p = 1 + strchr(p, ':'))
+    (*ids)[i++] = strtoul(p, NULL, 10);
+  return n;
+}
+
+/* This is an internal function.  Its contract is to parse a session
+ * record of len bytes in the old text format from buf into record,
+ * returning AL_SUCCESS, AL_WBADSESSION, or AL_ESESSION.  The text
+ * format is one line each for passwd_added ("0" or "1"), attached ("0"
+ * or "1"), the old home directory ("0" or "1" followed by the
+ * directory), the gid list, and the pid list (each entry followed by a
+ * colon), optionally followed by the NSS passwd line ("0" or "1"
+ * followed by the line) and the NSS group list.  buf[len] must be
+ * writable.
+ */
+static int parse_text_record(char *buf, size_t len, struct al_record *record)
+{
+  char *pos = buf, *end = buf + len, *line;
+  unsigned long *ids;
+  int n, i;
+
+  /* Get the first line (0 or 1; passwd created). */
+  line = next_line(&pos, end);
+  if (!line || (strcmp(line, "0") != 0 && strcmp(line, "1") != 0))
+    return AL_WBADSESSION;
+  record->passwd_added = line[0] - '0';
+
+  /* Get the second line (0 or 1; homedir attached). */
+  line = next_line(&pos, end);
+  if (!line || (strcmp(line, "0") != 0 && strcmp(line, "1") != 0))
+    return AL_WBADSESSION;
+  record->attached = line[0] - '0';
+
+  /* Get the third line (0 or 1old_homedir). */
+  line = next_line(&pos, end);
+  if (!line || (strcmp(line, "0") != 0 && (line[0] != '1' || !line[1])))
+    return AL_WBADSESSION;
+  if (line[0] == '1')
+    {
+      record->old_homedir = strdup(line + 1);
+      if (!record->old_homedir)
+	return AL_ESESSION;
+    }
+
+  /* Get the fourth line (gid1:gid2:...gidn:). */
+  line = next_line(&pos, end);
+  if (!line)
+    return AL_WBADSESSION;
+  n = parse_id_list(line, &ids);
+  if (n < 0)
+    return (n == -1) ? AL_WBADSESSION : AL_ESESSION;
+  record->groups = malloc((n + 1) * sizeof(gid_t));
+  if (!record->groups)
+    {
+      free(ids);
+      return AL_ESESSION;
+    }
+  for (i = 0; i < n; i++)
+    record->groups[i] = ids[i];
+  record->ngroups = n;
+  free(ids);
+
+  /* Get the fifth line (pid1:pid2:...pidn:). */
+  line = next_line(&pos, end);
+  if (!line)
+    return AL_WBADSESSION;
+  n = parse_id_list(line, &ids);
+  if (n < 0)
+    return (n == -1) ? AL_WBADSESSION : AL_ESESSION;
+  record->pids = malloc((n + 1) * sizeof(pid_t));
+  record->starts = calloc(n + 1, sizeof(unsigned long long));
+  if (!record->pids || !record->starts)
+    {
+      free(ids);
+      return AL_ESESSION;
+    }
+  record->maxpids = n + 1;
+  for (i = 0; i < n; i++)
+    record->pids[i] = ids[i];
+  record->npids = n;
+  free(ids);
+
+  /* The remaining lines are only present for users served by the NSS
+   * module, so the record may end here.
+   */
+  record->exists = 1;
+
+  /* Get the sixth line (0 or 1passwd_line). */
+  line = next_line(&pos, end);
+  if (!line)
+    return AL_SUCCESS;
+  if (strcmp(line, "0") != 0 && (line[0] != '1' || !strchr(line, ':')))
+    return AL_WBADSESSION;
+  if (line[0] == '1')
+    {
+      record->nss_passwd = strdup(line + 1);
+      if (!record->nss_passwd)
+	return AL_ESESSION;
+    }
+
+  /* Get the seventh line (name1:gid1:...namen:gidn:). */
+  line = next_line(&pos, end);
+  if (line && *line)
+    {
+      record->nss_groups = strdup(line);
+      if (!record->nss_groups)
+	return AL_ESESSION;
+    }
+
+  return AL_SUCCESS;
+}
+
+struct pid_entry {
+  pid_t pid;
+  unsigned long long start;
+};
+
+static int compare_pid_entries(const void *a, const void *b)
+{
+  pid_t pa = ((const struct pid_entry *) a)->pid;
+  pid_t pb = ((const struct pid_entry *) b)->pid;
+
+  return (pa < pb) ? -1 : (pa > pb);
+}
+
+/* This is an internal function.  Its contract is to sort the pids of
+ * a record read from disk, with their start times, if they are not
+ * already in order, which is only the case for records written by
+ * older versions of the library.  It returns AL_SUCCESS or AL_ESESSION.
+ */
+static int sort_pids(struct al_record *record)
+{
+  struct pid_entry *entries;
+  int i;
+
+  for (i = 1; i < record->npids; i++)
+    {
+      if (record->pids[i - 1] >= record->pids[i])
+	break;
+    }
+  if (i >= record->npids)
+    return AL_SUCCESS;
+
+  entries = malloc(record->npids * sizeof(struct pid_entry));
+  if (!entries)
+    return AL_ESESSION;
+  for (i = 0; i < record->npids; i++)
+    {
+      entries[i].pid = record->pids[i];
+      entries[i].start = record->starts[i];
+    }
+  qsort(entries, record->npids, sizeof(struct pid_entry),
+	compare_pid_entries);
+  for (i = 0; i < record->npids; i++)
+    {
+      record->pids[i] = entries[i].pid;
+      record->starts[i] = entries[i].start;
+    }
+  free(entries);
+  return AL_SUCCESS;
+}
+
+/* This is an internal function.  Its contract is to parse the len
+ * bytes of a session record in buf, in either the binary or the old
+ * text format, into record.  buf[len] must be writable.  It always
+ * allocates one extra slot in record->gids, record->pids, and
+ * record->starts.  It returns AL_SUCCESS (with record->exists set if
+ * the record was not empty), AL_WBADSESSION if the record is malformed,
+ * or AL_ESESSION if it runs out of memory; in the last two cases the
+ * record is zeroed.
+ */
+int al__parse_session_record(char *buf, size_t len, struct al_record *record)
+{
+  int retval;
+
+  if (len == 0)
+    return AL_SUCCESS;
+  if (len >= sizeof(RECORD_MAGIC) - 1
+      && memcmp(buf, RECORD_MAGIC, sizeof(RECORD_MAGIC) - 1) == 0)
+    retval = parse_binary_record(buf, len, record);
+  else
+    retval = parse_text_record(buf, len, record);
+  if (retval == AL_SUCCESS)
+    retval = sort_pids(record);
+
+  /* On either warning or error, zero out the record. */
+  if (retval != AL_SUCCESS)
+    al__free_record(record);
+  return retval;
+}
+
+/* This is an internal function.  Its contract is to read the whole of
+ * the session record open on fd and parse it into record, or take it
+ * from the record cache if username is not NULL.  A record no larger
+ * than RECORD_READ_SIZE is read with a single pread().
+ */
+static int read_record(int fd, const char *username,
+		       struct al_record *record)
+{
+  char *buf, *newbuf;
+  size_t size = RECORD_READ_SIZE, len = 0;
+  ssize_t count;
+  int retval;
+
+  /* Read until a short read, leaving a byte for the text parser. */
+  buf = malloc(size);
+  if (!buf)
+    return AL_ESESSION;
+  while (1)
+    {
+      count = pread(fd, buf + len, size - len - 1, len);
+      if (count == -1 && errno == EINTR)
+	continue;
+      if (count == -1)
+	{
+	  free(buf);
+	  return AL_ESESSION;
+	}
+      len += count;
+      if (len < size - 1)
+	break;
+      newbuf = realloc(buf, size * 2);
+      if (!newbuf)
+	{
+	  free(buf);
+	  return AL_ESESSION;
+	}
+      buf = newbuf;
+      size *= 2;
+    }
+
+  if (username && al__cached_session_record(username, buf, len, record))
+    {
+      free(buf);
+      return AL_SUCCESS;
+    }
+  retval = al__parse_session_record(buf, len, record);
+  free(buf);
+  return retval;
+}
+
+/* This is an internal function.  Its contract is to free the
+ * informational fields of a record and zero them out.
+ */
+void al__free_record(struct al_record *record)
+{
+  free(record->old_homedir);
+  free(record->groups);
+  free(record->pids);
+  free(record->starts);
+  free(record->nss_passwd);
+  free(record->nss_groups);
+  zero_record(record);
+}
+
+/* This is an internal function.  Its contract is to find pid in the
+ * record's pids, which are kept in increasing order, returning its
+ * index, or -1 if it is not present after storing the index at which
+ * it would be inserted in *pos.
+ */
+int al__find_pid(struct al_record *record, pid_t pid, int *pos)
+{
+  int lo = 0, hi = record->npids, mid;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (record->pids[mid] == pid)
+	return mid;
+      if (record->pids[mid] < pid)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  *pos = lo;
+  return -1;
+}
+
+/* This is an internal function.  Its contract is to insert pid, which
+ * started at time start, at index pos of the record's pids.  There
+ * must be room for it, such as the extra slot left by
+ * al__get_session_record().
+ */
+void al__insert_pid(struct al_record *record, int pos, pid_t pid,
+		    unsigned long long start)
+{
+  memmove(record->pids + pos + 1, record->pids + pos,
+	  (record->npids - pos) * sizeof(pid_t));
+  memmove(record->starts + pos + 1, record->starts + pos,
+	  (record->npids - pos) * sizeof(unsigned long long));
+  record->pids[pos] = pid;
+  record->starts[pos] = start;
+  record->npids++;
+}
+
+/* This is an internal function.  Its contract is to remove the pid at
+ * index i of the record's pids.
+ */
+void al__remove_pid(struct al_record *record, int i)
+{
+  record->npids--;
+  memmove(record->pids + i, record->pids + i + 1,
+	  (record->npids - i) * sizeof(pid_t));
+  memmove(record->starts + i, record->starts + i + 1,
+	  (record->npids - i) * sizeof(unsigned long long));
+}
+
+/* This is an internal function.  Its contract is to return an
+ * allocated binary encoding of record, storing its length in *len, or
+ * NULL if it runs out of memory.  It sets the record's generation and
+ * checksum to those of the encoding.  A record which does not exist
+ * but has a detach pending is encoded with only the detach.
+ */
+char *al__encode_session_record(struct al_record *record, size_t *len)
+{
+  struct record_header hdr;
+  char *buf, *p;
+  uint32_t val;
+  uint64_t start;
+  int i, full = record->exists;
+
+  memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+  hdr.version = RECORD_VERSION;
+  hdr.generation = record->generation + 1;
+  hdr.checksum = 0;
+  hdr.flags = (full && record->passwd_added ? RECORD_PASSWD_ADDED : 0)
+    | (record->attached ? RECORD_ATTACHED : 0)
+    | (record->authenticated ? RECORD_AUTHENTICATED : 0)
+    | (record->detach_pending ? RECORD_DETACH_PENDING : 0);
+  hdr.detach_uid = record->detach_uid;
+  hdr.detach_gid = record->detach_gid;
+  hdr.linger_until = (full) ? record->linger_until : 0;
+  hdr.ngroups = (full) ? record->ngroups : 0;
+  hdr.npids = (full) ? record->npids : 0;
+  hdr.old_homedir_len = (full && record->old_homedir)
+    ? strlen(record->old_homedir) : 0;
+  hdr.nss_passwd_len = (full && record->nss_passwd)
+    ? strlen(record->nss_passwd) : 0;
+  hdr.nss_groups_len = (full && record->nss_groups)
+    ? strlen(record->nss_groups) : 0;
+  hdr.size = sizeof(hdr) + 4 * (hdr.ngroups + hdr.npids) + 8 * hdr.npids
+    + hdr.old_homedir_len + hdr.nss_passwd_len + hdr.nss_groups_len;
+
+  buf = malloc(hdr.size);
+  if (!buf)
+    return NULL;
+  memcpy(buf, &hdr, sizeof(hdr));
+  p = buf + sizeof(hdr);
+  for (i = 0; i < hdr.ngroups; i++, p += 4)
+    {
+      val = record->groups[i];
+      memcpy(p, &val, 4);
+    }
+  for (i = 0; i < hdr.npids; i++, p += 4)
+    {
+      val = record->pids[i];
+      memcpy(p, &val, 4);
+    }
+  for (i = 0; i < hdr.npids; i++, p += 8)
+    {
+      start = record->starts[i];
+      memcpy(p, &start, 8);
+    }
+  memcpy(p, record->old_homedir, hdr.old_homedir_len);
+  p += hdr.old_homedir_len;
+  memcpy(p, record->nss_passwd, hdr.nss_passwd_len);
+  p += hdr.nss_passwd_len;
+  memcpy(p, record->nss_groups, hdr.nss_groups_len);
+
+  val = record_checksum(buf, hdr.size);
+  memcpy(buf + offsetof(struct record_header, checksum), &val, 4);
+  record->generation = hdr.generation;
+  record->checksum = val;
+  *len = hdr.size;
+  return buf;
+}
+
+/* The session records live in one of the stores below, chosen with
+ * the "session_store" parameter in al.conf.
+ */
+
+static const struct al_sessstore *stores[] = {
+  &al__files_store,
+  &al__db_store
+};
+
+/* This is an internal function.  Its contract is to return the
+ * session store in use.
+ */
+const struct al_sessstore *al__sessstore(void)
+{
+  const char *name;
+  int i;
+
+  name = al__config_string("session_store");
+  if (name)
+    {
+      for (i = 0; i < sizeof(stores) / sizeof(*stores); i++)
+	{
+	  if (strcmp(stores[i]->name, name) == 0)
+	    return stores[i];
+	}
+    }
+  return &al__files_store;
 }
 
 /* Return true if the session record exists.  (Purely a tweak to avoid
  * creating session files in al_acct_revert().) */
 int al__record_exists(const char *username)
+{
+  return al__sessstore()->exists(username);
+}
+
+/* Longest pause between attempts to take a contended lock when
+ * lock_timeout is set, in microseconds.
+ */
+#define LOCK_POLL_MAX		50000
+
+/* This is an internal function.  Its contract is to write-lock len
+ * bytes of the session record open on fd starting at start (all of it
+ * if len is 0), for a session store's get().  If the lock is held
+ * elsewhere, it waits for at most "lock_timeout" seconds, or
+ * indefinitely if that is 0, and records the wait in the statistics.
+ * It returns 0 on success or -1 with errno set to ETIMEDOUT if the
+ * wait timed out.
+ */
+int al__lock_record(int fd, off_t start, off_t len)
+{
+  struct timeval begin, now;
+  long timeout, waited, pause = 1000;
+  int retval;
+
+  al__stat_add(AL__STAT_LOCK_ACQUIRES, 1);
+  if (al__lock_fd(fd, start, len, F_WRLCK, 0) == 0)
+    return 0;
+
+  al__stat_add(AL__STAT_LOCK_WAITS, 1);
+  gettimeofday(&begin, NULL);
+  timeout = al__config_number("lock_timeout", 0);
+  if (timeout <= 0)
+    retval = al__lock_fd(fd, start, len, F_WRLCK, 1);
+  else
+    {
+      /* fcntl() has no timed wait, so poll, backing off as we go. */
+      while ((retval = al__lock_fd(fd, start, len, F_WRLCK, 0)) == -1)
+	{
+	  gettimeofday(&now, NULL);
+	  waited = (now.tv_sec - begin.tv_sec) * 1000000
+	    + (now.tv_usec - begin.tv_usec);
+	  if (waited >= timeout * 1000000)
+	    {
+	      al__stat_add(AL__STAT_LOCK_TIMEOUTS, 1);
+	      break;
+	    }
+	  usleep(pause);
+	  pause = (pause * 2 > LOCK_POLL_MAX) ? LOCK_POLL_MAX : pause * 2;
+	}
+    }
+
+  gettimeofday(&now, NULL);
+  waited = (now.tv_sec - begin.tv_sec) * 1000000
+    + (now.tv_usec - begin.tv_usec);
+  al__stat_add(AL__STAT_LOCK_WAIT_USEC, waited);
+  al__stat_max(AL__STAT_LOCK_WAIT_MAX_USEC, waited);
+  if (retval == -1)
+    errno = ETIMEDOUT;
+  return retval;
+}
+
+/* A process which creates and reverts accounts over and over, such as
+ * a display manager or login broker, may keep the parsed contents of
+ * the session records it writes in memory, by setting "record_cache"
+ * in al.conf to the number of records to keep.  When the process next
+ * locks one of those records, the cached copy is handed out in place
+ * of parsing the record again if the record's generation and checksum
+ * show that no other process has rewritten it since.  The cache is
+ * indexed by a hash of the username, one record per entry.  While a
+ * record is locked its entry holds nothing; the entry's ticket lets
+ * al__put_session_record() tell whether another username has claimed
+ * the entry in the meantime.
+ */
+struct cache_entry {
+  char *username;
+  unsigned int ticket;
+  int valid;
+  struct al_record record;	/* Informational fields only */
+};
+
+static struct cache_entry *cache;
+static int cache_size = -1;
+#ifdef HAVE_PTHREAD_SIGMASK
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void cache_lock(void)
+{
+#ifdef HAVE_PTHREAD_SIGMASK
+  pthread_mutex_lock(&cache_mutex);
+#endif
+}
+
+static void cache_unlock(void)
+{
+#ifdef HAVE_PTHREAD_SIGMASK
+  pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+/* Move the informational fields of src to dst, zeroing them in src. */
+static void move_record(struct al_record *dst, struct al_record *src)
+{
+  dst->generation = src->generation;
+  dst->checksum = src->checksum;
+  dst->exists = src->exists;
+  dst->passwd_added = src->passwd_added;
+  dst->attached = src->attached;
+  dst->authenticated = src->authenticated;
+  dst->detach_pending = src->detach_pending;
+  dst->detach_uid = src->detach_uid;
+  dst->detach_gid = src->detach_gid;
+  dst->linger_until = src->linger_until;
+  dst->old_homedir = src->old_homedir;
+  dst->groups = src->groups;
+  dst->ngroups = src->ngroups;
+  dst->pids = src->pids;
+  dst->starts = src->starts;
+  dst->npids = src->npids;
+  dst->maxpids = src->maxpids;
+  dst->nss_passwd = src->nss_passwd;
+  dst->nss_groups = src->nss_groups;
+  zero_record(src);
+}
+
+/* This is an internal function.  Its contract is to look username up
+ * in the record cache, given the len bytes of its session record in
+ * buf, read under the record's lock.  If the cache holds the same
+ * record, it moves the cached fields into record and returns 1.
+ * Otherwise it returns 0, after claiming username's cache entry for
+ * record so that al__put_session_record() can fill it in.
+ */
+int al__cached_session_record(const char *username, const char *buf,
+			      size_t len, struct al_record *record)
+{
+  struct record_header hdr;
+  struct cache_entry *entry;
+  int i, hit = 0;
+
+  cache_lock();
+  if (cache_size == -1)
+    {
+      cache_size = al__config_number("record_cache", 0);
+      if (cache_size > 0)
+	cache = calloc(cache_size, sizeof(struct cache_entry));
+      if (!cache)
+	cache_size = 0;
+    }
+  if (cache_size == 0)
+    {
+      cache_unlock();
+      return 0;
+    }
+
+  i = al__hash_name(username) % cache_size;
+  entry = &cache[i];
+  if (entry->username && strcmp(entry->username, username) == 0)
+    {
+      if (entry->valid && len >= sizeof(hdr))
+	{
+	  memcpy(&hdr, buf, sizeof(hdr));
+	  hit = (memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) == 0
+		 && hdr.version == RECORD_VERSION && hdr.size == len
+		 && hdr.generation == entry->record.generation
+		 && hdr.checksum == entry->record.checksum);
+	}
+    }
+  else
+    {
+      free(entry->username);
+      entry->username = strdup(username);
+    }
+
+  if (hit)
+    move_record(record, &entry->record);
+  else if (entry->valid)
+    al__free_record(&entry->record);
+  entry->valid = 0;
+  if (entry->username)
+    {
+      entry->ticket++;
+      record->cache = i;
+      record->cache_ticket = entry->ticket;
+    }
+  cache_unlock();
+  return hit;
+}
+
+/* Keep the informational fields of record, which has just been
+ * written, in its cache entry if it still owns it.
+ */
+static void cache_record(struct al_record *record)
+{
+  struct cache_entry *entry = &cache[record->cache];
+  pid_t *pids;
+  unsigned long long *starts;
+  int n;
+
+  /* Leave room for another pid, as parsing the record would. */
+  if (record->maxpids <= record->npids)
+    {
+      n = record->npids * 2 + 1;
+      pids = realloc(record->pids, n * sizeof(pid_t));
+      if (!pids)
+	return;
+      record->pids = pids;
+      starts = realloc(record->starts, n * sizeof(unsigned long long));
+      if (!starts)
+	return;
+      record->starts = starts;
+      record->maxpids = n;
+    }
+
+  cache_lock();
+  if (entry->ticket == record->cache_ticket && !entry->valid)
+    {
+      move_record(&entry->record, record);
+      entry->valid = 1;
+    }
+  cache_unlock();
+}
+
+/* This is an internal function.  Its contract is to open the session
+ * record, lock it, and parse its contents into record.  It always
+ * allocates one extra slot in record->gids, record->pids, and
+ * record->starts.
+ */
+int al__get_session_record(const char *username,
+			   struct al_record *record)
+{
+  int retval;
+  sigset_t smask;
+  struct sigaction action;
+
+  /* Zero the fields that correspond to state saved on disk. */
+  zero_record(record);
+  record->cache = -1;
+
+  retval = al__sessstore()->get(username, record);
+  if (retval != AL_ESESSION && retval != AL_ENOMEM
+      && retval != AL_ELOCKTIMEOUT)
+    {
+      /* Block signals that might kill process while record info on disk
+       * doesn't match reality.
+       */
+      sigemptyset(&smask);
+      sigaddset(&smask, SIGHUP);
+      sigaddset(&smask, SIGINT);
+      sigaddset(&smask, SIGQUIT);
+      sigaddset(&smask, SIGTSTP);
+      sigaddset(&smask, SIGALRM);
+      sigaddset(&smask, SIGCHLD);
+
+      /* In threads mode, block signals in this thread only, and leave
+       * SIGCHLD's disposition, which all threads share, alone.
+       */
+      record->threaded = al__threaded();
+#ifdef HAVE_PTHREAD_SIGMASK
+      if (record->threaded)
+	{
+	  pthread_sigmask(SIG_BLOCK, &smask, &(record->mask));
+	  return retval;
+	}
+#endif
+      sigprocmask(SIG_BLOCK, &smask, &(record->mask));
+      sigemptyset(&action.sa_mask);
+      action.sa_flags = 0;
+      action.sa_handler = SIG_DFL;
+      sigaction(SIGCHLD, &action, &(record->sigchld_action));
+    }
+
+  return retval;
+}
+
+/* This is an internal function.  Its contract is to read username's
+ * session record into record without locking it, creating it, or
+ * touching the signal state, for readers such as the NSS module which
+ * must never block behind a login in progress.  Writers replace the
+ * record contents with a single write, so the worst a reader can see
+ * is the previous contents or a torn record, which it rejects.  A
+ * missing record reads as an empty one.  The caller must release the
+ * record's memory with al__free_record().
+ */
+int al__snapshot_session_record(const char *username,
+				struct al_record *record)
+{
+  int retval, tries;
+
+  /* Try again if the record looks torn, in case a write was in
+   * progress.
+   */
+  for (tries = 0; tries < SNAPSHOT_TRIES; tries++)
+    {
+      zero_record(record);
+      retval = al__sessstore()->snapshot(username, record);
+      if (retval != AL_WBADSESSION)
+	break;
+    }
+  return retval;
+}
+
+/* This is an internal function.  Its contract is to write out a new
+ * session record according to what's in record and release the
+ * record's lock.
+ */
+int al__put_session_record(struct al_record *record)
+{
+  int retval;
+
+  retval = al__sessstore()->put(record);
+
+  if (retval == AL_SUCCESS && record->exists && record->cache != -1)
+    cache_record(record);
+  al__free_record(record);
+
+  /* Restore the signal mask in record->mask. */
+#ifdef HAVE_PTHREAD_SIGMASK
+  if (record->threaded)
+    {
+      pthread_sigmask(SIG_SETMASK, &(record->mask), NULL);
+      return retval;
+    }
+#endif
+  sigaction(SIGCHLD, &(record->sigchld_action), NULL);
+  sigprocmask(SIG_SETMASK, &(record->mask), NULL);
+
+  return retval;
+}
+
+/* These are internal functions.  Their contract is to enumerate the
+ * usernames which may have session records.  A username returned by
+ * al__session_iter_next() is valid until the next call.
+ */
+void *al__session_iter_open(void)
+{
+  return al__sessstore()->iter_open();
+}
+
+const char *al__session_iter_next(void *iter)
+{
+  return al__sessstore()->iter_next(iter);
+}
+
+void al__session_iter_close(void *iter)
+{
+  al__sessstore()->iter_close(iter);
+}
+
+/* The files store keeps each session record in a file named by the
+ * username, locked with fcntl while it is being updated.  In the flat
+ * layout the files live in the session directory itself.  If the
+ * session directory contains the file .sharded, they live two levels
+ * down instead, in subdirectories named by the low two bytes of a hash
+ * of the username in hex (for example, "3f/a2/username").
+ *
+ * al__shard_sessions() converts a flat directory to the sharded layout
+ * while logins continue, by giving each record a second hard link in
+ * its subdirectory.  Both names refer to the same file, so fcntl locks
+ * taken through either name exclude each other.  While it runs, the
+ * file .migrating exists, and a process creating a record in the
+ * sharded layout first links any flat record into place.  Since a
+ * process may resolve a record's name just before the layout changes,
+ * files_get() checks after locking a record that its name still refers
+ * to the file it locked.
+ */
+
+#define SHARDED_MARKER		".sharded"
+#define MIGRATING_MARKER	".migrating"
+
+/* Return true if the marker file exists in the session directory. */
+static int marker_exists(const char *marker)
+{
+  char *path;
+  int retval;
+
+  path = malloc(strlen(al__session_dir) + strlen(marker) + 2);
+  if (!path)
+    return 0;
+  sprintf(path, "%s/%s", al__session_dir, marker);
+  retval = (access(path, F_OK) == 0);
+  free(path);
+  return retval;
+}
+
+/* Return the allocated name of username's record in the flat or
+ * sharded layout, or NULL if it runs out of memory.
+ */
+static char *record_path(const char *username, int sharded)
+{
+  char *session_file;
+  unsigned int h;
+
+  /* No POSIX limit on username size; allocate space for filename. */
+  session_file = malloc(strlen(al__session_dir) + strlen(username) + 8);
+  if (!session_file)
+    return NULL;
+  if (sharded)
+    {
+      h = al__hash_name(username);
+      sprintf(session_file, "%s/%02x/%02x/%s", al__session_dir,
+	      (h >> 8) & 0xff, h & 0xff, username);
+    }
+  else
+    sprintf(session_file, "%s/%s", al__session_dir, username);
+  return session_file;
+}
+
+/* This is an internal function.  Its contract is to return the
+ * allocated path name of username's session record in the current
+ * layout, or NULL if it runs out of memory.
+ */
+char *al__session_path(const char *username)
+{
+  return record_path(username, marker_exists(SHARDED_MARKER));
+}
+
+/* Create the subdirectories leading to the sharded record path. */
+static void make_shard_dirs(char *path)
+{
+  char *p1, *p2;
+
+  p2 = strrchr(path, '/');
+  *p2 = 0;
+  p1 = strrchr(path, '/');
+  *p1 = 0;
+  mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+  *p1 = '/';
+  mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+  *p2 = '/';
+}
+
+/* Open username's record with the given flags, creating it and its
+ * subdirectories if O_CREAT is given.  During a migration, a flat
+ * record is linked into the sharded layout before it is opened, or
+ * opened in place by a reader.
+ */
+static int open_record(const char *username, int flags)
+{
+  char *path, *flat;
+  int fd, migrating;
+
+  if (!marker_exists(SHARDED_MARKER))
+    {
+      path = record_path(username, 0);
+      if (!path)
+	return -1;
+      fd = open(path, flags, S_IRUSR|S_IWUSR);
+      free(path);
+      return fd;
+    }
+
+  path = record_path(username, 1);
+  if (!path)
+    return -1;
+  migrating = marker_exists(MIGRATING_MARKER);
+  if (migrating && (flags & O_CREAT))
+    {
+      flat = record_path(username, 0);
+      if (flat)
+	{
+	  make_shard_dirs(path);
+	  link(flat, path);
+	  free(flat);
+	}
+    }
+  fd = open(path, flags, S_IRUSR|S_IWUSR);
+  if (fd == -1 && errno == ENOENT && (flags & O_CREAT))
+    {
+      make_shard_dirs(path);
+      fd = open(path, flags, S_IRUSR|S_IWUSR);
+    }
+  free(path);
+  if (fd == -1 && errno == ENOENT && migrating)
+    {
+      flat = record_path(username, 0);
+      if (flat)
+	{
+	  fd = open(flat, flags);
+	  free(flat);
+	}
+    }
+  return fd;
+}
+
+/* Return true if path names the file open on fd. */
+static int same_file(int fd, const char *path)
+{
+  struct stat st1, st2;
+
+  return (fstat(fd, &st1) == 0 && stat(path, &st2) == 0
+	  && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino);
+}
+
+static int files_exists(const char *username)
 {
   char *session_file;
   int retval;
 
-  /* No POSIX limit on username size; allocate space for filename. */
-  session_file = malloc(strlen(al__session_dir) + strlen(username) + 2);
+  session_file = al__session_path(username);
   if (!session_file)
     return 0;
-  sprintf(session_file, "%s/%s", al__session_dir, username);
-
   retval = access(session_file, F_OK);
   free(session_file);
+  if (retval == -1 && marker_exists(MIGRATING_MARKER))
+    {
+      session_file = record_path(username, 0);
+      if (!session_file)
+	return 0;
+      retval = access(session_file, F_OK);
+      free(session_file);
+    }
   return (retval == 0);
 }
 
-/* This is an internal function.  Its contract is to open the session
- * record, lock it, and parse its contents into record.  It always
- * allocates one extra slot in record->gids and record->pids.
- */
-int al__get_session_record(const char *username,
-			   struct al_record *record)
+static int files_get(const char *username, struct al_record *record)
 {
-  int fd, bufsize, retval = AL_WBADSESSION, i;
-  char *session_file, *buf = NULL, *ptr1;
-  struct flock fl;
-  sigset_t smask;
-  struct sigaction action;
+  int fd, retval, valid;
+  char *session_file;
 
-  /* No POSIX limit on username size; allocate space for filename. */
-  session_file = malloc(strlen(al__session_dir) + strlen(username) + 2);
-  if (!session_file)
-    return AL_ENOMEM;
-  sprintf(session_file, "%s/%s", al__session_dir, username);
+  while (1)
+    {
+      /* Open and lock the session record. */
+      fd = open_record(username, O_CREAT|O_RDWR);
+      if (fd == -1)
+	return (errno == ENOMEM) ? AL_ENOMEM : AL_ESESSION;
+      if (al__lock_record(fd, 0, 0) == -1)
+	{
+	  close(fd);
+	  return AL_ELOCKTIMEOUT;
+	}
 
-  /* Zero the fields that correspond to state saved on disk. */
-  zero_record(record);
+      /* Make sure the layout didn't change under us. */
+      session_file = al__session_path(username);
+      valid = (session_file) ? same_file(fd, session_file) : -1;
+      free(session_file);
+      if (valid == 1)
+	break;
+      al__lock_fd(fd, 0, 0, F_UNLCK, 1);
+      close(fd);
+      if (valid == -1)
+	return AL_ENOMEM;
+    }
 
-  /* Open and lock the session record. */
-  fd = open(session_file, O_CREAT|O_RDWR, 0600);
-  if (fd == -1)
-    return AL_ESESSION;
-  fl.l_type = F_WRLCK;
-  fl.l_whence = SEEK_SET;
-  fl.l_start = 0;
-  fl.l_len = 0;
-  while (fcntl(fd, F_SETLKW, &fl) == -1 && errno == EINTR)
-    ;
-  record->fp = fdopen(fd, "r+");
+  record->fd = fd;
+  retval = read_record(fd, username, record);
 
-  /* Get the first line (0 or 1; passwd created). */
-  switch (al__read_line(record->fp, &buf, &bufsize))
+  if (retval == AL_ESESSION)
     {
-    case -1:			/* error */
-      retval = AL_ESESSION;
-      goto cleanup;
+      /* Relinquish the lock in case this OS violates POSIX.1 B.6.5.2
+       * by not automatically relinquishing it when the fd is closed.
+       */
+      al__lock_fd(fd, 0, 0, F_UNLCK, 1);
+      close(fd);
+    }
+  return retval;
+}
 
-    case 1:			/* EOF */
-      retval = AL_SUCCESS;
-      goto cleanup;
+/* Closing any descriptor for a file releases all of the process's
+ * POSIX locks on it, so a snapshot taken by a process which holds the
+ * record locked (by way of the NSS module, for instance, while the
+ * library looks up the user) must not close its descriptor.  Such
+ * descriptors are kept here, and reused by later snapshots of the same
+ * record, until the lock is gone.  The NSS module has its own copy of
+ * this list, so the lock is detected through the kernel rather than by
+ * consulting files_get().
+ */
+struct kept_fd {
+  char *username;
+  int fd;
+};
 
-    default:			/* got line */
-      if (!strcmp(buf, "0") || !strcmp(buf, "1"))
-	record->passwd_added = buf[0] - '0';
-      else
-	goto cleanup;
-      break;
-    }
+static struct kept_fd *kept;
+static int nkept;
+#ifdef HAVE_PTHREAD_SIGMASK
+static pthread_mutex_t kept_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-  /* Get the second line (0 or 1; homedir attached). */
-  switch (al__read_line(record->fp, &buf, &bufsize))
-    {
-    case -1:			/* error */
-      retval = AL_ESESSION;
-      goto cleanup;
+static int files_snapshot(const char *username, struct al_record *record)
+{
+  struct kept_fd *newkept;
+  int fd = -1, i, retval;
 
-    case 1:			/* EOF */
-      goto cleanup;
+  record->fd = -1;
+#ifdef HAVE_PTHREAD_SIGMASK
+  pthread_mutex_lock(&kept_mutex);
+#endif
 
-    default:			/* got line */
-      if (!strcmp(buf, "0") || !strcmp(buf, "1"))
-	record->attached = buf[0] - '0';
-      else
-	goto cleanup;
-      break;
+  /* Close the descriptors whose locks have been released, and look for
+   * one open on this record. */
+  for (i = 0; i < nkept; i++)
+    {
+      if (al__lock_owned(kept[i].fd))
+	{
+	  if (strcmp(kept[i].username, username) == 0)
+	    fd = kept[i].fd;
+	  continue;
+	}
+      close(kept[i].fd);
+      free(kept[i].username);
+      kept[i--] = kept[--nkept];
     }
 
-  /* Get the third line (0 or 1old_homedir). */
-  switch (al__read_line(record->fp, &buf, &bufsize))
+  if (fd != -1)
+    retval = read_record(fd, NULL, record);
+  else
     {
-    case -1:			/* error */
-      retval = AL_ESESSION;
-      goto cleanup;
-
-    case 1:			/* EOF */
-      goto cleanup;
-
-    default:			/* got line */
-      if (!strcmp(buf, "0") || (buf[0] == '1' && strlen(buf) > 1))
+      fd = open_record(username, O_RDONLY);
+      if (fd == -1)
+	retval = (errno == ENOENT) ? AL_SUCCESS : AL_ESESSION;
+      else
 	{
-	  if (buf[0] != '0')
+	  retval = read_record(fd, NULL, record);
+
+	  /* If the descriptor can't be kept, leave it open rather than
+	   * release the lock. */
+	  if (!al__lock_owned(fd))
+	    close(fd);
+	  else if ((newkept = realloc(kept, (nkept + 1) * sizeof(*kept))))
 	    {
-	      record->old_homedir = strdup(buf + 1);
-	      if (!record->old_homedir)
-		{
-		  retval = AL_ESESSION;
-		  goto cleanup;
-		}
+	      kept = newkept;
+	      kept[nkept].username = strdup(username);
+	      kept[nkept].fd = fd;
+	      if (kept[nkept].username)
+		nkept++;
 	    }
 	}
-      else
-	goto cleanup;
-      break;
     }
 
-  /* Get the fourth line (gid1:gid2:...gidn:). */
-  switch (al__read_line(record->fp, &buf, &bufsize))
-    {
-    case -1:			/* error */
-      retval = AL_ESESSION;
-      goto cleanup;
+#ifdef HAVE_PTHREAD_SIGMASK
+  pthread_mutex_unlock(&kept_mutex);
+#endif
+  return retval;
+}
 
-    case 1:			/* EOF */
-      goto cleanup;
+static int files_put(struct al_record *record)
+{
+  char *buf;
+  size_t len = 0;
+  int retval = AL_SUCCESS;
 
-    default:			/* got line */
-      /* Make sure it's a list of zero or more numbers each followed by
-       * a colon.
+  if (record->exists || record->detach_pending)
+    {
+      /* The NSS module runs with the privileges of whatever process
+       * looks the user up, so the record must be world-readable.
        */
-      ptr1 = buf;
-      record->ngroups = 0;
-      while (*ptr1)
+      if (record->nss_passwd || record->nss_groups)
+	fchmod(record->fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+
+      buf = al__encode_session_record(record, &len);
+      if (!buf || pwrite(record->fd, buf, len, 0) != (ssize_t) len)
+	retval = AL_ESESSION;
+      free(buf);
+    }
+  if (retval == AL_SUCCESS)
+    {
+      ftruncate(record->fd, len);
+      if (al__config_bool("session_sync", 0) && al__sync_fd(record->fd) == -1)
+	retval = AL_ESESSION;
+    }
+
+  /* Relinquish the lock in case this OS violates POSIX.1 B.6.5.2
+   * by not automatically relinquishing it when the fd is closed.
+   */
+  al__lock_fd(record->fd, 0, 0, F_UNLCK, 1);
+
+  close(record->fd);
+  return retval;
+}
+
+/* In the sharded layout, the iterator walks the two levels of
+ * subdirectories, keeping one open directory per level.
+ */
+struct files_iter {
+  int depth;			/* Levels of subdirectories */
+  int migrating;		/* Flat layout with subdirectories present */
+  int level;			/* Level currently being read */
+  DIR *dirs[3];
+  char *path;
+  int baselen;
+};
+
+/* Return true if name is a subdirectory of the sharded layout. */
+static int shard_name(const char *name)
+{
+  return (isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1])
+	  && !name[2] && !isupper((unsigned char)name[0])
+	  && !isupper((unsigned char)name[1]));
+}
+
+static void files_iter_close(void *iter)
+{
+  struct files_iter *it = (struct files_iter *) iter;
+
+  if (!it)
+    return;
+  for (; it->level >= 0; it->level--)
+    closedir(it->dirs[it->level]);
+  free(it->path);
+  free(it);
+}
+
+static void *files_iter_open(void)
+{
+  struct files_iter *it;
+
+  it = malloc(sizeof(struct files_iter));
+  if (!it)
+    return NULL;
+  it->depth = (marker_exists(SHARDED_MARKER)) ? 2 : 0;
+  it->migrating = (it->depth == 0 && marker_exists(MIGRATING_MARKER));
+  it->level = -1;
+  it->baselen = strlen(al__session_dir);
+  it->path = malloc(it->baselen + 7);
+  if (!it->path)
+    {
+      files_iter_close(it);
+      return NULL;
+    }
+  strcpy(it->path, al__session_dir);
+  it->dirs[0] = opendir(it->path);
+  if (!it->dirs[0])
+    {
+      files_iter_close(it);
+      return NULL;
+    }
+  it->level = 0;
+  return it;
+}
+
+static const char *files_iter_next(void *iter)
+{
+  struct files_iter *it = (struct files_iter *) iter;
+  struct dirent *entry;
+  DIR *dir;
+
+  if (!it)
+    return NULL;
+  while (it->level >= 0)
+    {
+      entry = readdir(it->dirs[it->level]);
+      if (!entry)
 	{
-	  if (!isdigit((unsigned char)*ptr1) || !(ptr1 = strchr(ptr1, ':')))
-	    goto cleanup;
-	  record->ngroups++;
-	  ptr1++;
+	  /* Go back up a level, unless this is the top. */
+	  if (it->level == 0)
+	    return NULL;
+	  closedir(it->dirs[it->level--]);
+	  continue;
 	}
-      /* Parse the numbers into an array of gid_t. */
-      record->groups = malloc((record->ngroups + 1) * sizeof(gid_t));
-      if (!record->groups)
+      if (it->level < it->depth)
 	{
-	  retval = AL_ESESSION;
-	  goto cleanup;
+	  if (!shard_name(entry->d_name))
+	    continue;
+	  sprintf(it->path + it->baselen + 3 * it->level, "/%s",
+		  entry->d_name);
+	  dir = opendir(it->path);
+	  if (dir)
+	    it->dirs[++it->level] = dir;
+	  continue;
 	}
-      i = 0;
-      for (ptr1 = buf; *ptr1; ptr1 = 1 + strchr(ptr1, ':'))
-	record->groups[i++] = atoi(ptr1);
-    }
 
-  /* Get the fifth line (pid1:pid2:...pidn:). */
-  switch (al__read_line(record->fp, &buf, &bufsize))
-    {
-    case -1:			/* error */
-      retval = AL_ESESSION;
-      goto cleanup;
+      /* Skip the uid index and other entries which cannot be usernames. */
+      if (al__username_valid(entry->d_name)
+	  && !(it->migrating && shard_name(entry->d_name)))
+	return entry->d_name;
+    }
+  return NULL;
+}
 
-    case 1:			/* EOF */
-      goto cleanup;
+/* Give each flat record in the session directory a link in the
+ * sharded layout, counting failures in *errors.  If unlink_flat is
+ * set, remove the flat name of each record which has one.
+ */
+static void link_flat_records(int unlink_flat, int *errors)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st1, st2;
+  char *flat, *sharded;
 
-    default:			/* got line */
-      /* Make sure it's a list of zero or more numbers each followed by
-       * a colon. */
-      ptr1 = buf;
-      record->npids = 0;
-      while (*ptr1)
+  dir = opendir(al__session_dir);
+  if (!dir)
+    {
+      (*errors)++;
+      return;
+    }
+  while ((entry = readdir(dir)) != NULL)
+    {
+      if (!al__username_valid(entry->d_name) || shard_name(entry->d_name))
+	continue;
+      flat = record_path(entry->d_name, 0);
+      sharded = record_path(entry->d_name, 1);
+      if (!flat || !sharded || lstat(flat, &st1) == -1)
 	{
-	  if (!isdigit((unsigned char)*ptr1) || !(ptr1 = strchr(ptr1, ':')))
-	    goto cleanup;
-	  record->npids++;
-	  ptr1++;
+	  (*errors) += (!flat || !sharded);
+	  free(flat);
+	  free(sharded);
+	  continue;
 	}
-      /* Parse the numbers into an array of pid_t. */
-      record->pids = malloc((record->npids + 1) * sizeof(pid_t));
-      if (!record->pids)
+      if (S_ISREG(st1.st_mode))
 	{
-	  retval = AL_ESESSION;
-	  goto cleanup;
+	  make_shard_dirs(sharded);
+	  if (link(flat, sharded) == -1 && errno != EEXIST)
+	    (*errors)++;
+	  else if (unlink_flat && stat(sharded, &st2) == 0
+		   && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+	    unlink(flat);
 	}
-      i = 0;
-      for (ptr1 = buf; *ptr1; ptr1 = 1 + strchr(ptr1, ':'))
-	record->pids[i++] = atoi(ptr1);
+      free(flat);
+      free(sharded);
+    }
+  closedir(dir);
+}
+
+/* This is an internal function.  Its contract is to convert the
+ * session directory from the flat layout to the sharded layout, which
+ * is safe to do while users are logging in and out.  It returns the
+ * number of records which could not be converted, or -1 if the
+ * conversion could not be started.  It is safe to run again after an
+ * interruption.
+ */
+int al__shard_sessions(void)
+{
+  char *marker;
+  int fd, errors = 0;
+
+  marker = malloc(strlen(al__session_dir) + sizeof(MIGRATING_MARKER) + 1);
+  if (!marker)
+    return -1;
+  sprintf(marker, "%s/%s", al__session_dir, MIGRATING_MARKER);
+  fd = open(marker, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (fd == -1)
+    {
+      free(marker);
+      return -1;
     }
+  close(fd);
 
-  retval = AL_SUCCESS;
-  record->exists = 1;
+  /* Link the existing records, switch layouts, link any records
+   * created in the meantime, and then retire the flat names.
+   */
+  link_flat_records(0, &errors);
+  sprintf(marker, "%s/%s", al__session_dir, SHARDED_MARKER);
+  fd = open(marker, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (fd == -1)
+    {
+      free(marker);
+      return -1;
+    }
+  close(fd);
+  link_flat_records(1, &errors);
 
-cleanup:
-  free(buf);
+  if (errors == 0)
+    {
+      sprintf(marker, "%s/%s", al__session_dir, MIGRATING_MARKER);
+      unlink(marker);
+    }
+  free(marker);
+  return errors;
+}
 
-  if (retval == AL_ESESSION)
+const struct al_sessstore al__files_store = {
+  "files",
+  files_exists,
+  files_get,
+  files_snapshot,
+  files_put,
+  files_iter_open,
+  files_iter_next,
+  files_iter_close
+};
+
+/* The NSS module answers uid lookups through an index of symbolic
+ * links in the .uid subdirectory of the session directory, each named
+ * by a uid and pointing at a username.  Usernames may not begin with
+ * ".", so the index cannot collide with a session record.
+ */
+static char *uid_index_path(uid_t uid)
+{
+  char *path;
+
+  path = malloc(strlen(al__session_dir) + 32);
+  if (!path)
+    return NULL;
+  sprintf(path, "%s/.uid/%lu", al__session_dir, (unsigned long) uid);
+  return path;
+}
+
+/* This is an internal function.  Its contract is to point the uid
+ * index entry for uid at username.
+ */
+int al__set_uid_index(uid_t uid, const char *username)
+{
+  char *path, *p;
+  int retval;
+
+  path = uid_index_path(uid);
+  if (!path)
+    return AL_ENOMEM;
+  unlink(path);
+  retval = symlink(username, path);
+  if (retval == -1 && errno == ENOENT)
     {
-      /* Relinquish the lock in case this OS violates POSIX.1 B.6.5.2
-       * by not automatically relinquishing it when the fd is closed.
-       */
-      fl.l_type = F_UNLCK;
-      fcntl(fileno(record->fp), F_SETLKW, &fl);
+      /* Create the index directory and try again. */
+      p = strrchr(path, '/');
+      *p = 0;
+      mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+      *p = '/';
+      retval = symlink(username, path);
+    }
+  free(path);
+  return (retval == 0) ? AL_SUCCESS : AL_ESESSION;
+}
 
-      if (record->fp)
-	fclose(record->fp);
-      else
-	close(fd);
+/* This is an internal function.  Its contract is to remove the uid
+ * index entry for uid.
+ */
+void al__clear_uid_index(uid_t uid)
+{
+  char *path;
+
+  path = uid_index_path(uid);
+  if (path)
+    {
+      unlink(path);
+      free(path);
     }
-  else
+}
+
+/* This is an internal function.  Its contract is to return the
+ * allocated username the uid index gives for uid, or NULL if there is
+ * none.
+ */
+char *al__lookup_uid_index(uid_t uid)
+{
+  char *path, buf[1024];
+  int len;
+
+  path = uid_index_path(uid);
+  if (!path)
+    return NULL;
+  len = readlink(path, buf, sizeof(buf) - 1);
+  free(path);
+  if (len <= 0)
+    return NULL;
+  buf[len] = 0;
+  return strdup(buf);
+}
+
+/* This is an internal function.  Its contract is to parse the next
+ * name:gid: pair of a session record's group list, starting at *p.  On
+ * success, it stores an allocated copy of the name in *name and the gid
+ * in *gid, advances *p past the pair, and returns 0.  It returns -1 at
+ * the end of the list, on malformed data, or if out of memory.
+ */
+int al__next_group(const char **p, char **name, gid_t *gid)
+{
+  const char *q, *end;
+
+  q = strchr(*p, ':');
+  if (!q || q == *p || !isdigit((unsigned char)q[1]))
+    return -1;
+  *name = malloc(q - *p + 1);
+  if (!*name)
+    return -1;
+  memcpy(*name, *p, q - *p);
+  (*name)[q - *p] = 0;
+  *gid = atoi(q + 1);
+  end = strchr(q + 1, ':');
+  *p = (end) ? end + 1 : q + strlen(q);
+  return 0;
+}
+
+/* The NSS module answers group lookups through a second index, so that
+ * it need not read every session record.  The .gid subdirectory of the
+ * session directory holds a directory for each gid, containing a
+ * symbolic link named by each session user in the group and pointing
+ * at the group's name, and the .group subdirectory holds a symbolic
+ * link for each group name, pointing at its gid.  The directories and
+ * group name links are never removed, so that they need no locking;
+ * there are only as many as there are groups.  Entries are only hints,
+ * checked against the session records they lead to.
+ */
+
+/* Point the symbolic link path at target, creating the index
+ * directories above it if needed.  Return 0 on success or -1 on
+ * failure.
+ */
+static int set_index_link(char *path, const char *target)
+{
+  char buf[1024], *p;
+  int len;
+
+  len = readlink(path, buf, sizeof(buf) - 1);
+  if (len >= 0)
     {
-      /* Block signals that might kill process while record info on disk
-       * doesn't match reality.
-       */
-      sigemptyset(&smask);
-      sigaddset(&smask, SIGHUP);
-      sigaddset(&smask, SIGINT);
-      sigaddset(&smask, SIGQUIT);
-      sigaddset(&smask, SIGTSTP);
-      sigaddset(&smask, SIGALRM);
-      sigaddset(&smask, SIGCHLD);
-      sigprocmask(SIG_BLOCK, &smask, &(record->mask));
-      sigemptyset(&action.sa_mask);
-      action.sa_flags = 0;
-      action.sa_handler = SIG_DFL;
-      sigaction(SIGCHLD, &action, &(record->sigchld_action));
+      buf[len] = 0;
+      if (strcmp(buf, target) == 0)
+	return 0;
+      unlink(path);
     }
+  if (symlink(target, path) == 0)
+    return 0;
+  if (errno != ENOENT)
+    return -1;
 
-  if (retval != AL_SUCCESS)
+  /* Create the index directories and try again. */
+  for (p = strchr(path + strlen(al__session_dir) + 1, '/'); p;
+       p = strchr(p + 1, '/'))
     {
-      /* On either warning or error, zero out the record. */
-      free(record->old_homedir);
-      free(record->groups);
-      free(record->pids);
-      zero_record(record);
+      *p = 0;
+      mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+      *p = '/';
+    }
+  return symlink(target, path);
+}
+
+static char *group_index_path(const char *dir, const char *name,
+			      const char *username)
+{
+  char *path;
+
+  path = malloc(strlen(al__session_dir) + strlen(dir) + strlen(name)
+		+ ((username) ? strlen(username) : 0) + 4);
+  if (!path)
+    return NULL;
+  if (username)
+    sprintf(path, "%s/%s/%s/%s", al__session_dir, dir, name, username);
+  else
+    sprintf(path, "%s/%s/%s", al__session_dir, dir, name);
+  return path;
+}
+
+/* This is an internal function.  Its contract is to add username to
+ * the group index entries for each group in groups, a session record's
+ * group list.
+ */
+int al__set_group_index(const char *username, const char *groups)
+{
+  char *name, *path, gidstr[32];
+  int retval = AL_SUCCESS;
+  gid_t gid;
+
+  while (al__next_group(&groups, &name, &gid) == 0)
+    {
+      /* Group names must be usable as file names. */
+      if (al__username_valid(name))
+	{
+	  sprintf(gidstr, "%lu", (unsigned long) gid);
+	  path = group_index_path(".group", name, NULL);
+	  if (!path || set_index_link(path, gidstr) == -1)
+	    retval = AL_ESESSION;
+	  free(path);
+	  path = group_index_path(".gid", gidstr, username);
+	  if (!path || set_index_link(path, name) == -1)
+	    retval = AL_ESESSION;
+	  free(path);
+	}
+      free(name);
     }
   return retval;
 }
 
-/* This is an internal function.  Its contract is to write out a new
- * session record according to what's in record, drop the fcntl lock,
- * and close the file descriptor.
+/* This is an internal function.  Its contract is to remove username
+ * from the group index entries for each group in groups.
  */
-int al__put_session_record(struct al_record *record)
+void al__clear_group_index(const char *username, const char *groups)
 {
-  int i;
-  struct flock fl;
+  char *name, *path, gidstr[32];
+  gid_t gid;
+
+  while (al__next_group(&groups, &name, &gid) == 0)
+    {
+      free(name);
+      sprintf(gidstr, "%lu", (unsigned long) gid);
+      path = group_index_path(".gid", gidstr, username);
+      if (path)
+	unlink(path);
+      free(path);
+    }
+}
+
+/* This is an internal function.  Its contract is to set *gid to the
+ * gid the group index gives for the group name, returning 0, or to
+ * return -1 if there is none.
+ */
+int al__lookup_group_index(const char *name, gid_t *gid)
+{
+  char *path, buf[32];
+  int len;
+
+  if (!al__username_valid(name))
+    return -1;
+  path = group_index_path(".group", name, NULL);
+  if (!path)
+    return -1;
+  len = readlink(path, buf, sizeof(buf) - 1);
+  free(path);
+  if (len <= 0)
+    return -1;
+  buf[len] = 0;
+  if (!isdigit((unsigned char)buf[0]))
+    return -1;
+  *gid = atoi(buf);
+  return 0;
+}
 
-  rewind(record->fp);
+/* This is an internal function.  Its contract is to return an
+ * allocated vector of the allocated usernames the group index lists for
+ * gid, setting *n to their number.  It returns NULL with *n set to 0 if
+ * there are none or it runs out of memory.
+ */
+char **al__group_index_members(gid_t gid, int *n)
+{
+  DIR *dir;
+  struct dirent *ent;
+  char *path, **members = NULL, **newmembers, gidstr[32];
 
-  if (record->exists)
+  *n = 0;
+  sprintf(gidstr, "%lu", (unsigned long) gid);
+  path = group_index_path(".gid", gidstr, NULL);
+  if (!path)
+    return NULL;
+  dir = opendir(path);
+  free(path);
+  if (!dir)
+    return NULL;
+  while ((ent = readdir(dir)) != NULL)
     {
-      fprintf(record->fp, "%d\n%d\n%d%s\n",
-	      record->passwd_added, record->attached,
-	      (record->old_homedir != NULL),
-	      (record->old_homedir != NULL) ? record->old_homedir : "");
-      for (i = 0; i < record->ngroups; i++)
-	fprintf(record->fp, "%lu:", (unsigned long) record->groups[i]);
-      fputs("\n", record->fp);
-      for (i = 0; i < record->npids; i++)
-	fprintf(record->fp, "%lu:", (unsigned long) record->pids[i]);
-      fputs("\n", record->fp);
-      fflush(record->fp);
-      ftruncate(fileno(record->fp), ftell(record->fp));
+      if (!al__username_valid(ent->d_name))
+	continue;
+      newmembers = realloc(members, (*n + 1) * sizeof(char *));
+      if (!newmembers)
+	break;
+      members = newmembers;
+      members[*n] = strdup(ent->d_name);
+      if (!members[*n])
+	break;
+      (*n)++;
     }
-  else
-    ftruncate(fileno(record->fp), 0);
+  closedir(dir);
+  if (*n == 0)
+    {
+      free(members);
+      return NULL;
+    }
+  return members;
+}
 
-  /* Relinquish the lock in case this OS violates POSIX.1 B.6.5.2
-   * by not automatically relinquishing it when the fd is closed.
-   */
-  fl.l_type = F_UNLCK;
-  fl.l_whence = SEEK_SET;
-  fl.l_start = 0;
-  fl.l_len = 0;
-  fcntl(fileno(record->fp), F_SETLKW, &fl);
+/* This is an internal function.  Its contract is to return an
+ * iterator over the group names in the group index, for
+ * al__group_iter_next() and al__group_iter_close(), or NULL if out of
+ * memory.
+ */
+void *al__group_iter_open(void)
+{
+  DIR **iter;
+  char *path;
+
+  iter = malloc(sizeof(DIR *));
+  if (!iter)
+    return NULL;
+  path = malloc(strlen(al__session_dir) + sizeof("/.group"));
+  if (!path)
+    {
+      free(iter);
+      return NULL;
+    }
+  sprintf(path, "%s/.group", al__session_dir);
+  *iter = opendir(path);
+  free(path);
+  return iter;
+}
 
-  fclose(record->fp);
+/* This is an internal function.  Its contract is to return the next
+ * group name from iter, or NULL when there are no more.
+ */
+const char *al__group_iter_next(void *iter)
+{
+  DIR *dir = *(DIR **) iter;
+  struct dirent *ent;
 
-  free(record->old_homedir);
-  free(record->groups);
-  free(record->pids);
+  if (!dir)
+    return NULL;
+  while ((ent = readdir(dir)) != NULL)
+    {
+      if (al__username_valid(ent->d_name))
+	return ent->d_name;
+    }
+  return NULL;
+}
 
-  /* Restore the signal mask in record->mask. */
-  sigaction(SIGCHLD, &(record->sigchld_action), NULL);
-  sigprocmask(SIG_SETMASK, &(record->mask), NULL);
+void al__group_iter_close(void *iter)
+{
+  DIR *dir = *(DIR **) iter;
 
-  return AL_SUCCESS;
+  if (dir)
+    closedir(dir);
+  free(iter);
 }
@@ -0,0 +1,272 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* sessionbench measures the cost of the Athena login library's account
+ * setup: adding and removing many sessions of one user, and copying
+ * the prototype files into new temporary home directories.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "al.h"
+#include "al_private.h"
+
+/* Largest number of operations in one run, and a prime just above it
+ * with which bench_pid() spreads the pids out.
+ */
+#define MAX_COUNT	1000000
+#define PID_MODULUS	1000003
+#define PID_STRIDE	7919
+
+#define DEFAULT_COUNT	10000
+
+struct timing {
+  unsigned long long n;
+  unsigned long long usec;
+  unsigned long long max_usec;
+};
+
+static int bench_acct(const char *username, int count);
+static int bench_home(const char *proto, const char *dir, int count);
+static pid_t bench_pid(int i);
+static void start_timing(struct timeval *begin);
+static void stop_timing(struct timeval *begin, struct timing *t);
+static void print_timing(const char *plural, const char *name,
+			 struct timing *t);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+  const char *proto = PATH_TMPPROTO, *dir = "/tmp";
+  int c, count = DEFAULT_COUNT;
+
+  while ((c = getopt(argc, argv, "c:d:n:p:")) != -1)
+    {
+      switch (c)
+	{
+	case 'c':
+	  al__config_file = optarg;
+	  break;
+	case 'd':
+	  dir = optarg;
+	  break;
+	case 'n':
+	  count = atoi(optarg);
+	  if (count < 1 || count > MAX_COUNT)
+	    {
+	      fprintf(stderr, "sessionbench: count must be from 1 to %d\n",
+		      MAX_COUNT);
+	      return 1;
+	    }
+	  break;
+	case 'p':
+	  proto = optarg;
+	  break;
+	default:
+	  usage();
+	}
+    }
+  argc -= optind;
+  argv += optind;
+
+  if (argc == 2 && strcmp(argv[0], "acct") == 0)
+    return bench_acct(argv[1], count);
+  if (argc == 1 && strcmp(argv[0], "home") == 0)
+    return bench_home(proto, dir, count);
+  usage();
+  return 1;
+}
+
+/* Add count sessions of username with al_acct_create() and remove them
+ * again with al_acct_revert(), timing each call.  The user's passwd
+ * entry is kept in the memory of this process, so the system's passwd
+ * database is never changed; the group database and home directory are
+ * set up and reverted as for a real login.  Return 0 on success or 1
+ * on failure.
+ */
+static int bench_acct(const char *username, int count)
+{
+  struct timing creates = { 0, 0, 0 }, reverts = { 0, 0, 0 };
+  struct timeval begin;
+  struct al_session session;
+  const char *backend;
+  char *mem;
+  int i, ncreated, retval, status = 0;
+
+  /* Never touch the passwd database of the machine being measured. */
+  backend = al__config_string("passwd_backend");
+  if (!backend || strcmp(backend, "memory") != 0)
+    {
+      fprintf(stderr, "sessionbench: passwd_backend must be \"memory\"\n");
+      return 1;
+    }
+  if (al__record_exists(username))
+    {
+      fprintf(stderr, "sessionbench: %s already has a session record\n",
+	      username);
+      return 1;
+    }
+
+  for (ncreated = 0; ncreated < count; ncreated++)
+    {
+      start_timing(&begin);
+      retval = al_acct_create(username, bench_pid(ncreated), 0, 0, NULL);
+      stop_timing(&begin, &creates);
+      if (retval != AL_SUCCESS && retval != AL_WARNINGS)
+	{
+	  fprintf(stderr, "sessionbench: al_acct_create: %s\n",
+		  al_strerror(retval, &mem));
+	  al_free_errmem(mem);
+	  status = 1;
+	  break;
+	}
+    }
+
+  for (i = 0; i < ncreated; i++)
+    {
+      start_timing(&begin);
+      retval = al_acct_revert(username, bench_pid(i));
+      stop_timing(&begin, &reverts);
+      if (retval != AL_SUCCESS)
+	{
+	  fprintf(stderr, "sessionbench: al_acct_revert: %s\n",
+		  al_strerror(retval, &mem));
+	  al_free_errmem(mem);
+	  status = 1;
+	}
+    }
+
+  /* The last revert should have undone the account setup. */
+  retval = al_session_query(username, &session);
+  if (retval != AL_SUCCESS || session.exists)
+    {
+      fprintf(stderr, "sessionbench: %s was not reverted\n", username);
+      status = 1;
+    }
+  if (retval == AL_SUCCESS)
+    al_free_session(&session);
+
+  print_timing("creates", "create", &creates);
+  print_timing("reverts", "revert", &reverts);
+  return status;
+}
+
+/* Copy the prototype directory proto into count new directories under
+ * a temporary directory in dir, timing each copy, and remove them all
+ * afterwards.  Return 0 on success or 1 on failure.
+ */
+static int bench_home(const char *proto, const char *dir, int count)
+{
+  struct timing copies = { 0, 0, 0 };
+  struct timeval begin;
+  char *top, *dest;
+  int i, retval, status = 0;
+
+  top = malloc(strlen(dir) + 32);
+  dest = malloc(strlen(dir) + 64);
+  if (!top || !dest)
+    {
+      fprintf(stderr, "sessionbench: out of memory\n");
+      return 1;
+    }
+  sprintf(top, "%s/sessionbench.XXXXXX", dir);
+  if (!mkdtemp(top))
+    {
+      perror("sessionbench: mkdtemp");
+      return 1;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      sprintf(dest, "%s/%d", top, i);
+      if (mkdir(dest, S_IRWXU) == -1)
+	{
+	  perror("sessionbench: mkdir");
+	  status = 1;
+	  break;
+	}
+      start_timing(&begin);
+      retval = al__copy_prototype(proto, dest, getuid(), getgid());
+      stop_timing(&begin, &copies);
+      if (retval == -1)
+	{
+	  fprintf(stderr, "sessionbench: cannot copy %s\n", proto);
+	  status = 1;
+	  break;
+	}
+    }
+
+  if (al__remove_tree(AT_FDCWD, top) == -1)
+    fprintf(stderr, "sessionbench: cannot remove %s\n", top);
+  free(top);
+  free(dest);
+
+  print_timing("copies", "copy", &copies);
+  return status;
+}
+
+/* Return the pid to use for the ith session.  The pids are distinct
+ * but out of order, so that they are inserted all through the record
+ * rather than only at its end.  They need not belong to running
+ * processes.
+ */
+static pid_t bench_pid(int i)
+{
+  return 2 + (pid_t) (((long long) i * PID_STRIDE) % PID_MODULUS);
+}
+
+static void start_timing(struct timeval *begin)
+{
+  gettimeofday(begin, NULL);
+}
+
+static void stop_timing(struct timeval *begin, struct timing *t)
+{
+  struct timeval end;
+  unsigned long long usec;
+
+  gettimeofday(&end, NULL);
+  usec = (end.tv_sec - begin->tv_sec) * 1000000
+    + (end.tv_usec - begin->tv_usec);
+  t->n++;
+  t->usec += usec;
+  if (usec > t->max_usec)
+    t->max_usec = usec;
+}
+
+static void print_timing(const char *plural, const char *name,
+			 struct timing *t)
+{
+  printf("%s %llu\n", plural, t->n);
+  printf("%s_usec %llu\n", name, t->usec);
+  printf("%s_max_usec %llu\n", name, t->max_usec);
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: sessionbench [-c config] [-n count] acct user\n");
+  fprintf(stderr, "       sessionbench [-d dir] [-n count] [-p prototype] "
+	  "home\n");
+  exit(1);
+}
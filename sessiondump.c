@@ -0,0 +1,99 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* sessiondump prints Athena login session records in the text form
+ * described in sessions(5).
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "al.h"
+#include "al_private.h"
+
+static int dump(const char *username, int header);
+
+int main(int argc, char **argv)
+{
+  void *iter;
+  const char *username;
+  int i, status = 0;
+
+  if (argc > 1)
+    {
+      for (i = 1; i < argc; i++)
+	status |= dump(argv[i], argc > 2);
+      return status;
+    }
+
+  iter = al__session_iter_open();
+  if (!iter)
+    {
+      fprintf(stderr, "sessiondump: cannot read session records\n");
+      return 1;
+    }
+  while ((username = al__session_iter_next(iter)) != NULL)
+    status |= dump(username, 1);
+  al__session_iter_close(iter);
+  return status;
+}
+
+/* Print username's session record, preceded by a comment line giving
+ * the username if header is set.  Return 0 on success or 1 if the
+ * record could not be read.
+ */
+static int dump(const char *username, int header)
+{
+  struct al_record record;
+  int retval, i;
+
+  retval = al__snapshot_session_record(username, &record);
+  if (retval != AL_SUCCESS)
+    {
+      fprintf(stderr, "sessiondump: %s: %s\n", username,
+	      al_strerror(retval, NULL));
+      return 1;
+    }
+
+  if (header)
+    printf("# %s\n", username);
+  if (!record.exists)
+    {
+      al__free_record(&record);
+      return 0;
+    }
+
+  printf("%d\n%d\n%d%s\n", record.passwd_added, record.attached,
+	 (record.old_homedir != NULL),
+	 (record.old_homedir != NULL) ? record.old_homedir : "");
+  for (i = 0; i < record.ngroups; i++)
+    printf("%lu:", (unsigned long) record.groups[i]);
+  putchar('\n');
+  for (i = 0; i < record.npids; i++)
+    printf("%lu:", (unsigned long) record.pids[i]);
+  putchar('\n');
+  if (record.nss_passwd || record.nss_groups)
+    {
+      printf("%d%s\n%s\n", (record.nss_passwd != NULL),
+	     (record.nss_passwd != NULL) ? record.nss_passwd : "",
+	     (record.nss_groups != NULL) ? record.nss_groups : "");
+    }
+  al__free_record(&record);
+  return 0;
+}
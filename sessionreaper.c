@@ -0,0 +1,73 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* sessionreaper reverts the accounts of Athena login users as their
+ * login sessions exit.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include "al.h"
+
+int main(int argc, char **argv)
+{
+  struct al_reaper *reaper;
+  struct rlimit rl;
+  char *mem;
+  int retval;
+
+  if (argc != 1)
+    {
+      fprintf(stderr, "Usage: sessionreaper\n");
+      return 1;
+    }
+
+  /* The reaper holds a descriptor for each login session. */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+  retval = al_reaper_open(&reaper);
+  if (retval != AL_SUCCESS)
+    {
+      fprintf(stderr, "sessionreaper: %s\n", al_strerror(retval, &mem));
+      al_free_errmem(mem);
+      return 1;
+    }
+
+  while (1)
+    {
+      retval = al_reaper_run(reaper, -1);
+      if (retval != AL_SUCCESS)
+	{
+	  fprintf(stderr, "sessionreaper: %s\n", al_strerror(retval, &mem));
+	  al_free_errmem(mem);
+	}
+
+      /* Replace temporary home directories taken by logins since. */
+      retval = al_tmphome_refill();
+      if (retval != AL_SUCCESS)
+	{
+	  fprintf(stderr, "sessionreaper: %s\n", al_strerror(retval, &mem));
+	  al_free_errmem(mem);
+	}
+    }
+}
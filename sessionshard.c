@@ -0,0 +1,52 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* sessionshard converts the Athena login session directory from the
+ * flat layout to the sharded layout described in sessions(5).
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <signal.h>
+#include <stdio.h>
+#include "al.h"
+#include "al_private.h"
+
+int main(int argc, char **argv)
+{
+  int errors;
+
+  if (argc != 1)
+    {
+      fprintf(stderr, "Usage: sessionshard\n");
+      return 1;
+    }
+
+  errors = al__shard_sessions();
+  if (errors == -1)
+    {
+      fprintf(stderr, "sessionshard: cannot create layout marker\n");
+      return 1;
+    }
+  if (errors > 0)
+    {
+      fprintf(stderr, "sessionshard: %d record%s could not be converted; "
+	      "run sessionshard again to retry\n", errors,
+	      (errors == 1) ? "" : "s");
+      return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,57 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* sessionstat prints the Athena login library's statistics. */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <stdio.h>
+#include "al.h"
+
+int main(int argc, char **argv)
+{
+  struct al_stats stats;
+  char *mem;
+  int retval;
+
+  if (argc != 1)
+    {
+      fprintf(stderr, "Usage: sessionstat\n");
+      return 1;
+    }
+
+  retval = al_get_stats(&stats);
+  if (retval != AL_SUCCESS)
+    {
+      fprintf(stderr, "sessionstat: %s\n", al_strerror(retval, &mem));
+      al_free_errmem(mem);
+      return 1;
+    }
+
+  printf("lock_acquires %llu\n", stats.lock_acquires);
+  printf("lock_waits %llu\n", stats.lock_waits);
+  printf("lock_wait_usec %llu\n", stats.lock_wait_usec);
+  printf("lock_wait_max_usec %llu\n", stats.lock_wait_max_usec);
+  printf("lock_timeouts %llu\n", stats.lock_timeouts);
+  printf("admissions %llu\n", stats.admissions);
+  printf("admission_waits %llu\n", stats.admission_waits);
+  printf("admission_wait_usec %llu\n", stats.admission_wait_usec);
+  printf("admission_wait_max_usec %llu\n", stats.admission_wait_max_usec);
+  printf("spawns %llu\n", stats.spawns);
+  printf("spawn_usec %llu\n", stats.spawn_usec);
+  printf("spawn_max_usec %llu\n", stats.spawn_max_usec);
+  return 0;
+}
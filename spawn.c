@@ -0,0 +1,198 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements
+ * starting helper programs such as attach, detach, and pwd_mkdb.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+#ifdef HAVE_VFORK
+#include <sys/syscall.h>
+#endif
+#include "al.h"
+#include "al_private.h"
+
+/* The library is often linked into large programs, such as display
+ * managers, for which fork() must copy a big address space only for
+ * the child to replace it at once.  Helpers are therefore started with
+ * posix_spawn() where the system has it, and with vfork() where the
+ * helper must run as the user, which posix_spawn() cannot arrange.  A
+ * vfork() child shares the parent's memory until it execs, so it
+ * changes its ids with bare system calls rather than the C library's
+ * setuid(), which in a threaded program signals the caller's other
+ * threads.  It also shares the parent's errno, which callers must not
+ * rely on across al__spawn().  Elsewhere fork() is used.
+ */
+
+#if defined(HAVE_VFORK) && defined(SYS_setresuid32)
+#define SYS_SETRESUID	SYS_setresuid32
+#define SYS_SETRESGID	SYS_setresgid32
+#elif defined(HAVE_VFORK) && defined(SYS_setresuid)
+#define SYS_SETRESUID	SYS_setresuid
+#define SYS_SETRESGID	SYS_setresgid
+#endif
+
+extern char **environ;
+
+/* Set up a child of fork() or vfork() as al__spawn() describes, and
+ * exec path.  Return only on failure.
+ */
+static void exec_child(const char *path, char *const argv[], int flags,
+		       uid_t uid, gid_t gid, int setid_syscalls)
+{
+  int fd;
+
+  fd = open("/dev/null", O_RDWR);
+  if (fd == -1)
+    return;
+  dup2(fd, STDIN_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  if (fd > STDERR_FILENO)
+    close(fd);
+
+  if (flags & AL__SPAWN_PGROUP)
+    setpgid(0, 0);
+  if (flags & AL__SPAWN_SETID)
+    {
+#ifdef SYS_SETRESUID
+      if (setid_syscalls)
+	{
+	  if (syscall(SYS_SETRESGID, gid, gid, gid) == -1
+	      || syscall(SYS_SETRESUID, uid, uid, uid) == -1)
+	    return;
+	}
+      else
+#endif
+      if (setgid(gid) == -1 || setuid(uid) == -1)
+	return;
+    }
+  execve(path, argv, environ);
+}
+
+#ifdef HAVE_POSIX_SPAWN
+static pid_t posix_spawn_child(const char *path, char *const argv[],
+			       int flags)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  pid_t pid;
+  int ok;
+
+  if (posix_spawn_file_actions_init(&actions) != 0)
+    return -1;
+  if (posix_spawnattr_init(&attr) != 0)
+    {
+      posix_spawn_file_actions_destroy(&actions);
+      return -1;
+    }
+  ok = (posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+					 "/dev/null", O_RDWR, 0) == 0
+	&& posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO,
+					    STDOUT_FILENO) == 0
+	&& posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO,
+					    STDERR_FILENO) == 0);
+  if (ok && (flags & AL__SPAWN_PGROUP))
+    {
+      ok = (posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP) == 0
+	    && posix_spawnattr_setpgroup(&attr, 0) == 0);
+    }
+  if (!ok || posix_spawn(&pid, path, &actions, &attr, argv, environ) != 0)
+    pid = -1;
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return pid;
+}
+#endif
+
+/* This is an internal function.  Its contract is to start the program
+ * path with arguments argv, with its standard input and outputs on
+ * /dev/null, returning its pid for the caller to wait for, or -1 if it
+ * could not be started.  If flags include AL__SPAWN_PGROUP, the program
+ * leads a new process group; if they include AL__SPAWN_SETID, it runs
+ * with the given uid and gid.  The time taken to start the program is
+ * recorded in the statistics.
+ */
+pid_t al__spawn(const char *path, char *const argv[], int flags, uid_t uid,
+		gid_t gid)
+{
+  struct timeval begin, end;
+  pid_t pid = -1;
+  int done = 0;
+  long usec;
+
+  gettimeofday(&begin, NULL);
+
+#ifdef HAVE_POSIX_SPAWN
+  /* Some posix_spawn() implementations report a failed exec rather
+   * than starting a child which exits.  Callers expect the latter, as
+   * when a missing attach counts as a failed attach, so fall back in
+   * that case.
+   */
+  if (!(flags & AL__SPAWN_SETID))
+    {
+      pid = posix_spawn_child(path, argv, flags);
+      done = (pid != -1);
+    }
+#endif
+
+#ifdef SYS_SETRESUID
+  if (!done)
+    {
+      pid = vfork();
+      if (pid == 0)
+	{
+	  exec_child(path, argv, flags, uid, gid, 1);
+	  _exit(1);
+	}
+      done = 1;
+    }
+#endif
+
+  if (!done)
+    {
+      pid = fork();
+      if (pid == 0)
+	{
+	  exec_child(path, argv, flags, uid, gid, 0);
+	  _exit(1);
+	}
+    }
+
+  /* Set the process group from both sides, so that it is in place
+   * whichever runs first.
+   */
+  if (pid > 0 && (flags & AL__SPAWN_PGROUP))
+    setpgid(pid, pid);
+
+  gettimeofday(&end, NULL);
+  if (pid > 0)
+    {
+      usec = (end.tv_sec - begin.tv_sec) * 1000000
+	+ (end.tv_usec - begin.tv_usec);
+      al__stat_add(AL__STAT_SPAWNS, 1);
+      al__stat_add(AL__STAT_SPAWN_USEC, usec);
+      al__stat_max(AL__STAT_SPAWN_MAX_USEC, usec);
+    }
+  return pid;
+}
@@ -0,0 +1,203 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements
+ * operational statistics shared by every process using the library.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD_SIGMASK
+#include <pthread.h>
+#endif
+#include "al.h"
+#include "al_private.h"
+
+extern char *al__session_dir;
+
+/* Logins are handled by many short-lived processes, so the statistics
+ * are kept in a file in the session directory, which each process
+ * maps and updates with atomic operations.  The file holds a header
+ * followed by one 64-bit counter per statistic, in the order of the
+ * AL__STAT_* values.  New statistics are added at the end, and a
+ * process finding the file too short for its statistics extends it.
+ */
+
+#define STATS_FILE		".stats"
+#define STATS_MAGIC		"ALST"
+
+struct stats_header {
+  char magic[4];
+  uint32_t version;
+};
+
+#define STATS_SIZE (sizeof(struct stats_header) + AL__NSTATS * sizeof(uint64_t))
+
+static uint64_t *counters;
+#ifdef HAVE_PTHREAD_SIGMASK
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+#else
+static int stats_tried;
+#endif
+
+static char *stats_path(void)
+{
+  char *path;
+
+  path = malloc(strlen(al__session_dir) + sizeof(STATS_FILE) + 1);
+  if (path)
+    sprintf(path, "%s/%s", al__session_dir, STATS_FILE);
+  return path;
+}
+
+/* Map the statistics file for updating, creating or extending it as
+ * needed.  Processes which cannot write it keep no statistics.
+ */
+static void map_stats(void)
+{
+  struct stats_header hdr;
+  struct stat st;
+  char *path, *map;
+  int fd;
+
+  path = stats_path();
+  if (!path)
+    return;
+  fd = open(path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  free(path);
+  if (fd == -1)
+    return;
+
+  if (fstat(fd, &st) == -1)
+    {
+      close(fd);
+      return;
+    }
+  if (st.st_size == 0)
+    {
+      memcpy(hdr.magic, STATS_MAGIC, sizeof(hdr.magic));
+      hdr.version = 1;
+      pwrite(fd, &hdr, sizeof(hdr), 0);
+    }
+  if (st.st_size < (off_t) STATS_SIZE)
+    ftruncate(fd, STATS_SIZE);
+
+  map = mmap(NULL, STATS_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+  if (memcmp(map, STATS_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+      munmap(map, STATS_SIZE);
+      return;
+    }
+  counters = (uint64_t *) (map + sizeof(struct stats_header));
+}
+
+static uint64_t *get_counters(void)
+{
+#ifdef HAVE_PTHREAD_SIGMASK
+  pthread_once(&stats_once, map_stats);
+#else
+  if (!stats_tried)
+    {
+      stats_tried = 1;
+      map_stats();
+    }
+#endif
+  return counters;
+}
+
+/* This is an internal function.  Its contract is to add n to
+ * statistic stat.
+ */
+void al__stat_add(int stat, unsigned long long n)
+{
+  uint64_t *c = get_counters();
+
+  if (c)
+    __sync_fetch_and_add(&c[stat], (uint64_t) n);
+}
+
+/* This is an internal function.  Its contract is to raise statistic
+ * stat to n if it is lower.
+ */
+void al__stat_max(int stat, unsigned long long n)
+{
+  uint64_t *c = get_counters(), old;
+
+  if (!c)
+    return;
+  old = c[stat];
+  while (old < n)
+    old = __sync_val_compare_and_swap(&c[stat], old, (uint64_t) n);
+}
+
+/* The al_get_stats() function reads the statistics gathered by every
+ * process using the library since the statistics file was created.
+ */
+
+int al_get_stats(struct al_stats *stats)
+{
+  struct stats_header hdr;
+  uint64_t values[AL__NSTATS];
+  char *path;
+  ssize_t len;
+  int fd;
+
+  memset(stats, 0, sizeof(struct al_stats));
+  memset(values, 0, sizeof(values));
+  path = stats_path();
+  if (!path)
+    return AL_ENOMEM;
+  fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1)
+    return (errno == ENOENT) ? AL_SUCCESS : AL_ESESSION;
+
+  /* Statistics a shorter file lacks read as zero. */
+  len = pread(fd, values, sizeof(values), sizeof(hdr));
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || len == -1
+      || memcmp(hdr.magic, STATS_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+      close(fd);
+      return AL_ESESSION;
+    }
+  close(fd);
+
+  stats->lock_acquires = values[AL__STAT_LOCK_ACQUIRES];
+  stats->lock_waits = values[AL__STAT_LOCK_WAITS];
+  stats->lock_wait_usec = values[AL__STAT_LOCK_WAIT_USEC];
+  stats->lock_wait_max_usec = values[AL__STAT_LOCK_WAIT_MAX_USEC];
+  stats->lock_timeouts = values[AL__STAT_LOCK_TIMEOUTS];
+  stats->admissions = values[AL__STAT_ADMISSIONS];
+  stats->admission_waits = values[AL__STAT_ADMISSION_WAITS];
+  stats->admission_wait_usec = values[AL__STAT_ADMISSION_WAIT_USEC];
+  stats->admission_wait_max_usec = values[AL__STAT_ADMISSION_WAIT_MAX_USEC];
+  stats->spawns = values[AL__STAT_SPAWNS];
+  stats->spawn_usec = values[AL__STAT_SPAWN_USEC];
+  stats->spawn_max_usec = values[AL__STAT_SPAWN_MAX_USEC];
+  return AL_SUCCESS;
+}
@@ -0,0 +1,569 @@
+/* Copyright 2026 by the Massachusetts Institute of Technology.
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+/* This file is part of the Athena login library.  It implements
+ * populating temporary home directories from the prototype.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SETFSUID
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "al.h"
+#include "al_private.h"
+
+#define COPY_BUFSIZE	65536
+
+#if defined(HAVE_SETFSUID) && defined(SYS_setgroups32)
+#define SYS_SETGROUPS	SYS_setgroups32
+#elif defined(HAVE_SETFSUID) && defined(SYS_setgroups)
+#define SYS_SETGROUPS	SYS_setgroups
+#endif
+
+/* Copy the contents of the file open on srcfd to dstfd.  If *clone is
+ * set, try first to clone the file, sharing its data with the
+ * original, and clear *clone if the file system cannot do that.
+ * Return 0 on success or -1 on failure.
+ */
+static int copy_contents(int srcfd, int dstfd, int *clone)
+{
+  char buf[COPY_BUFSIZE], *p;
+  ssize_t count, written;
+
+#ifdef FICLONE
+  /* On file systems such as btrfs and XFS, a clone takes the same
+   * short time however large the file is.
+   */
+  if (*clone)
+    {
+      if (ioctl(dstfd, FICLONE, srcfd) == 0)
+	return 0;
+      *clone = 0;
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  /* Let the kernel copy the data, falling back to reading and writing
+   * it if the file systems involved do not support that.
+   */
+  while ((count = copy_file_range(srcfd, NULL, dstfd, NULL,
+				  COPY_BUFSIZE * 16, 0)) != 0)
+    {
+      if (count == -1 && errno == EINTR)
+	continue;
+      if (count == -1 && (errno == EXDEV || errno == ENOSYS
+			  || errno == EINVAL || errno == EOPNOTSUPP))
+	break;
+      if (count == -1)
+	return -1;
+    }
+  if (count == 0)
+    return 0;
+#endif
+
+  while ((count = read(srcfd, buf, sizeof(buf))) != 0)
+    {
+      if (count == -1 && errno == EINTR)
+	continue;
+      if (count == -1)
+	return -1;
+      for (p = buf; count > 0; p += written, count -= written)
+	{
+	  written = write(dstfd, p, count);
+	  if (written == -1 && errno == EINTR)
+	    written = 0;
+	  else if (written == -1)
+	    return -1;
+	}
+    }
+  return 0;
+}
+
+/* Copy the contents of the directory open on srcdir into the directory
+ * open on dstdir, recursively, preserving permissions, symlinks, and
+ * subdirectories, and cloning files while *clone is set (see
+ * copy_contents()).  Files of other types are skipped.  Everything is
+ * created relative to dstdir without following symlinks, so that
+ * nothing placed in the destination can redirect the copy elsewhere.
+ * Both descriptors are closed.  Return 0 on success or -1 on failure.
+ */
+static int copy_tree(int srcdir, int dstdir, int *clone)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st;
+  char *target;
+  ssize_t len;
+  int srcfd, dstfd, subdir, retval = 0;
+
+  dir = fdopendir(srcdir);
+  if (!dir)
+    {
+      close(srcdir);
+      close(dstdir);
+      return -1;
+    }
+
+  while (retval == 0 && (entry = readdir(dir)) != NULL)
+    {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+	continue;
+      if (fstatat(srcdir, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+	{
+	  retval = -1;
+	  break;
+	}
+
+      if (S_ISDIR(st.st_mode))
+	{
+	  /* Fill in the subdirectory before giving it its final mode,
+	   * in case that mode does not allow writing.
+	   */
+	  if (mkdirat(dstdir, entry->d_name, S_IRWXU) == -1)
+	    retval = -1;
+	  else
+	    {
+	      srcfd = openat(srcdir, entry->d_name,
+			     O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+	      dstfd = openat(dstdir, entry->d_name,
+			     O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+	      if (srcfd == -1 || dstfd == -1)
+		{
+		  if (srcfd != -1)
+		    close(srcfd);
+		  if (dstfd != -1)
+		    close(dstfd);
+		  retval = -1;
+		}
+	      else
+		{
+		  subdir = dup(dstfd);
+		  if (subdir == -1)
+		    {
+		      close(srcfd);
+		      retval = -1;
+		    }
+		  else
+		    retval = copy_tree(srcfd, subdir, clone);
+		  if (retval == 0 && fchmod(dstfd, st.st_mode & 0777) == -1)
+		    retval = -1;
+		  close(dstfd);
+		}
+	    }
+	}
+      else if (S_ISLNK(st.st_mode))
+	{
+	  target = malloc(st.st_size + 1);
+	  len = (target) ? readlinkat(srcdir, entry->d_name, target,
+				      st.st_size + 1) : -1;
+	  if (len == -1 || len > st.st_size)
+	    retval = -1;
+	  else
+	    {
+	      target[len] = 0;
+	      if (symlinkat(target, dstdir, entry->d_name) == -1)
+		retval = -1;
+	    }
+	  free(target);
+	}
+      else if (S_ISREG(st.st_mode))
+	{
+	  srcfd = openat(srcdir, entry->d_name, O_RDONLY|O_NOFOLLOW);
+	  dstfd = openat(dstdir, entry->d_name,
+			 O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IRUSR|S_IWUSR);
+	  if (srcfd == -1 || dstfd == -1
+	      || copy_contents(srcfd, dstfd, clone) == -1
+	      || fchmod(dstfd, st.st_mode & 0777) == -1)
+	    retval = -1;
+	  if (srcfd != -1)
+	    close(srcfd);
+	  if (dstfd != -1 && close(dstfd) == -1)
+	    retval = -1;
+	}
+    }
+
+  closedir(dir);
+  close(dstdir);
+  return retval;
+}
+
+/* Copy the prototype directory proto into the existing directory dest
+ * with the current credentials.  Return 0 on success or -1 on failure.
+ */
+static int copy_prototype(const char *proto, const char *dest)
+{
+  struct stat srcst, dstst;
+  int srcdir, dstdir, clone;
+
+  srcdir = open(proto, O_RDONLY|O_DIRECTORY);
+  if (srcdir == -1)
+    return -1;
+  dstdir = open(dest, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+  if (dstdir == -1)
+    {
+      close(srcdir);
+      return -1;
+    }
+
+  /* Files can only be cloned within a file system.  Whether that file
+   * system supports cloning is found out from the first file.
+   */
+  clone = (fstat(srcdir, &srcst) == 0 && fstat(dstdir, &dstst) == 0
+	   && srcst.st_dev == dstst.st_dev);
+  return copy_tree(srcdir, dstdir, &clone);
+}
+
+#ifdef SYS_SETGROUPS
+/* Restore the calling thread's credentials after enter_user_fs(). */
+static void leave_user_fs(gid_t *saved, int nsaved)
+{
+  setfsuid(geteuid());
+  setfsgid(getegid());
+  syscall(SYS_SETGROUPS, nsaved, saved);
+  free(saved);
+}
+
+/* Give the calling thread the file system ids uid and gid and the
+ * single group gid, saving its groups in *saved for leave_user_fs().
+ * The C library's setgroups() changes the groups of every thread in the
+ * process, so the system call is made directly, which changes only the
+ * calling thread's.  Return 0 on success, or -1 with the thread's
+ * credentials unchanged.
+ */
+static int enter_user_fs(uid_t uid, gid_t gid, gid_t **saved, int *nsaved)
+{
+  int n;
+
+  n = getgroups(0, NULL);
+  if (n < 0)
+    return -1;
+  *saved = malloc((n + 1) * sizeof(gid_t));
+  if (!*saved)
+    return -1;
+  *nsaved = getgroups(n, *saved);
+  if (*nsaved < 0 || syscall(SYS_SETGROUPS, 1, &gid) == -1)
+    {
+      free(*saved);
+      return -1;
+    }
+
+  /* setfsuid() and setfsgid() report no errors; check the result. */
+  setfsgid(gid);
+  setfsuid(uid);
+  if ((uid_t) setfsuid(-1) != uid || (gid_t) setfsgid(-1) != gid)
+    {
+      leave_user_fs(*saved, *nsaved);
+      return -1;
+    }
+  return 0;
+}
+#endif
+
+/* This is an internal function.  Its contract is to copy the contents
+ * of the prototype directory proto into dest, a directory owned by the
+ * user with the given uid and gid, with that user's credentials, so
+ * that the copy cannot be used to reach files the user could not.
+ * Where the prototype and dest are on a file system which supports
+ * it, such as btrfs or XFS, files are cloned rather than copied, so
+ * that a large prototype costs little more than an empty one.  It
+ * returns 0 on success or -1 on failure.
+ *
+ * The copy is made in a single child process, which drops privileges
+ * for the whole tree.  In threads mode, forking would leave the child
+ * with whatever locks other threads held, so on systems with
+ * setfsuid() the calling thread instead takes on the user's file
+ * system ids and, like the child, the user's gid as its only group,
+ * for the duration of the copy.  If the thread's credentials cannot be
+ * changed, the copy is made in a child after all.
+ */
+int al__copy_prototype(const char *proto, const char *dest, uid_t uid,
+		       gid_t gid)
+{
+  pid_t pid, rpid;
+  int status;
+
+#ifdef SYS_SETGROUPS
+  if (al__threaded())
+    {
+      gid_t *saved;
+      int nsaved, retval;
+
+      if (enter_user_fs(uid, gid, &saved, &nsaved) == 0)
+	{
+	  retval = copy_prototype(proto, dest);
+	  leave_user_fs(saved, nsaved);
+	  return retval;
+	}
+    }
+#endif
+
+  pid = fork();
+  switch (pid)
+    {
+    case -1:
+      return -1;
+
+    case 0:
+      if (setgroups(1, &gid) == -1 || setgid(gid) == -1
+	  || setuid(uid) == -1)
+	_exit(1);
+      _exit((copy_prototype(proto, dest) == 0) ? 0 : 1);
+
+    default:
+      while ((rpid = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+	;
+      if (rpid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	return -1;
+      return 0;
+    }
+}
+
+/* Logins which fall back to temporary home directories tend to come
+ * all at once, when a file server goes down.  To take the creation of
+ * the directories out of those logins, al_tmphome_refill() can keep
+ * "tmphome_pool" populated directories in PATH_TMPPOOL, owned by root
+ * and named arbitrarily.  A login claims one by renaming it to the
+ * user's temporary home directory and changing the ownership of its
+ * contents, the top-level directory last so that the user cannot reach
+ * the directory before it is ready.  Directories are populated under
+ * names beginning with ".new." and renamed into the pool when
+ * complete; a refill removes any left over from an earlier refill
+ * which was interrupted.  PATH_TMPPOOL is accessible only to root.
+ */
+
+#define POOL_LOCK	".lock"
+#define POOL_NEW	".new."
+
+/* This is an internal function.  Its contract is to remove name, in
+ * the directory open on dirfd (or AT_FDCWD), and everything beneath
+ * it, without following symlinks.  It returns 0 on success or -1 on
+ * failure.
+ */
+int al__remove_tree(int dirfd, const char *name)
+{
+  DIR *dir;
+  struct dirent *entry;
+  int fd, retval = 0;
+
+  if (unlinkat(dirfd, name, 0) == 0)
+    return 0;
+  if (errno != EISDIR && errno != EPERM)
+    return -1;
+
+  fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+  if (fd == -1)
+    return -1;
+  dir = fdopendir(fd);
+  if (!dir)
+    {
+      close(fd);
+      return -1;
+    }
+  while ((entry = readdir(dir)) != NULL)
+    {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+	continue;
+      if (al__remove_tree(fd, entry->d_name) == -1)
+	retval = -1;
+    }
+  closedir(dir);
+  if (retval == 0)
+    retval = unlinkat(dirfd, name, AT_REMOVEDIR);
+  return retval;
+}
+
+/* Give the contents of the directory open on dirfd to uid and gid,
+ * without following symlinks.  dirfd is closed.  Return 0 on success
+ * or -1 on failure.
+ */
+static int chown_tree(int dirfd, uid_t uid, gid_t gid)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st;
+  int fd, retval = 0;
+
+  dir = fdopendir(dirfd);
+  if (!dir)
+    {
+      close(dirfd);
+      return -1;
+    }
+  while (retval == 0 && (entry = readdir(dir)) != NULL)
+    {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+	continue;
+      if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1
+	  || fchownat(dirfd, entry->d_name, uid, gid,
+		      AT_SYMLINK_NOFOLLOW) == -1)
+	retval = -1;
+      else if (S_ISDIR(st.st_mode))
+	{
+	  fd = openat(dirfd, entry->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+	  retval = (fd == -1) ? -1 : chown_tree(fd, uid, gid);
+	}
+    }
+  closedir(dir);
+  return retval;
+}
+
+/* This is an internal function.  Its contract is to take a directory
+ * from the pool of temporary home directories, if there is one, and
+ * make it dest, a temporary home directory owned by the user with the
+ * given uid and gid.  It returns 0 on success or -1 if no directory
+ * could be taken, in which case dest does not exist.
+ */
+int al__claim_tmphome(const char *dest, uid_t uid, gid_t gid)
+{
+  DIR *dir;
+  struct dirent *entry;
+  char *path;
+  int fd, retval = -1;
+
+  if (al__config_number("tmphome_pool", 0) <= 0)
+    return -1;
+  dir = opendir(PATH_TMPPOOL);
+  if (!dir)
+    return -1;
+  path = malloc(sizeof(PATH_TMPPOOL) + NAME_MAX + 1);
+  while (path && retval == -1 && (entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] == '.')
+	continue;
+
+      /* Another login may take the same directory first. */
+      sprintf(path, "%s/%s", PATH_TMPPOOL, entry->d_name);
+      if (rename(path, dest) == -1)
+	continue;
+
+      fd = open(dest, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+      if (fd != -1 && chown_tree(dup(fd), uid, gid) == 0
+	  && fchown(fd, uid, gid) == 0)
+	retval = 0;
+      if (fd != -1)
+	close(fd);
+      if (retval == -1)
+	{
+	  al__remove_tree(AT_FDCWD, dest);
+	  break;
+	}
+    }
+  free(path);
+  closedir(dir);
+  return retval;
+}
+
+/* The al_tmphome_refill() function brings the pool of temporary home
+ * directories up to the size set by "tmphome_pool" in al.conf, for a
+ * daemon such as sessionreaper(8) to call periodically.  It returns
+ * immediately if another process is refilling the pool.
+ */
+
+int al_tmphome_refill(void)
+{
+  DIR *dir;
+  struct dirent *entry;
+  char *path, *newpath;
+  long size, n = 0;
+  int lockfd, retval = AL_SUCCESS;
+
+  size = al__config_number("tmphome_pool", 0);
+  if (size <= 0)
+    return AL_SUCCESS;
+
+  mkdir(PATH_TMPDIRS, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+  mkdir(PATH_TMPPOOL, S_IRWXU);
+  lockfd = open(PATH_TMPPOOL "/" POOL_LOCK, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+  if (lockfd == -1)
+    return AL_EPERM;
+  if (al__lock_fd(lockfd, 0, 0, F_WRLCK, 0) == -1)
+    {
+      close(lockfd);
+      return AL_SUCCESS;
+    }
+
+  /* Count the pool, clearing out any directories left half built. */
+  dir = opendir(PATH_TMPPOOL);
+  if (!dir)
+    {
+      close(lockfd);
+      return AL_EPERM;
+    }
+  while ((entry = readdir(dir)) != NULL)
+    {
+      if (strncmp(entry->d_name, POOL_NEW, sizeof(POOL_NEW) - 1) == 0)
+	al__remove_tree(dirfd(dir), entry->d_name);
+      else if (entry->d_name[0] != '.')
+	n++;
+    }
+  closedir(dir);
+
+  path = malloc(sizeof(PATH_TMPPOOL) + sizeof(POOL_NEW) + 7);
+  newpath = malloc(sizeof(PATH_TMPPOOL) + 7);
+  if (!path || !newpath)
+    {
+      free(path);
+      free(newpath);
+      close(lockfd);
+      return AL_ENOMEM;
+    }
+  for (; n < size; n++)
+    {
+      sprintf(path, "%s/%sXXXXXX", PATH_TMPPOOL, POOL_NEW);
+      if (!mkdtemp(path))
+	{
+	  retval = AL_EPERM;
+	  break;
+	}
+      if (copy_prototype(PATH_TMPPROTO, path) == -1)
+	{
+	  al__remove_tree(AT_FDCWD, path);
+	  retval = AL_EPERM;
+	  break;
+	}
+
+      /* Publish the directory under its name without the prefix. */
+      sprintf(newpath, "%s/%s", PATH_TMPPOOL,
+	      path + sizeof(PATH_TMPPOOL) + sizeof(POOL_NEW) - 1);
+      if (rename(path, newpath) == -1)
+	{
+	  al__remove_tree(AT_FDCWD, path);
+	  retval = AL_EPERM;
+	  break;
+	}
+    }
+  free(path);
+  free(newpath);
+  close(lockfd);
+  return retval;
+}
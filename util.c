@@ -19,22 +19,23 @@
 
 static const char rcsid[] = "$Id: util.c,v 1.11 2005-06-09 15:33:53 ghudson Exp $";
 
+/* For open file description locks. */
+#define _GNU_SOURCE
+
 #include <sys/param.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <pwd.h>
 #include "al.h"
 #include "al_private.h"
 
-#ifdef HAVE_MASTER_PASSWD
-#include <db.h>
-#include <utmp.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#endif
 
 const char *al_strerror(int code, char **mem)
 {
@@ -59,7 +60,10 @@ const char *al_strerror(int code, char **mem)
     "Using a temporary home directory created by a previous login",
     "Attach failed; you have a temporary home directory",
     "Attach failed; you have no home directory",
-    "Home directory attach is disabled on this machine"
+    "Home directory attach is disabled on this machine",
+    "Timed out waiting for another login of this user to finish",
+    "Attach timed out; you have a temporary home directory",
+    "Home directory server is down; you have a temporary home directory"
   };
 
   assert(code >= 0 && code < (sizeof(errtext) / sizeof(*errtext)));
@@ -71,195 +75,79 @@ void al_free_errmem(char *mem)
   /* Do nothing for now. */
 }
 
-/* The next couple of functions (al__getpwnam() and al__getpwuid())
- * are here because libal, being a library, shouldn't be stomping on
- * the static memory returned by the native operating system's
- * getpwnam() and getpwuid() calls.  Unfortunately, we have to write a
- * lot of code which does the same thing as libc does.  Some day we
- * may be able to assume that all modern platforms have getpwnam_r()
- * and getpwuid_r() and have a single, simple version of these
- * functions.
- */
-
-#ifdef HAVE_MASTER_PASSWD
-static struct passwd *lookup(const DBT *key);
-
-struct passwd *al__getpwnam(const char *username)
-{
-  DBT key;
-  char buf[UT_NAMESIZE + 1];
-  int len;
-
-  /* Paranoia: don't find an empty username. */
-  if (!*username)
-    return NULL;
-  len = strlen(username);
-  if (len > UT_NAMESIZE)
-    len = UT_NAMESIZE;
-  buf[0] = _PW_KEYBYNAME;
-  memcpy(buf + 1, username, len);
-  key.data = buf;
-  key.size = len + 1;
-  return lookup(&key);
-}
-
-struct passwd *al__getpwuid(uid_t uid)
+void al__free_passwd(struct passwd *pwd)
 {
-  DBT key;
-  char buf[128];
-
-  sprintf(buf, "%c%d", _PW_KEYBYUID, (int) uid);
-  key.data = buf;
-  key.size = strlen(buf);
-  return lookup(&key);
+  free(pwd);
 }
 
-static struct passwd *lookup(const DBT *key)
+/* This is an internal function.  Its contract is to parse a passwd
+ * line of the form name:passwd:uid:gid:gecos:dir:shell (the format the
+ * NSS module serves, regardless of the native passwd format) into an
+ * allocated passwd structure which the caller frees with
+ * al__free_passwd().  It returns NULL on a malformed line or if it
+ * runs out of memory.
+ */
+struct passwd *al__parse_passwd_line(const char *line)
 {
-  DB *db;
-  DBT value;
-  unsigned char buf[UT_NAMESIZE + 1];
-  int len, success = 0;
-  char *p, *buffer;
   struct passwd *pwd;
+  char *buffer, *p;
+  int i;
 
-  /* Open the insecure or secure database depending on whether we're root. */
-  db = _dbopen(_PATH_SMP_DB, O_RDONLY, 0, DB_HASH, NULL);
-  if (!db)
-    db = _dbopen(_PATH_MP_DB, O_RDONLY, 0, DB_HASH, NULL);
-  if (!db)
-    return NULL;
-
-  /* Look up the username. */
-  if (db->get(db, key, &value, 0) != 0)
-    {
-      db->close(db);
-      return NULL;
-    }
-  buffer = malloc(sizeof(struct passwd) + value.size);
+  buffer = malloc(sizeof(struct passwd) + strlen(line) + 1);
   if (!buffer)
-    {
-      db->close(db);
-      return NULL;
-    }
+    return NULL;
   pwd = (struct passwd *) buffer;
+  memset(pwd, 0, sizeof(struct passwd));
   buffer += sizeof(struct passwd);
-  memcpy(buffer, value.data, value.size);
-#define FIELD(v) v = buffer; buffer += strlen(buffer) + 1
-  FIELD(pwd->pw_name);
-  FIELD(pwd->pw_passwd);
-  memcpy(&pwd->pw_uid, buffer, sizeof(int));
-  memcpy(&pwd->pw_gid, buffer + sizeof(int), sizeof(int));
-  memcpy(&pwd->pw_change, buffer + 2 * sizeof(int), sizeof(time_t));
-  buffer += 2 * sizeof(int) + sizeof(time_t);
-  FIELD(pwd->pw_class);
-  FIELD(pwd->pw_gecos);
-  FIELD(pwd->pw_dir);
-  FIELD(pwd->pw_shell);
-  memcpy(&pwd->pw_expire, buffer, sizeof(time_t));
-  db->close(db);
-  return pwd;
-}
-
-#else /* HAVE_MASTER_PASSWD */
+  strcpy(buffer, line);
 
-static struct passwd *lookup(const char *username, uid_t uid);
-
-struct passwd *al__getpwnam(const char *username)
-{
-  /* Paranoia: don't find an empty username. */
-  if (!*username)
-    return NULL;
-  return lookup(username, 0);
-}
-
-struct passwd *al__getpwuid(uid_t uid)
-{
-  return lookup(NULL, uid);
-}
-
-/* If username is NULL, it's a lookup by uid; otherwise it's by name. */
-static struct passwd *lookup(const char *username, uid_t uid)
-{
-  /* BSD 4.3 has /etc/passwd and /etc/passwd.{dir,pag}.  Only implement
-   * reading /etc/passwd, since the DBM routines aren't reentrant and
-   * we don't really need that level of performance in the login system
-   * anyway. */
-  FILE *fp;
-  int linesize, len = (username) ? strlen(username) : 0;
-  struct passwd *pwd;
-  char *line = NULL, *buffer;
-  const char *p;
-
-  fp = fopen(PATH_PASSWD, "r");
-  if (!fp)
-    return NULL;
-
-  while (al__read_line(fp, &line, &linesize) == 0)
+  /* Split the line into its seven fields. */
+  for (i = 0, p = buffer; i < 6; i++)
     {
-      /* See if we got the right entry. */
-      if (username && (strncmp(line, username, len) != 0 || line[len] != ':'))
-	continue;
-      if (!username)
-	{
-	  p = strchr(line, ':');
-	  if (p)
-	    p = strchr(p + 1, ':');
-	  if (!p || atoi(p + 1) != uid)
-	    continue;
-	}
-
-      /* Allocate space for the return value. */
-      buffer = malloc(sizeof(struct passwd) + strlen(line) + 1);
-      if (!buffer)
+      p = strchr(p, ':');
+      if (!p)
 	{
-	  free(line);
-	  fclose(fp);
+	  free(pwd);
 	  return NULL;
 	}
-      pwd = (struct passwd *) buffer;
-      buffer += sizeof(struct passwd);
-      strcpy(buffer, line);
+      *p++ = 0;
+    }
+  if (strchr(p, ':'))
+    {
+      free(pwd);
+      return NULL;
+    }
 
+  pwd->pw_name = buffer;
+  buffer += strlen(buffer) + 1;
+  pwd->pw_passwd = buffer;
+  buffer += strlen(buffer) + 1;
+  if (!isdigit((unsigned char)*buffer))
+    {
+      free(pwd);
+      return NULL;
+    }
+  pwd->pw_uid = atoi(buffer);
+  buffer += strlen(buffer) + 1;
+  if (!isdigit((unsigned char)*buffer))
+    {
+      free(pwd);
+      return NULL;
+    }
+  pwd->pw_gid = atoi(buffer);
+  buffer += strlen(buffer) + 1;
+  pwd->pw_gecos = buffer;
+  buffer += strlen(buffer) + 1;
+  pwd->pw_dir = buffer;
+  buffer += strlen(buffer) + 1;
+  pwd->pw_shell = buffer;
+#ifdef HAVE_MASTER_PASSWD
+  pwd->pw_class = "";
+#endif
 #if defined(BSD) || defined(ultrix)
-      pwd->pw_quota = 0;
-      pwd->pw_comment = "";
+  pwd->pw_comment = "";
 #endif
-
-      /* Set the fields of the returned structure. */
-#define BAD_LINE	{ free(pwd); break; }
-#define NEXT_FIELD	{ buffer = strchr(buffer, ':'); \
-	if (!buffer) BAD_LINE; *buffer++ = 0; }
-#define FIELD(v)	{ v = buffer; NEXT_FIELD; }
-      FIELD(pwd->pw_name);
-      FIELD(pwd->pw_passwd);
-      if (!isdigit((unsigned char)*buffer))
-	BAD_LINE;
-      pwd->pw_uid = atoi(buffer);
-      NEXT_FIELD;
-      if (!isdigit((unsigned char)*buffer))
-	BAD_LINE;
-      pwd->pw_gid = atoi(buffer);
-      NEXT_FIELD;
-      FIELD(pwd->pw_gecos);
-      FIELD(pwd->pw_dir);
-      pwd->pw_shell = buffer;
-      buffer[strlen(buffer) - 1] = 0;
-      fclose(fp);
-      free(line);
-      return pwd;
-    }
-
-  /* We lost. */
-  free(line);
-  fclose(fp);
-  return NULL;
-}
-#endif /* HAVE_MASTER_PASSWD */
-
-void al__free_passwd(struct passwd *pwd)
-{
-  free(pwd);
+  return pwd;
 }
 
 /* This is an internal function.  Its contract is to read a line from a
@@ -322,3 +210,187 @@ int al__username_valid(const char *username)
     }
   return 1;
 }
+
+/* Return a 32-bit FNV-1a hash of username, for spreading session
+ * records across slots or directories. */
+unsigned int al__hash_name(const char *username)
+{
+  unsigned int h = 2166136261U;
+
+  for (; *username; username++)
+    {
+      h ^= (unsigned char) *username;
+      h = (h * 16777619U) & 0xffffffffU;
+    }
+  return h;
+}
+
+/* This is an internal function.  Its contract is to return the start
+ * time of process pid, in clock ticks since boot, from field 22 of
+ * /proc/<pid>/stat, or 0 if it cannot be read.  Together with the pid,
+ * the start time identifies a process even if the pid is reused.
+ */
+unsigned long long al__pid_start_time(pid_t pid)
+{
+  char path[64], buf[1024], *p;
+  ssize_t len;
+  int fd, field;
+
+  sprintf(path, "%s/%lu/stat", PATH_PROC, (unsigned long) pid);
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  do
+    len = read(fd, buf, sizeof(buf) - 1);
+  while (len == -1 && errno == EINTR);
+  close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = 0;
+
+  /* The command name in field 2 may contain spaces and parentheses, so
+   * count fields from the last parenthesis.
+   */
+  p = strrchr(buf, ')');
+  if (!p)
+    return 0;
+  for (field = 2; field < 22; field++)
+    {
+      p = strchr(p + 1, ' ');
+      if (!p)
+	return 0;
+    }
+  return strtoull(p + 1, NULL, 10);
+}
+
+/* This is an internal function.  Its contract is to return true if
+ * process pid exists and, if start is not 0 and the process's start
+ * time can be read, started at time start.
+ */
+int al__pid_alive(pid_t pid, unsigned long long start)
+{
+  unsigned long long now;
+
+  if (kill(pid, 0) != 0)
+    return 0;
+  if (start == 0)
+    return 1;
+  now = al__pid_start_time(pid);
+  return (now == 0 || now == start);
+}
+
+/* This is an internal function.  Its contract is to return true if
+ * the "threads" parameter is set, meaning that several threads of the
+ * calling process may use the library at once.  Threads mode relies on
+ * open file description locks, so on systems without them the
+ * parameter is ignored.
+ */
+int al__threaded(void)
+{
+#ifdef F_OFD_SETLKW
+  return al__config_bool("threads", 0);
+#else
+  return 0;
+#endif
+}
+
+/* This is an internal function.  Its contract is to apply lock type
+ * (F_RDLCK, F_WRLCK, or F_UNLCK) to len bytes of fd starting at start,
+ * where a len of 0 extends to the end of the file, waiting for a
+ * conflicting lock to be released if wait is set.  In threads mode,
+ * open file description locks are used; these belong to the descriptor
+ * rather than the process, so threads using separate descriptors
+ * exclude each other, and closing another descriptor for the file does
+ * not release them.  It returns 0 on
+ * success or -1 with errno set.
+ */
+int al__lock_fd(int fd, off_t start, off_t len, int type, int wait)
+{
+  struct flock fl;
+  int cmd = (wait) ? F_SETLKW : F_SETLK;
+
+  /* Open file description locks require l_pid to be zero. */
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+#ifdef F_OFD_SETLKW
+  if (al__threaded())
+    cmd = (wait) ? F_OFD_SETLKW : F_OFD_SETLK;
+#endif
+  while (fcntl(fd, cmd, &fl) == -1)
+    {
+      if (errno != EINTR)
+	return -1;
+    }
+  return 0;
+}
+
+/* This is an internal function.  Its contract is to return true if
+ * another process, or in threads mode another descriptor, holds a lock
+ * on len bytes of fd starting at start.  If the test fails, the lock is
+ * taken to be held.
+ */
+int al__lock_held(int fd, off_t start, off_t len)
+{
+  struct flock fl;
+  int cmd = F_GETLK;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+#ifdef F_OFD_GETLK
+  if (al__threaded())
+    cmd = F_OFD_GETLK;
+#endif
+  if (fcntl(fd, cmd, &fl) == -1)
+    return 1;
+  return fl.l_type != F_UNLCK;
+}
+
+/* This is an internal function.  Its contract is to return true if
+ * the calling process holds a POSIX lock on fd, which closing fd would
+ * release.  A POSIX lock test ignores the caller's own locks while an
+ * open file description lock test does not, so a lock seen only by the
+ * latter is the caller's.  Without open file description locks it
+ * always returns false.
+ */
+int al__lock_owned(int fd)
+{
+#ifdef F_OFD_GETLK
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  if (fcntl(fd, F_GETLK, &fl) == -1 || fl.l_type != F_UNLCK)
+    return 0;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  return (fcntl(fd, F_OFD_GETLK, &fl) == 0 && fl.l_type != F_UNLCK);
+#else
+  return 0;
+#endif
+}
+
+/* This is an internal function.  Its contract is to flush the data
+ * written to fd, and the metadata needed to read it back, to stable
+ * storage, returning 0 on success or -1 on failure.
+ */
+int al__sync_fd(int fd)
+{
+  int retval;
+
+  do
+#ifdef HAVE_FDATASYNC
+    retval = fdatasync(fd);
+#else
+    retval = fsync(fd);
+#endif
+  while (retval == -1 && errno == EINTR);
+  return retval;
+}